@@ -6,12 +6,13 @@
     See the file COPYING.
 */
 
-#include <stdlib.h> /* realloc(), exit() */
+#include <stdlib.h> /* realloc(), malloc(), free(), exit() */
 #include <string.h> /* memcpy() */
 #include <stdio.h>  /* stderr, fprintf() */
 
 #include <stdint.h> /* <uint8_t> */
 #include <unistd.h> /* <off_t> */
+#include <sys/uio.h> /* <struct iovec> */
 
 #include "buffer.h"
 
@@ -57,3 +58,124 @@ void buf_null_terminate(struct buffer *buf) {
   if (buf_add_mem(buf, "\0", 1) == -1)
     exit(1);
 }
+
+void ring_init(struct ring *ring) {
+  ring->p            = NULL;
+  ring->len          = 0;
+  ring->size         = 0;
+  ring->head         = 0;
+  ring->begin_offset = 0;
+}
+
+void ring_free(struct ring *ring) {
+  free(ring->p);
+}
+
+/* Empties the ring but keeps its memory around for the next stream */
+void ring_clear(struct ring *ring) {
+  ring->len          = 0;
+  ring->head         = 0;
+  ring->begin_offset = 0;
+}
+
+/* Makes room for at least size bytes in total */
+int ring_reserve(struct ring *ring, size_t size) {
+  uint8_t *p;
+
+  if (size <= ring->size)
+    return 0;
+
+  size = (size + 63) & ~31;
+  p = malloc(size);
+  if (!p) {
+    fprintf(stderr, "ftpfs: memory allocation failed\n");
+    return -1;
+  }
+
+  ring_copy(ring, 0, p, ring->len);
+  free(ring->p);
+  ring->p    = p;
+  ring->size = size;
+  ring->head = 0;
+
+  return 0;
+}
+
+size_t ring_space(const struct ring *ring) {
+  return ring->size - ring->len;
+}
+
+/* Grows the ring if the data doesn't fit */
+int ring_add_mem(struct ring *ring, const void *data, size_t len) {
+  size_t tail, first;
+
+  if (len == 0)
+    return 0;
+
+  if (len > ring_space(ring)) {
+    size_t want = ring->size * 2;
+    if (want < ring->len + len)
+      want = ring->len + len;
+    if (ring_reserve(ring, want) == -1)
+      return -1;
+  }
+
+  tail  = (ring->head + ring->len) % ring->size;
+  first = ring->size - tail;
+  if (first > len)
+    first = len;
+
+  memcpy(ring->p + tail, data, first);
+  memcpy(ring->p, (const uint8_t *) data + first, len - first);
+  ring->len += len;
+
+  return 0;
+}
+
+/* Copies len bytes starting pos bytes after the oldest one */
+void ring_copy(const struct ring *ring, size_t pos, void *dst, size_t len) {
+  size_t start, first;
+
+  if (len == 0)
+    return;
+
+  start = (ring->head + pos) % ring->size;
+  first = ring->size - start;
+  if (first > len)
+    first = len;
+
+  memcpy(dst, ring->p + start, first);
+  memcpy((uint8_t *) dst + first, ring->p, len - first);
+}
+
+/* Forgets the len oldest bytes */
+void ring_drop(struct ring *ring, size_t len) {
+  if (len > ring->len)
+    len = ring->len;
+
+  ring->len          -= len;
+  ring->begin_offset += len;
+  ring->head          = ring->len ? (ring->head + len) % ring->size : 0;
+}
+
+int ring_iov(const struct ring *ring, size_t pos, size_t len,
+             struct iovec iov[2]) {
+  size_t start, first;
+
+  if (len == 0)
+    return 0;
+
+  start = (ring->head + pos) % ring->size;
+  first = ring->size - start;
+  if (first >= len) {
+    iov[0].iov_base = ring->p + start;
+    iov[0].iov_len  = len;
+    return 1;
+  }
+
+  iov[0].iov_base = ring->p + start;
+  iov[0].iov_len  = first;
+  iov[1].iov_base = ring->p;
+  iov[1].iov_len  = len - first;
+  return 2;
+}
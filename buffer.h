@@ -22,4 +22,30 @@ void buf_clear(struct buffer *buf);
 int  buf_add_mem(struct buffer *buf, const void *data, size_t len);
 void buf_null_terminate(struct buffer *buf);
 
+/* A FIFO for data we only stream through. It wraps around instead of
+ * moving its contents, and only reallocates when asked to hold more than
+ * it ever has, so a steady stream costs no allocations at all.
+ * begin_offset is the file offset of the oldest byte held. */
+struct ring {
+  uint8_t *p;
+  size_t   len;
+  size_t   size;
+  size_t   head;
+  off_t    begin_offset;
+};
+
+void   ring_init(struct ring *ring);
+void   ring_free(struct ring *ring);
+void   ring_clear(struct ring *ring);
+int    ring_reserve(struct ring *ring, size_t size);
+size_t ring_space(const struct ring *ring);
+int    ring_add_mem(struct ring *ring, const void *data, size_t len);
+void   ring_copy(const struct ring *ring, size_t pos, void *dst, size_t len);
+void   ring_drop(struct ring *ring, size_t len);
+/* Points iov at len bytes from pos without copying; returns how many of
+ * the two entries it used */
+struct iovec;
+int    ring_iov(const struct ring *ring, size_t pos, size_t len,
+                struct iovec iov[2]);
+
 #endif
@@ -7,35 +7,135 @@
 */
 
 #include "cache.h"
+#include "stats.h"
+#include "path_utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <glib.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/* Paths are spread over shards by their hash so that lookups of
+ * unrelated paths don't wait on each other. Each shard keeps its nodes in
+ * the order they were last used. The least recently used ones go first
+ * when the shard is over its share of the limits, and since they are
+ * also the ones most likely to have expired, cleaning only ever looks at
+ * the oldest few. */
+struct cache_shard {
+    pthread_mutex_t lock;
+    GHashTable *table;
+    GQueue lru;
+    size_t mem;
+};
+
+/* A snapshot is a header, the records sorted by path and then the
+ * strings they point to. Offsets are from the start of the file. */
+#define SNAPSHOT_MAGIC "CFSSNAP1"
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t count;
+    uint32_t pad;
+    uint64_t source;  /* hash of what the cache is a cache of */
+    int64_t saved;
+};
+
+#define SNAPSHOT_STAT      1
+#define SNAPSHOT_NOT_FOUND 2
+#define SNAPSHOT_DIR       4
+#define SNAPSHOT_LINK      8
+
+struct snapshot_record {
+    uint64_t path;
+    uint64_t dir;     /* dir_count NUL terminated names, one after another */
+    uint64_t link;
+    int64_t updated;
+    int64_t atime, mtime, ctime;
+    uint64_t size, blocks;
+    uint32_t mode, nlink, uid, gid, blksize;
+    uint32_t path_len, dir_count, link_len;
+    uint32_t flags;
+    uint32_t pad;
+};
+
+struct snapshot {
+    const char *map;
+    size_t size;
+    const struct snapshot_record *records;
+    uint32_t count;
+    /* Set once a record has been taken into the cache, or dropped. One
+     * byte each, since records of different shards sit side by side. */
+    unsigned char *used;
+};
+
+/* A listing to fetch in the background: one that was served although
+ * it had expired, or the subdirectory of one that was just fetched */
+struct cache_job {
+    char *path;
+    int prefetch;
+    unsigned depth;     /* levels of subdirectories to prefetch from it */
+};
+
+struct cache_refresh {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    GQueue queue;           /* jobs waiting, oldest first */
+    GHashTable *pending;    /* owns them, and the ones being done */
+    pthread_t *threads;
+    unsigned started;
+    int stop;
+};
 
 struct cache {
     int on;
-    unsigned stat_timeout;
-    unsigned dir_timeout;
-    unsigned link_timeout;
+    /* In seconds as given, and then in milliseconds */
+    double stat_timeout;
+    double dir_timeout;
+    double link_timeout;
+    double stale_timeout;
+    int64_t stat_ms;
+    int64_t dir_ms;
+    int64_t link_ms;
+    int64_t stale_ms;
+    unsigned prefetch_depth;
+    unsigned prefetch_conns;
+    unsigned max_entries;
+    unsigned max_mem;   /* MiB */
+    size_t shard_entries;
+    size_t shard_mem;
+    char *snapshot_file;
+    unsigned snapshot_age;
+    uint64_t source;
+    struct snapshot snapshot;
+    struct cache_refresh refresh;
     struct fuse_cache_operations *next_oper;
-    GHashTable *table;
-    pthread_mutex_t lock;
-    time_t last_cleaned;
+    struct cache_shard shards[CACHE_SHARDS];
 };
 
 static struct cache cache;
 
+/* Validity is in cache_now() milliseconds */
 struct node {
     struct stat stat;
     int not_found;
-    time_t stat_valid;
+    int64_t stat_valid;
     char **dir;
-    time_t dir_valid;
+    char **dir_sorted;  /* the same names, for looking them up */
+    size_t dir_len;
+    int64_t dir_valid;
     char *link;
-    time_t link_valid;
-    time_t valid;
+    int64_t link_valid;
+    int64_t valid;
+    time_t updated; /* when the server last told us anything about it */
+    char *path;     /* the key in the shard's table */
+    GList lru;      /* link in the shard's LRU queue */
+    size_t mem;     /* bytes held by the node, as counted in the shard */
 };
 
 struct fuse_cache_dirhandle {
@@ -43,45 +143,112 @@ struct fuse_cache_dirhandle {
     fuse_dirh_t h;
     fuse_dirfil_t filler;
     GPtrArray *dir;
+    GPtrArray *subdirs; /* full paths, if they are to be prefetched */
 };
 
 static void free_node(gpointer node_)
 {
     struct node *node = (struct node *) node_;
     g_strfreev(node->dir);
+    g_free(node->dir_sorted);
     g_free(node->link);
+    g_free(node->path);
     g_free(node);
 }
 
-static int cache_clean_entry(void *key_, struct node *node, time_t *now)
+/* Milliseconds on a clock that doesn't jump with the time of day. The
+ * coarse one is good to a few milliseconds and is read without a system
+ * call, which is what lookups want. */
+int64_t cache_now(void)
 {
-    (void) key_;
-    if (*now > node->valid)
-        return TRUE;
-    else
-        return FALSE;
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+        return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct cache_shard *cache_shard(const char *path)
+{
+    /* Take the top bits, the table itself goes by the bottom ones */
+    guint hash = g_str_hash(path) * 2654435761U;
+    return &cache.shards[hash >> (32 - CACHE_SHARD_BITS)];
+}
+
+static void cache_remove(struct cache_shard *shard, struct node *node)
+{
+    g_queue_unlink(&shard->lru, &node->lru);
+    shard->mem -= node->mem;
+    g_hash_table_remove(shard->table, node->path);
+}
+
+/* Moves a node that was just used to the new end of the queue */
+static void cache_touch(struct cache_shard *shard, struct node *node)
+{
+    g_queue_unlink(&shard->lru, &node->lru);
+    g_queue_push_tail_link(&shard->lru, &node->lru);
+}
+
+/* Records that a node now holds bytes more, or fewer if negative */
+static void cache_account(struct cache_shard *shard, struct node *node,
+                          ssize_t bytes)
+{
+    node->mem += bytes;
+    shard->mem += bytes;
 }
 
-static void cache_clean(void)
+static int cache_over_limit(struct cache_shard *shard)
 {
-    time_t now = time(NULL);
-    if (now > cache.last_cleaned + MIN_CACHE_CLEAN_INTERVAL &&
-         (g_hash_table_size(cache.table) > MAX_CACHE_SIZE ||
-          now > cache.last_cleaned + CACHE_CLEAN_INTERVAL)) {
-        g_hash_table_foreach_remove(cache.table,
-                                    (GHRFunc) cache_clean_entry, &now);
-        cache.last_cleaned = now;
+    return (cache.shard_entries &&
+            g_queue_get_length(&shard->lru) > cache.shard_entries) ||
+           (cache.shard_mem && shard->mem > cache.shard_mem);
+}
+
+/* Drops nodes from the old end of the queue: as many as it takes to get
+ * within the limits, and a few more if they have expired. The node used
+ * last always stays, however big it is. */
+static void cache_clean(struct cache_shard *shard)
+{
+    int64_t now = cache_now();
+    int expired = 0;
+
+    while (g_queue_get_length(&shard->lru) > 1) {
+        GList *oldest = g_queue_peek_head_link(&shard->lru);
+        struct node *node = (struct node *) oldest->data;
+
+        if (!cache_over_limit(shard)) {
+            if (expired == CACHE_CLEAN_BATCH ||
+                node->valid + cache.stale_ms - now >= 0)
+                break;
+            expired++;
+        }
+        cache_remove(shard, node);
     }
 }
 
-static struct node *cache_lookup(const char *path)
+static struct node *cache_restore(struct cache_shard *shard,
+                                  const char *path);
+
+static struct node *cache_lookup(struct cache_shard *shard, const char *path)
 {
-    return (struct node *) g_hash_table_lookup(cache.table, path);
+    struct node *node = g_hash_table_lookup(shard->table, path);
+    if (node == NULL && cache.snapshot.map != NULL)
+        node = cache_restore(shard, path);
+    return node;
 }
 
 static void cache_purge(const char *path)
 {
-    g_hash_table_remove(cache.table, path);
+    struct cache_shard *shard = cache_shard(path);
+    struct node *node;
+
+    pthread_mutex_lock(&shard->lock);
+    node = cache_lookup(shard, path);
+    if (node != NULL)
+        cache_remove(shard, node);
+    pthread_mutex_unlock(&shard->lock);
 }
 
 static void cache_purge_parent(const char *path)
@@ -89,7 +256,7 @@ static void cache_purge_parent(const char *path)
     const char *s = strrchr(path, '/');
     if (s) {
         if (s == path)
-            g_hash_table_remove(cache.table, "/");
+            cache_purge("/");
         else {
             char *parent = g_strndup(path, s - path);
             cache_purge(parent);
@@ -100,77 +267,126 @@ static void cache_purge_parent(const char *path)
 
 static void cache_invalidate(const char *path)
 {
-    pthread_mutex_lock(&cache.lock);
     cache_purge(path);
-    pthread_mutex_unlock(&cache.lock);
 }
 
 static void cache_invalidate_dir(const char *path)
 {
-    pthread_mutex_lock(&cache.lock);
     cache_purge(path);
     cache_purge_parent(path);
-    pthread_mutex_unlock(&cache.lock);
 }
 
 static void cache_do_rename(const char *from, const char *to)
 {
-    pthread_mutex_lock(&cache.lock);
     cache_purge(from);
     cache_purge(to);
     cache_purge_parent(from);
     cache_purge_parent(to);
-    pthread_mutex_unlock(&cache.lock);
 }
 
-static struct node *cache_get(const char *path)
+/* Finds or makes the node of path, for an update that is about to extend
+ * its validity, and moves it to the new end of the queue */
+static struct node *cache_new_node(struct cache_shard *shard,
+                                   const char *path)
 {
-    struct node *node = cache_lookup(path);
-    if (node == NULL) {
-        char *pathcopy = g_strdup(path);
-        node = g_new0(struct node, 1);
-        g_hash_table_insert(cache.table, pathcopy, node);
-    }
+    size_t len = strlen(path);
+    struct node *node = g_new0(struct node, 1);
+    node->path = g_strndup(path, len);
+    node->lru.data = node;
+    g_hash_table_insert(shard->table, node->path, node);
+    g_queue_push_tail_link(&shard->lru, &node->lru);
+    cache_account(shard, node, sizeof(struct node) + len + 1);
+    return node;
+}
+
+static struct node *cache_get(struct cache_shard *shard, const char *path)
+{
+    struct node *node = cache_lookup(shard, path);
+    if (node == NULL)
+        node = cache_new_node(shard, path);
+    else
+        cache_touch(shard, node);
     return node;
 }
 
+/* What a listing costs: the names and both arrays of pointers to them */
+static size_t dir_mem(char **dir, size_t len)
+{
+    size_t mem = (2 * len + 1) * sizeof(char *);
+    for (; *dir != NULL; dir++)
+        mem += strlen(*dir) + 1;
+    return mem;
+}
+
 void cache_add_attr(const char *path, const struct stat *stbuf)
 {
+    struct cache_shard *shard = cache_shard(path);
     struct node *node;
-    time_t now;
+    int64_t now;
 
-    pthread_mutex_lock(&cache.lock);
-    node = cache_get(path);
-    now = time(NULL);
+    pthread_mutex_lock(&shard->lock);
+    node = cache_get(shard, path);
+    now = cache_now();
+    node->updated = time(NULL);
     if (stbuf) {
       node->stat = *stbuf;
       node->not_found = 0;
     } else {
       node->not_found = 1;
     }
-    node->stat_valid = now + cache.stat_timeout;
+    node->stat_valid = now + cache.stat_ms;
     if (node->stat_valid > node->valid)
         node->valid = node->stat_valid;
-    cache_clean();
-    pthread_mutex_unlock(&cache.lock);
+    cache_clean(shard);
+    pthread_mutex_unlock(&shard->lock);
 }
 
-void cache_add_dir(const char *path, char **dir)
+static int cache_name_cmp(const void *a, const void *b)
 {
-    struct node *node;
-    time_t now;
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static char **dir_sort(char **dir, size_t len)
+{
+    char **sorted = g_new(char *, len);
+    memcpy(sorted, dir, len * sizeof(char *));
+    qsort(sorted, len, sizeof(char *), cache_name_cmp);
+    return sorted;
+}
 
-    pthread_mutex_lock(&cache.lock);
-    node = cache_get(path);
-    now = time(NULL);
+/* Gives the node a listing that was sorted with dir_sort() */
+static void cache_set_dir(struct cache_shard *shard, struct node *node,
+                          char **dir, char **sorted, size_t len)
+{
+    if (node->dir)
+        cache_account(shard, node, -(ssize_t) dir_mem(node->dir, node->dir_len));
+    cache_account(shard, node, dir_mem(dir, len));
     g_strfreev(node->dir);
+    g_free(node->dir_sorted);
     node->dir = dir;
+    node->dir_sorted = sorted;
+    node->dir_len = len;
+}
+
+void cache_add_dir(const char *path, char **dir)
+{
+    struct cache_shard *shard = cache_shard(path);
+    struct node *node;
+    int64_t now;
+    size_t len = g_strv_length(dir);
+    char **sorted = dir_sort(dir, len);
+
+    pthread_mutex_lock(&shard->lock);
+    node = cache_get(shard, path);
+    now = cache_now();
+    node->updated = time(NULL);
+    cache_set_dir(shard, node, dir, sorted, len);
     node->not_found = 0;
-    node->dir_valid = now + cache.dir_timeout;
+    node->dir_valid = now + cache.dir_ms;
     if (node->dir_valid > node->valid)
         node->valid = node->dir_valid;
-    cache_clean();
-    pthread_mutex_unlock(&cache.lock);
+    cache_clean(shard);
+    pthread_mutex_unlock(&shard->lock);
 }
 
 static size_t my_strnlen(const char *s, size_t maxsize)
@@ -182,30 +398,39 @@ static size_t my_strnlen(const char *s, size_t maxsize)
 
 void cache_add_link(const char *path, const char *link, size_t size)
 {
+    struct cache_shard *shard = cache_shard(path);
     struct node *node;
-    time_t now;
+    int64_t now;
 
-    pthread_mutex_lock(&cache.lock);
-    node = cache_get(path);
-    now = time(NULL);
+    pthread_mutex_lock(&shard->lock);
+    node = cache_get(shard, path);
+    now = cache_now();
+    node->updated = time(NULL);
+    if (node->link)
+        cache_account(shard, node, -(ssize_t) (strlen(node->link) + 1));
     g_free(node->link);
     node->link = g_strndup(link, my_strnlen(link, size-1));
+    cache_account(shard, node, strlen(node->link) + 1);
     node->not_found = 0;
-    node->link_valid = now + cache.link_timeout;
+    node->link_valid = now + cache.link_ms;
     if (node->link_valid > node->valid)
         node->valid = node->link_valid;
-    cache_clean();
-    pthread_mutex_unlock(&cache.lock);
+    cache_clean(shard);
+    pthread_mutex_unlock(&shard->lock);
 }
 
-static int cache_get_attr(const char *path, struct stat *stbuf)
+int cache_get_attr(const char *path, struct stat *stbuf)
 {
+    struct cache_shard *shard;
     struct node *node;
     int err = -EAGAIN;
-    pthread_mutex_lock(&cache.lock);
-    node = cache_lookup(path);
+    if (!cache.on)
+        return err;
+    shard = cache_shard(path);
+    pthread_mutex_lock(&shard->lock);
+    node = cache_lookup(shard, path);
     if (node != NULL) {
-        time_t now = time(NULL);
+        int64_t now = cache_now();
         if (node->stat_valid - now >= 0) {
             if (node->not_found) {
               err = -ENOENT;
@@ -213,42 +438,134 @@ static int cache_get_attr(const char *path, struct stat *stbuf)
               *stbuf = node->stat;
               err = 0;
             }
+            cache_touch(shard, node);
         }
     }
-    pthread_mutex_unlock(&cache.lock);
+    pthread_mutex_unlock(&shard->lock);
+    return err;
+}
+
+/* NULL for the root */
+static char *cache_parent(const char *path, const char **name)
+{
+    const char *s = strrchr(path, '/');
+    if (s == NULL || s[1] == '\0')
+        return NULL;
+    *name = s + 1;
+    return s == path ? g_strdup("/") : g_strndup(path, s - path);
+}
+
+/* True if the listing of the parent is cached and doesn't have path */
+static int cache_parent_lacks(const char *path)
+{
+    struct cache_shard *shard;
+    struct node *node;
+    const char *name;
+    char *parent = cache_parent(path, &name);
+    int lacks = 0;
+
+    if (parent == NULL)
+        return 0;
+
+    shard = cache_shard(parent);
+    pthread_mutex_lock(&shard->lock);
+    node = cache_lookup(shard, parent);
+    if (node != NULL && node->dir_sorted != NULL) {
+        int64_t now = cache_now();
+        if (node->dir_valid - now >= 0) {
+            lacks = bsearch(&name, node->dir_sorted, node->dir_len,
+                            sizeof(char *), cache_name_cmp) == NULL;
+            cache_touch(shard, node);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    g_free(parent);
+    return lacks;
+}
+
+static int cache_queue(const char *path, int prefetch, unsigned depth);
+
+/* Like cache_get_attr(), but for what has expired no longer ago than
+ * cache_stale_timeout. Listing the parent again brings it up to date,
+ * along with whatever else is in there. */
+static int cache_get_stale_attr(const char *path, struct stat *stbuf)
+{
+    struct cache_shard *shard;
+    struct node *node;
+    const char *name;
+    char *parent;
+    struct stat stat;
+    int err = -EAGAIN;
+
+    if (!cache.stale_ms)
+        return err;
+    shard = cache_shard(path);
+    pthread_mutex_lock(&shard->lock);
+    node = cache_lookup(shard, path);
+    if (node != NULL && node->stat_valid + cache.stale_ms - cache_now() >= 0) {
+        err = node->not_found ? -ENOENT : 0;
+        stat = node->stat;
+        cache_touch(shard, node);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (err == -EAGAIN)
+        return err;
+
+    parent = cache_parent(path, &name);
+    if (parent == NULL || cache_queue(parent, 0, 0) == -1)
+        err = -EAGAIN;
+    else if (!err)
+        *stbuf = stat;
+    g_free(parent);
     return err;
 }
 
 static int cache_getattr(const char *path, struct stat *stbuf)
 {
     int err = cache_get_attr(path, stbuf);
-    if (err == -EAGAIN) {
-        err = cache.next_oper->oper.getattr(path, stbuf);
-        if (!err)
-            cache_add_attr(path, stbuf);
-        else if (err == -ENOENT)
-            cache_add_attr(path, NULL);
+    if (err != -EAGAIN) {
+        stats_add(STATS_STAT_HIT, 1);
+        return err;
+    }
+    if (cache_parent_lacks(path)) {
+        stats_add(STATS_STAT_NEGATIVE, 1);
+        return -ENOENT;
     }
+    err = cache_get_stale_attr(path, stbuf);
+    if (err != -EAGAIN) {
+        stats_add(STATS_STAT_STALE, 1);
+        return err;
+    }
+    stats_add(STATS_STAT_MISS, 1);
+    err = cache.next_oper->oper.getattr(path, stbuf);
+    if (!err)
+        cache_add_attr(path, stbuf);
+    else if (err == -ENOENT)
+        cache_add_attr(path, NULL);
     return err;
 }
 
 static int cache_readlink(const char *path, char *buf, size_t size)
 {
+    struct cache_shard *shard = cache_shard(path);
     struct node *node;
     int err;
 
-    pthread_mutex_lock(&cache.lock);
-    node = cache_lookup(path);
+    pthread_mutex_lock(&shard->lock);
+    node = cache_lookup(shard, path);
     if (node != NULL) {
-        time_t now = time(NULL);
+        int64_t now = cache_now();
         if (node->link_valid - now >= 0) {
             strncpy(buf, node->link, size-1);
             buf[size-1] = '\0';
-            pthread_mutex_unlock(&cache.lock);
+            cache_touch(shard, node);
+            pthread_mutex_unlock(&shard->lock);
+            stats_add(STATS_LINK_HIT, 1);
             return 0;
         }
     }
-    pthread_mutex_unlock(&cache.lock);
+    pthread_mutex_unlock(&shard->lock);
+    stats_add(STATS_LINK_MISS, 1);
     err = cache.next_oper->oper.readlink(path, buf, size);
     if (!err)
         cache_add_link(path, buf, size);
@@ -265,35 +582,45 @@ static int cache_dirfill(fuse_cache_dirh_t ch, const char *name,
         g_ptr_array_add(ch->dir, g_strdup(name));
         fullpath = g_strdup_printf("%s/%s", !ch->path[1] ? "" : ch->path, name);
         cache_add_attr(fullpath, stbuf);
-        g_free(fullpath);
+        /* Links are left alone, they may well lead back up the tree */
+        if (ch->subdirs && S_ISDIR(stbuf->st_mode) &&
+            strcmp(name, ".") && strcmp(name, ".."))
+            g_ptr_array_add(ch->subdirs, fullpath);
+        else
+            g_free(fullpath);
     }
     return err;
 }
 
-static int cache_getdir(const char *path, fuse_dirh_t h, fuse_dirfil_t filler)
+static int cache_dir_fresh(const char *path)
+{
+    struct cache_shard *shard = cache_shard(path);
+    struct node *node;
+    int fresh;
+
+    pthread_mutex_lock(&shard->lock);
+    node = cache_lookup(shard, path);
+    fresh = node != NULL && node->dir != NULL &&
+            node->dir_valid - cache_now() >= 0;
+    pthread_mutex_unlock(&shard->lock);
+    return fresh;
+}
+
+/* Lists path into the cache, and has the subdirectories in it listed in
+ * the background down to depth more levels */
+static int cache_fetch_dir(const char *path, fuse_dirh_t h,
+                           fuse_dirfil_t filler, unsigned depth)
 {
     struct fuse_cache_dirhandle ch;
     int err;
     char **dir;
-    struct node *node;
-
-    pthread_mutex_lock(&cache.lock);
-    node = cache_lookup(path);
-    if (node != NULL && node->dir != NULL) {
-        time_t now = time(NULL);
-        if (node->dir_valid - now >= 0) {
-            for(dir = node->dir; *dir != NULL; dir++)
-                filler(h, *dir, 0, 0);
-            pthread_mutex_unlock(&cache.lock);
-            return 0;
-        }
-    }
-    pthread_mutex_unlock(&cache.lock);
+    guint i;
 
     ch.path = path;
     ch.h = h;
     ch.filler = filler;
     ch.dir = g_ptr_array_new();
+    ch.subdirs = depth ? g_ptr_array_new() : NULL;
     err = cache.next_oper->cache_getdir(path, &ch, cache_dirfill);
     g_ptr_array_add(ch.dir, NULL);
     dir = (char **) ch.dir->pdata;
@@ -302,9 +629,162 @@ static int cache_getdir(const char *path, fuse_dirh_t h, fuse_dirfil_t filler)
     else
         g_strfreev(dir);
     g_ptr_array_free(ch.dir, FALSE);
+
+    if (ch.subdirs) {
+        for (i = 0; i < ch.subdirs->len; i++) {
+            char *subdir = g_ptr_array_index(ch.subdirs, i);
+            if (!err && !cache_dir_fresh(subdir))
+                cache_queue(subdir, 1, depth - 1);
+            g_free(subdir);
+        }
+        g_ptr_array_free(ch.subdirs, TRUE);
+    }
     return err;
 }
 
+static int cache_refresh_filler(fuse_dirh_t h, const char *name, int type,
+                                ino_t ino)
+{
+    (void) h;
+    (void) name;
+    (void) type;
+    (void) ino;
+    return 0;
+}
+
+static void *cache_refresh_worker(void *arg)
+{
+    struct cache_refresh *r = &cache.refresh;
+    (void) arg;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->stop) {
+        struct cache_job *job = g_queue_pop_head(&r->queue);
+        if (job == NULL) {
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&r->lock);
+        stats_add(job->prefetch ? STATS_DIR_PREFETCH : STATS_DIR_REFRESH, 1);
+        /* Don't go on serving what can't be had any more, the next
+         * access fetches it again and gets to see the error */
+        if (cache.next_oper->cache_getdir &&
+            cache_fetch_dir(job->path, NULL, cache_refresh_filler,
+                            job->depth) != 0)
+            cache_purge(job->path);
+        pthread_mutex_lock(&r->lock);
+        g_hash_table_remove(r->pending, job->path);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static void free_job(gpointer job_)
+{
+    struct cache_job *job = (struct cache_job *) job_;
+    g_free(job->path);
+    g_free(job);
+}
+
+static int cache_background(void)
+{
+    return cache.stale_ms || cache.prefetch_depth;
+}
+
+/* One worker per connection prefetching may use, and one at least for
+ * refreshing */
+static unsigned cache_workers(void)
+{
+    if (cache.prefetch_depth && cache.prefetch_conns)
+        return cache.prefetch_conns;
+    return 1;
+}
+
+/* Has the listing of path fetched in the background, unless it already
+ * is about to be. -1 if it can't be, and the caller had better fetch it
+ * itself. Prefetching only gets half of the queue so as not to crowd
+ * out refreshing. */
+static int cache_queue(const char *path, int prefetch, unsigned depth)
+{
+    struct cache_refresh *r = &cache.refresh;
+    struct cache_job *job;
+    unsigned max = prefetch ? CACHE_REFRESH_QUEUE / 2 : CACHE_REFRESH_QUEUE;
+    int err = 0;
+
+    pthread_mutex_lock(&r->lock);
+    if (g_hash_table_lookup(r->pending, path) != NULL)
+        goto out;
+    err = -1;
+    if (r->stop || g_queue_get_length(&r->queue) >= max)
+        goto out;
+    /* Started on first use, as threads don't survive daemonizing */
+    if (!r->started) {
+        unsigned n = cache_workers();
+        r->threads = g_new(pthread_t, n);
+        while (r->started < n &&
+               pthread_create(&r->threads[r->started], NULL,
+                              cache_refresh_worker, NULL) == 0)
+            r->started++;
+        if (!r->started)
+            goto out;
+    }
+    job = g_new(struct cache_job, 1);
+    job->path = g_strdup(path);
+    job->prefetch = prefetch;
+    job->depth = depth;
+    g_hash_table_insert(r->pending, job->path, job);
+    g_queue_push_tail(&r->queue, job);
+    pthread_cond_signal(&r->cond);
+    err = 0;
+out:
+    pthread_mutex_unlock(&r->lock);
+    return err;
+}
+
+static void cache_refresh_stop(void)
+{
+    struct cache_refresh *r = &cache.refresh;
+    unsigned i;
+    if (!cache_background())
+        return;
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    for (i = 0; i < r->started; i++)
+        pthread_join(r->threads[i], NULL);
+    g_free(r->threads);
+    r->threads = NULL;
+    r->started = 0;
+}
+
+static int cache_getdir(const char *path, fuse_dirh_t h, fuse_dirfil_t filler)
+{
+    struct cache_shard *shard = cache_shard(path);
+    char **dir;
+    struct node *node;
+
+    pthread_mutex_lock(&shard->lock);
+    node = cache_lookup(shard, path);
+    if (node != NULL && node->dir != NULL) {
+        int64_t now = cache_now();
+        int fresh = node->dir_valid - now >= 0;
+        if (fresh || (node->dir_valid + cache.stale_ms - now >= 0 &&
+                      cache_queue(path, 0, 0) == 0)) {
+            for(dir = node->dir; *dir != NULL; dir++)
+                filler(h, *dir, 0, 0);
+            cache_touch(shard, node);
+            pthread_mutex_unlock(&shard->lock);
+            stats_add(fresh ? STATS_DIR_HIT : STATS_DIR_STALE, 1);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    stats_add(STATS_DIR_MISS, 1);
+
+    return cache_fetch_dir(path, h, filler, cache.prefetch_depth);
+}
+
 static int cache_unity_dirfill(fuse_cache_dirh_t ch, const char *name,
                                const struct stat *stbuf)
 {
@@ -379,11 +859,28 @@ static int cache_link(const char *from, const char *to)
     return err;
 }
 
+/* The server has taken mode, so a stat we hold is still good with it */
+static void cache_set_mode(const char *path, mode_t mode)
+{
+    struct cache_shard *shard = cache_shard(path);
+    struct node *node;
+
+    pthread_mutex_lock(&shard->lock);
+    node = cache_lookup(shard, path);
+    if (node != NULL) {
+        if (!node->not_found && node->stat_valid - cache_now() >= 0)
+            node->stat.st_mode = (node->stat.st_mode & S_IFMT) | (mode & 07777);
+        else
+            cache_remove(shard, node);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
 static int cache_chmod(const char *path, mode_t mode)
 {
     int err = cache.next_oper->oper.chmod(path, mode);
     if (!err)
-        cache_invalidate(path);
+        cache_set_mode(path, mode);
     return err;
 }
 
@@ -454,11 +951,361 @@ static int cache_fgetattr(const char *path, struct stat *stbuf,
 }
 #endif
 
+/* FNV-1a 64 */
+static uint64_t snapshot_hash(const char *s)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char) *s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void cache_set_source(const char *source)
+{
+    cache.source = snapshot_hash(source);
+}
+
+/* The string at off, or NULL if it doesn't fit in the file */
+static const char *snapshot_string(uint64_t off, uint64_t len)
+{
+    struct snapshot *snap = &cache.snapshot;
+    if (off > snap->size || len >= snap->size - off ||
+        snap->map[off + len] != '\0')
+        return NULL;
+    return snap->map + off;
+}
+
+static int snapshot_cmp(const void *key, const void *rec_)
+{
+    const struct snapshot_record *rec = rec_;
+    const char *path = (const char *) key;
+    const char *name = snapshot_string(rec->path, rec->path_len);
+    return strcmp(path, name ? name : "");
+}
+
+static void snapshot_load(void)
+{
+    struct snapshot *snap = &cache.snapshot;
+    const struct snapshot_header *header;
+    struct stat st;
+    void *map;
+    int fd = open(cache.snapshot_file, O_RDONLY);
+
+    if (fd == -1)
+        return;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(*header)) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    header = map;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+        header->source != cache.source ||
+        header->count > (st.st_size - sizeof(*header)) /
+                        sizeof(struct snapshot_record)) {
+        fprintf(stderr, "ignoring cache snapshot %s\n", cache.snapshot_file);
+        munmap(map, st.st_size);
+        return;
+    }
+    snap->map = map;
+    snap->size = st.st_size;
+    snap->records = (const struct snapshot_record *) (header + 1);
+    snap->count = header->count;
+    snap->used = g_malloc0(snap->count);
+}
+
+/* When what the server said age_ms ago expires: after the rest of
+ * timeout_ms, or if that has run out, just now, so that it is served
+ * while being fetched again for up to cache_stale_timeout */
+static int64_t restored_valid(int64_t now, int64_t timeout_ms,
+                              int64_t age_ms)
+{
+    return timeout_ms > age_ms ? now + timeout_ms - age_ms : now - 1;
+}
+
+/* Builds the node for path from the snapshot the first time the cache is
+ * asked about it. Its validity goes by when the server said it, so what
+ * comes back after a restart gets checked again. */
+static struct node *cache_restore(struct cache_shard *shard,
+                                  const char *path)
+{
+    struct snapshot *snap = &cache.snapshot;
+    const struct snapshot_record *rec;
+    struct node *node;
+    int64_t now, age_ms;
+    time_t age;
+    size_t i;
+
+    rec = bsearch(path, snap->records, snap->count, sizeof(*rec),
+                  snapshot_cmp);
+    if (rec == NULL || snap->used[rec - snap->records])
+        return NULL;
+    snap->used[rec - snap->records] = 1;
+
+    age = time(NULL) - (time_t) rec->updated;
+    if (age > (time_t) cache.snapshot_age)
+        return NULL;
+    age_ms = age > 0 ? (int64_t) age * 1000 : 0;
+    now = cache_now();
+
+    node = cache_new_node(shard, path);
+    node->updated = rec->updated;
+    if (rec->flags & SNAPSHOT_STAT) {
+        node->stat.st_mode = rec->mode;
+        node->stat.st_nlink = rec->nlink;
+        node->stat.st_uid = rec->uid;
+        node->stat.st_gid = rec->gid;
+        node->stat.st_size = rec->size;
+        node->stat.st_blocks = rec->blocks;
+        node->stat.st_blksize = rec->blksize;
+        node->stat.st_atime = rec->atime;
+        node->stat.st_mtime = rec->mtime;
+        node->stat.st_ctime = rec->ctime;
+        node->not_found = !!(rec->flags & SNAPSHOT_NOT_FOUND);
+        node->stat_valid = restored_valid(now, cache.stat_ms, age_ms);
+    }
+    if (rec->flags & SNAPSHOT_DIR) {
+        char **dir = g_new0(char *, rec->dir_count + 1);
+        uint64_t off = rec->dir;
+        for (i = 0; i < rec->dir_count; i++) {
+            const char *name = off < snap->size ?
+                memchr(snap->map + off, '\0', snap->size - off) : NULL;
+            if (name == NULL)
+                break;
+            dir[i] = g_strdup(snap->map + off);
+            off = name - snap->map + 1;
+        }
+        cache_set_dir(shard, node, dir, dir_sort(dir, i), i);
+        node->dir_valid = restored_valid(now, cache.dir_ms, age_ms);
+    }
+    if (rec->flags & SNAPSHOT_LINK) {
+        const char *link = snapshot_string(rec->link, rec->link_len);
+        if (link != NULL) {
+            node->link = g_strdup(link);
+            cache_account(shard, node, rec->link_len + 1);
+            node->link_valid = restored_valid(now, cache.link_ms, age_ms);
+        }
+    }
+    node->valid = node->stat_valid;
+    if (node->dir_valid > node->valid)
+        node->valid = node->dir_valid;
+    if (node->link_valid > node->valid)
+        node->valid = node->link_valid;
+    return node;
+}
+
+/* What goes into a new snapshot: a node, or a record of the old snapshot
+ * that nobody asked about */
+struct snapshot_entry {
+    const char *path;
+    struct node *node;
+    const struct snapshot_record *rec;
+};
+
+static int snapshot_entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct snapshot_entry *) a)->path,
+                  ((const struct snapshot_entry *) b)->path);
+}
+
+static int snapshot_write(FILE *f, uint64_t *off, const char *s, size_t len)
+{
+    if (fwrite(s, 1, len + 1, f) != len + 1)
+        return -1;
+    *off += len + 1;
+    return 0;
+}
+
+static int snapshot_write_entry(FILE *f, uint64_t *off,
+                                const struct snapshot_entry *e,
+                                struct snapshot_record *rec)
+{
+    const struct node *node = e->node;
+    struct snapshot *snap = &cache.snapshot;
+    size_t i;
+
+    if (node == NULL) {
+        /* Copied as it was, strings and all */
+        const char *dir = snap->map + e->rec->dir;
+        size_t left = e->rec->dir < snap->size ? snap->size - e->rec->dir : 0;
+        const char *link = snapshot_string(e->rec->link, e->rec->link_len);
+        *rec = *e->rec;
+        rec->path = *off;
+        if (snapshot_write(f, off, e->path, rec->path_len))
+            return -1;
+        rec->dir = *off;
+        for (i = 0; i < rec->dir_count; i++) {
+            size_t len = my_strnlen(dir, left);
+            if (len == left)
+                break;
+            if (snapshot_write(f, off, dir, len))
+                return -1;
+            dir += len + 1;
+            left -= len + 1;
+        }
+        rec->dir_count = i;
+        if (link == NULL)
+            rec->flags &= ~SNAPSHOT_LINK;
+        rec->link = *off;
+        if ((rec->flags & SNAPSHOT_LINK) &&
+            snapshot_write(f, off, link, rec->link_len))
+            return -1;
+        return 0;
+    }
+
+    memset(rec, 0, sizeof(*rec));
+    rec->updated = node->updated;
+    if (node->stat_valid) {
+        rec->flags |= SNAPSHOT_STAT;
+        if (node->not_found)
+            rec->flags |= SNAPSHOT_NOT_FOUND;
+        rec->mode = node->stat.st_mode;
+        rec->nlink = node->stat.st_nlink;
+        rec->uid = node->stat.st_uid;
+        rec->gid = node->stat.st_gid;
+        rec->size = node->stat.st_size;
+        rec->blocks = node->stat.st_blocks;
+        rec->blksize = node->stat.st_blksize;
+        rec->atime = node->stat.st_atime;
+        rec->mtime = node->stat.st_mtime;
+        rec->ctime = node->stat.st_ctime;
+    }
+    rec->path_len = strlen(node->path);
+    rec->path = *off;
+    if (snapshot_write(f, off, node->path, rec->path_len))
+        return -1;
+    rec->dir = *off;
+    if (node->dir) {
+        rec->flags |= SNAPSHOT_DIR;
+        rec->dir_count = node->dir_len;
+        for (i = 0; i < node->dir_len; i++)
+            if (snapshot_write(f, off, node->dir[i], strlen(node->dir[i])))
+                return -1;
+    }
+    rec->link = *off;
+    if (node->link) {
+        rec->flags |= SNAPSHOT_LINK;
+        rec->link_len = strlen(node->link);
+        if (snapshot_write(f, off, node->link, rec->link_len))
+            return -1;
+    }
+    return 0;
+}
+
+/* Writes what the cache holds, which is what hasn't expired for longer
+ * than cache_stale_timeout, and what the old snapshot had that wasn't
+ * looked at, to a new file that then replaces the old one */
+static void snapshot_save(void)
+{
+    struct snapshot *snap = &cache.snapshot;
+    struct snapshot_header header;
+    struct snapshot_record *records;
+    struct snapshot_entry *entries;
+    GHashTableIter iter;
+    gpointer value;
+    size_t count = 0, max = snap->count;
+    uint64_t off;
+    char *tmp;
+    FILE *f;
+    size_t i;
+    int err = 0;
+
+    for (i = 0; i < CACHE_SHARDS; i++)
+        max += g_hash_table_size(cache.shards[i].table);
+    entries = g_new(struct snapshot_entry, max);
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        g_hash_table_iter_init(&iter, cache.shards[i].table);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            struct node *node = value;
+            entries[count].path = node->path;
+            entries[count].node = node;
+            entries[count].rec = NULL;
+            count++;
+        }
+    }
+    for (i = 0; i < snap->count; i++) {
+        const struct snapshot_record *rec = &snap->records[i];
+        const char *path = snapshot_string(rec->path, rec->path_len);
+        if (snap->used[i] || path == NULL)
+            continue;
+        entries[count].path = path;
+        entries[count].node = NULL;
+        entries[count].rec = rec;
+        count++;
+    }
+    qsort(entries, count, sizeof(*entries), snapshot_entry_cmp);
+
+    tmp = g_strdup_printf("%s.tmp", cache.snapshot_file);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        fprintf(stderr, "can't save cache snapshot %s: %s\n", tmp,
+                strerror(errno));
+        g_free(tmp);
+        g_free(entries);
+        return;
+    }
+
+    records = g_new(struct snapshot_record, count);
+    off = sizeof(header) + count * sizeof(*records);
+    if (fseek(f, off, SEEK_SET) == -1)
+        err = -1;
+    for (i = 0; i < count && !err; i++)
+        err = snapshot_write_entry(f, &off, &entries[i], &records[i]);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.count = count;
+    header.source = cache.source;
+    header.saved = time(NULL);
+    if (!err && (fseek(f, 0, SEEK_SET) == -1 ||
+                 fwrite(&header, sizeof(header), 1, f) != 1 ||
+                 fwrite(records, sizeof(*records), count, f) != count))
+        err = -1;
+    if (fclose(f) == EOF)
+        err = -1;
+    if (err || rename(tmp, cache.snapshot_file) == -1) {
+        fprintf(stderr, "can't save cache snapshot %s: %s\n",
+                cache.snapshot_file, strerror(errno));
+        unlink(tmp);
+    }
+
+    g_free(records);
+    g_free(entries);
+    g_free(tmp);
+}
+
+static void snapshot_unload(void)
+{
+    struct snapshot *snap = &cache.snapshot;
+    if (snap->map == NULL)
+        return;
+    munmap((void *) snap->map, snap->size);
+    g_free(snap->used);
+    memset(snap, 0, sizeof(*snap));
+}
+
+#if FUSE_VERSION >= 23
+static void cache_destroy(void *data)
+{
+    /* The worker may be using a connection, which are gone after this */
+    cache_refresh_stop();
+    if (cache.next_oper->oper.destroy)
+        cache.next_oper->oper.destroy(data);
+}
+#endif
+
 static void cache_unity_fill(struct fuse_cache_operations *oper,
                              struct fuse_operations *cache_oper)
 {
 #if FUSE_VERSION >= 23
     cache_oper->init        = oper->oper.init;
+    cache_oper->destroy     = oper->oper.destroy;
 #endif
     cache_oper->getattr     = oper->oper.getattr;
     cache_oper->readlink    = oper->oper.readlink;
@@ -490,18 +1337,39 @@ static void cache_unity_fill(struct fuse_cache_operations *oper,
     cache_oper->ftruncate   = oper->oper.ftruncate;
     cache_oper->fgetattr    = oper->oper.fgetattr;
 #endif
+#if FUSE_VERSION >= 29
+    cache_oper->read_buf    = oper->oper.read_buf;
+#endif
+}
+
+static int64_t cache_ms(double secs)
+{
+    return secs > 0 ? (int64_t) (secs * 1000 + 0.5) : 0;
 }
 
 struct fuse_operations *cache_init(struct fuse_cache_operations *oper)
 {
     static struct fuse_operations cache_oper;
+    int i;
     cache.next_oper = oper;
+    cache.stat_ms = cache_ms(cache.stat_timeout);
+    cache.dir_ms = cache_ms(cache.dir_timeout);
+    cache.link_ms = cache_ms(cache.link_timeout);
+    cache.stale_ms = cache_ms(cache.stale_timeout);
+    /* The limits are shared out evenly, as paths are */
+    cache.shard_entries = (cache.max_entries + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    cache.shard_mem =
+        ((size_t) cache.max_mem * 1024 * 1024 + CACHE_SHARDS - 1) / CACHE_SHARDS;
 
     cache_unity_fill(oper, &cache_oper);
     if (cache.on) {
         cache_oper.getattr  = oper->oper.getattr ? cache_getattr : NULL;
         cache_oper.readlink = oper->oper.readlink ? cache_readlink : NULL;
         cache_oper.getdir   = oper->cache_getdir ? cache_getdir : NULL;
+#if FUSE_VERSION >= 23
+        if (cache_background())
+            cache_oper.destroy = cache_destroy;
+#endif
         cache_oper.mknod    = oper->oper.mknod ? cache_mknod : NULL;
         cache_oper.mkdir    = oper->oper.mkdir ? cache_mkdir : NULL;
         cache_oper.symlink  = oper->oper.symlink ? cache_symlink : NULL;
@@ -519,13 +1387,27 @@ struct fuse_operations *cache_init(struct fuse_cache_operations *oper)
         cache_oper.ftruncate = oper->oper.ftruncate ? cache_ftruncate : NULL;
         cache_oper.fgetattr = oper->oper.fgetattr ? cache_fgetattr : NULL;
 #endif
-        pthread_mutex_init(&cache.lock, NULL);
-        cache.table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-                                            free_node);
-        if (cache.table == NULL) {
-            fprintf(stderr, "failed to create cache\n");
-            return NULL;
+        for (i = 0; i < CACHE_SHARDS; i++) {
+            struct cache_shard *shard = &cache.shards[i];
+            pthread_mutex_init(&shard->lock, NULL);
+            g_queue_init(&shard->lru);
+            shard->table = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 NULL, free_node);
+            if (shard->table == NULL) {
+                fprintf(stderr, "failed to create cache\n");
+                return NULL;
+            }
+        }
+        if (cache_background()) {
+            struct cache_refresh *r = &cache.refresh;
+            pthread_mutex_init(&r->lock, NULL);
+            pthread_cond_init(&r->cond, NULL);
+            g_queue_init(&r->queue);
+            r->pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               NULL, free_job);
         }
+        if (cache.snapshot_file != NULL)
+            snapshot_load();
     }
     return &cache_oper;
 }
@@ -535,24 +1417,49 @@ int cache_enabled(void) {
 }
 
 void cache_deinit(void) {
-    pthread_mutex_lock(&cache.lock);
+    int i;
+    if (!cache.on)
+        return;
+    if (cache_background()) {
+        struct cache_refresh *r = &cache.refresh;
+        cache_refresh_stop();
+        g_queue_clear(&r->queue);
+        g_hash_table_destroy(r->pending);
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+    }
     cache.on = 0;
-    g_hash_table_destroy(cache.table);
-    cache.table = NULL;
-    pthread_mutex_unlock(&cache.lock);
-    pthread_mutex_destroy(&cache.lock);
+    if (cache.snapshot_file != NULL) {
+        snapshot_save();
+        snapshot_unload();
+    }
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache.shards[i];
+        pthread_mutex_lock(&shard->lock);
+        g_hash_table_destroy(shard->table);
+        shard->table = NULL;
+        pthread_mutex_unlock(&shard->lock);
+        pthread_mutex_destroy(&shard->lock);
+    }
     return;
 }
 
 static const struct fuse_opt cache_opts[] = {
     { "cache=yes", offsetof(struct cache, on), 1 },
     { "cache=no", offsetof(struct cache, on), 0 },
-    { "cache_timeout=%u", offsetof(struct cache, stat_timeout), 0 },
-    { "cache_timeout=%u", offsetof(struct cache, dir_timeout), 0 },
-    { "cache_timeout=%u", offsetof(struct cache, link_timeout), 0 },
-    { "cache_stat_timeout=%u", offsetof(struct cache, stat_timeout), 0 },
-    { "cache_dir_timeout=%u", offsetof(struct cache, dir_timeout), 0 },
-    { "cache_link_timeout=%u", offsetof(struct cache, link_timeout), 0 },
+    { "cache_timeout=%lf", offsetof(struct cache, stat_timeout), 0 },
+    { "cache_timeout=%lf", offsetof(struct cache, dir_timeout), 0 },
+    { "cache_timeout=%lf", offsetof(struct cache, link_timeout), 0 },
+    { "cache_stat_timeout=%lf", offsetof(struct cache, stat_timeout), 0 },
+    { "cache_dir_timeout=%lf", offsetof(struct cache, dir_timeout), 0 },
+    { "cache_link_timeout=%lf", offsetof(struct cache, link_timeout), 0 },
+    { "cache_stale_timeout=%lf", offsetof(struct cache, stale_timeout), 0 },
+    { "cache_prefetch_depth=%u", offsetof(struct cache, prefetch_depth), 0 },
+    { "cache_prefetch_conns=%u", offsetof(struct cache, prefetch_conns), 0 },
+    { "cache_max_entries=%u", offsetof(struct cache, max_entries), 0 },
+    { "cache_max_mem=%u", offsetof(struct cache, max_mem), 0 },
+    { "cache_snapshot=%s", offsetof(struct cache, snapshot_file), 0 },
+    { "cache_snapshot_age=%u", offsetof(struct cache, snapshot_age), 0 },
     FUSE_OPT_END
 };
 
@@ -561,7 +1468,15 @@ int cache_parse_options(struct fuse_args *args)
     cache.stat_timeout = DEFAULT_CACHE_TIMEOUT;
     cache.dir_timeout = DEFAULT_CACHE_TIMEOUT;
     cache.link_timeout = DEFAULT_CACHE_TIMEOUT;
+    cache.snapshot_age = DEFAULT_CACHE_SNAPSHOT_AGE;
+    cache.prefetch_conns = DEFAULT_CACHE_PREFETCH_CONNS;
     cache.on = 1;
 
-    return fuse_opt_parse(args, &cache, cache_opts, NULL);
+    if (fuse_opt_parse(args, &cache, cache_opts, NULL) == -1)
+        return -1;
+
+    /* The snapshot is saved after fuse_daemonize() has changed to "/" */
+    if (make_absolute(&cache.snapshot_file) == -1)
+        return -1;
+    return 0;
 }
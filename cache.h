@@ -14,15 +14,23 @@
 #endif
 #include <fuse.h>
 #include <fuse_opt.h>
+#include <stdint.h> /* <int64_t> */
 
 #ifndef FUSE_VERSION
 #define FUSE_VERSION (FUSE_MAJOR_VERSION * 10 + FUSE_MINOR_VERSION)
 #endif
 
 #define DEFAULT_CACHE_TIMEOUT 10
-#define MAX_CACHE_SIZE 10000
-#define MIN_CACHE_CLEAN_INTERVAL 5
-#define CACHE_CLEAN_INTERVAL 60
+#define CACHE_SHARD_BITS 4
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+/* Expired entries dropped per update, at most */
+#define CACHE_CLEAN_BATCH 8
+/* Listings waiting to be fetched again in the background, at most */
+#define CACHE_REFRESH_QUEUE 256
+/* Background listings at a time when prefetching */
+#define DEFAULT_CACHE_PREFETCH_CONNS 2
+/* Oldest entry of a snapshot that is loaded, in seconds */
+#define DEFAULT_CACHE_SNAPSHOT_AGE (24*60*60)
 
 typedef struct fuse_cache_dirhandle *fuse_cache_dirh_t;
 typedef int (*fuse_cache_dirfil_t) (fuse_cache_dirh_t h, const char *name,
@@ -38,7 +46,13 @@ int cache_enabled(void);
 void cache_deinit(void);
 int cache_parse_options(struct fuse_args *args);
 void cache_add_attr(const char *path, const struct stat *stbuf);
+/* -EAGAIN if we don't know about path */
+int cache_get_attr(const char *path, struct stat *stbuf);
 void cache_add_dir(const char *path, char **dir);
 void cache_add_link(const char *path, const char *link, size_t size);
+/* A snapshot is only loaded into a cache of the same source */
+void cache_set_source(const char *source);
+/* Milliseconds on the monotonic clock the cache times expiry with */
+int64_t cache_now(void);
 
 #endif   /* __CURLFTPFS_CACHE_H__ */
@@ -13,47 +13,202 @@
 #include <iconv.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "error.h"
 #include "ftpfs.h"
+#include "charset_utils.h"
 
-int convert_charsets(const char* from, const char* to, char** str) {
+/* One for each direction we convert in */
+#define ICONV_CACHE 2
+
+/* Opening a descriptor costs far more than a short conversion, so each
+ * thread keeps the ones it has used */
+struct iconv_entry {
+  char* from;
+  char* to;
+  iconv_t cd;
+  int ascii;      /* plain ASCII comes out unchanged */
+};
+
+struct iconv_cache {
+  struct iconv_entry e[ICONV_CACHE];
+  unsigned next;
+};
+
+static pthread_key_t iconv_key;
+static pthread_once_t iconv_once = PTHREAD_ONCE_INIT;
+
+static void iconv_entry_clear(struct iconv_entry* e) {
+  if (e->from) {
+    iconv_close(e->cd);
+    free(e->from);
+    free(e->to);
+    e->from = e->to = NULL;
+  }
+}
+
+static void iconv_cache_free(void* data) {
+  struct iconv_cache* cache = data;
+  int i;
+
+  for (i = 0; i < ICONV_CACHE; i++)
+    iconv_entry_clear(&cache->e[i]);
+  free(cache);
+}
+
+static void iconv_key_create(void) {
+  pthread_key_create(&iconv_key, iconv_cache_free);
+}
+
+static int is_ascii(const char* s, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++)
+    if ((unsigned char) s[i] >= 0x80)
+      return 0;
+  return 1;
+}
+
+/* Whether ASCII goes through cd untouched, as it does between most of the
+ * charsets servers use, but not into UTF-16 or EBCDIC */
+static int ascii_compatible(iconv_t cd) {
+  char in[127], out[127 * MB_LEN_MAX];
+  ICONV_CONST char* ib = in;
+  char* ob = out;
+  size_t ibl = sizeof in, obl = sizeof out;
+  int i, res;
+
+  for (i = 0; i < 127; i++)
+    in[i] = i + 1;
+  res = iconv(cd, &ib, &ibl, &ob, &obl) != (size_t) -1 && ibl == 0 &&
+        iconv(cd, NULL, NULL, &ob, &obl) != (size_t) -1 &&
+        ob - out == sizeof in && !memcmp(in, out, sizeof in);
+  iconv(cd, NULL, NULL, NULL, NULL);
+  return res;
+}
+
+static struct iconv_entry* iconv_get(const char* from, const char* to) {
+  struct iconv_cache* cache;
+  struct iconv_entry* e;
   iconv_t cd;
+  int i;
+
+  pthread_once(&iconv_once, iconv_key_create);
+  cache = pthread_getspecific(iconv_key);
+  if (cache == NULL) {
+    cache = calloc(1, sizeof *cache);
+    if (cache == NULL)
+      return NULL;
+    pthread_setspecific(iconv_key, cache);
+  }
+
+  for (i = 0; i < ICONV_CACHE; i++) {
+    e = &cache->e[i];
+    if (e->from && !strcmp(e->from, from) && !strcmp(e->to, to))
+      return e;
+  }
+
+  cd = iconv_open(to, from);
+  if (cd == (iconv_t)-1) {
+    DEBUG(2, "iconv_open return error %d\n", errno);
+    return NULL;
+  }
+
+  e = &cache->e[cache->next++ % ICONV_CACHE];
+  iconv_entry_clear(e);
+  e->from = strdup(from);
+  e->to = strdup(to);
+  if (e->from == NULL || e->to == NULL) {
+    free(e->from);
+    free(e->to);
+    e->from = e->to = NULL;
+    iconv_close(cd);
+    return NULL;
+  }
+  e->cd = cd;
+  e->ascii = ascii_compatible(cd);
+  return e;
+}
+
+int convert_charsets_noop(const char* from, const char* to,
+                          const char* s, size_t len) {
+  struct iconv_entry* e;
+
+  if (!to || !from || len == 0)
+    return 1;
+  if (!is_ascii(s, len))
+    return 0;
+  e = iconv_get(from, to);
+  return e == NULL || e->ascii;
+}
+
+ssize_t convert_charsets_buf(const char* from, const char* to,
+                             const char* s, size_t len,
+                             char* out, size_t outlen) {
+  struct iconv_entry* e = NULL;
+  ICONV_CONST char* ib;
+  char* ob;
+  size_t ibl, obl;
+
+  if (outlen == 0)
+    return -1;
+  if (to && from && len)
+    e = iconv_get(from, to);
+  if (e == NULL || (e->ascii && is_ascii(s, len))) {
+    if (len >= outlen)
+      return -1;
+    memcpy(out, s, len);
+    out[len] = '\0';
+    return len;
+  }
+
+  ib = (ICONV_CONST char*) s;
+  ibl = len;
+  ob = out;
+  obl = outlen - 1;
+
+  iconv(e->cd, NULL, NULL, NULL, NULL);
+  while (ibl) {
+    if (iconv(e->cd, &ib, &ibl, &ob, &obl) == (size_t)-1) {
+      DEBUG(2, "iconv return error %d\n", errno);
+      if (errno == E2BIG || obl == 0)
+        return -1;
+      /* Pass what we can't convert on as it is */
+      *ob++ = *ib++;
+      ibl--;
+      obl--;
+    }
+  }
+  if (iconv(e->cd, NULL, NULL, &ob, &obl) == (size_t)-1)
+    return -1;
+  *ob = 0;
+  DEBUG(2, "iconv return %s\n", out);
+
+  return ob - out;
+}
+
+int convert_charsets(const char* from, const char* to, char** str) {
   char* s = *str;
+  size_t len, size;
+  char* buf;
 
   if (!s || !*s)
     return 0;
 
-  if (to && from && (cd = iconv_open(to, from)) != (iconv_t)-1) {
-    ICONV_CONST char* ib;
-    char* buf;
-    char* ob;
-    size_t ibl, obl;
-
-    ibl = strlen(s) + 1;
-    ib = s;
-    obl = MB_LEN_MAX * ibl;
-    buf = malloc(obl);
-    ob = buf;
-
-    do {
-      if (iconv(cd, &ib, &ibl, &ob, &obl) == (size_t)-1) {
-        DEBUG(2, "iconv return error %d\n", errno);
-        if (obl) {
-          *ob++ = *ib++;
-          ibl--;
-          obl--;
-        }
-      }
-    } while (ibl && obl);
-    *ob = 0;
-    DEBUG(2, "iconv return %s\n", buf);
-    iconv_close (cd);
-    free(*str);
-    *str = buf;
-  } else {
-    DEBUG(2, "iconv_open return error %d\n", errno);
+  len = strlen(s);
+  if (convert_charsets_noop(from, to, s, len))
+    return 0;
+
+  size = MB_LEN_MAX * (len + 1);
+  buf = malloc(size);
+  if (buf == NULL)
+    return 0;
+  if (convert_charsets_buf(from, to, s, len, buf, size) == -1) {
+    free(buf);
+    return 0;
   }
+  free(*str);
+  *str = buf;
 
   return 0;
 }
@@ -1,6 +1,19 @@
 #ifndef __CURLFTPFS_CHARSET_UTILS_H__
 #define __CURLFTPFS_CHARSET_UTILS_H__
 
+#include <sys/types.h>
+
+/* Replaces *str with its conversion, unless that wouldn't change it */
 int convert_charsets(const char* from, const char* to, char** str);
 
+/* 1 if converting the len bytes at s would leave them as they are */
+int convert_charsets_noop(const char* from, const char* to,
+                          const char* s, size_t len);
+
+/* Converts the len bytes at s into out, NUL terminated. Returns the length
+ * of the result, or -1 if it doesn't fit in outlen bytes. */
+ssize_t convert_charsets_buf(const char* from, const char* to,
+                             const char* s, size_t len,
+                             char* out, size_t outlen);
+
 #endif  /* __CURLFTPFS_CHARSET_UTILS_H__ */
@@ -0,0 +1,261 @@
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <stdlib.h> /* calloc(), free(), exit() */
+#include <stdio.h>  /* stderr, fprintf() */
+
+#include <pthread.h> /* pthread_*() */
+
+#include "error.h"
+#include "ftpfs.h"
+#include "conn_pool.h"
+
+struct conn_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t available;
+  struct ftpfs_conn *idle;
+  unsigned count;
+  unsigned max;
+  pthread_t *prewarm;
+  unsigned prewarm_count;
+};
+
+static struct conn_pool pool;
+
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static struct ftpfs_conn *conn_wrap(CURL *easy) {
+  struct ftpfs_conn *conn = calloc(1, sizeof *conn);
+
+  if (conn == NULL)
+    return NULL;
+
+  conn->easy = easy;
+  /* Every connection reports errors into its own buffer, since several of
+   * them may fail at the same time. */
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_ERRORBUFFER, conn->error_buf);
+
+  return conn;
+}
+
+static struct ftpfs_conn *conn_new(void) {
+  struct ftpfs_conn *conn;
+  CURL *easy = curl_easy_init();
+
+  if (easy == NULL)
+    return NULL;
+
+  set_common_curl_stuff(easy);
+  conn = conn_wrap(easy);
+  if (conn == NULL)
+    curl_easy_cleanup(easy);
+
+  return conn;
+}
+
+static void conn_free(struct ftpfs_conn *conn) {
+  curl_easy_cleanup(conn->easy);
+  free(conn);
+}
+
+int conn_pool_init(unsigned max_conns) {
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.available, NULL);
+  pool.idle  = NULL;
+  pool.count = 0;
+  pool.max   = max_conns ? max_conns : 1;
+  return 0;
+}
+
+void conn_pool_adopt(CURL *easy) {
+  struct ftpfs_conn *conn = conn_wrap(easy);
+
+  if (conn == NULL) {
+    curl_easy_cleanup(easy);
+    return;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  if (pool.count >= pool.max) {
+    pthread_mutex_unlock(&pool.lock);
+    conn_free(conn);
+    return;
+  }
+  pool.count++;
+  conn->next = pool.idle;
+  pool.idle = conn;
+  pthread_cond_signal(&pool.available);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+static void *conn_prewarm_thread(void *data) {
+  CURL *easy = curl_easy_init();
+  CURLcode curl_res;
+
+  (void) data;
+  if (easy == NULL)
+    return NULL;
+
+  set_common_curl_stuff(easy);
+  curl_easy_setopt_or_die(easy, CURLOPT_WRITEDATA, NULL);
+  curl_easy_setopt_or_die(easy, CURLOPT_NOBODY, ftpfs.safe_nobody);
+  /* The common error buffer is only for the thread that mounts */
+  curl_easy_setopt_or_die(easy, CURLOPT_ERRORBUFFER, NULL);
+  curl_res = curl_easy_perform(easy);
+  curl_easy_setopt_or_die(easy, CURLOPT_NOBODY, 0);
+
+  if (curl_res != CURLE_OK) {
+    DEBUG(1, "conn_pool: prewarming failed: %s\n",
+          curl_easy_strerror(curl_res));
+    curl_easy_cleanup(easy);
+    return NULL;
+  }
+  conn_pool_adopt(easy);
+  DEBUG(1, "conn_pool: prewarmed a connection\n");
+  return NULL;
+}
+
+void conn_pool_prewarm(unsigned n) {
+  unsigned i;
+
+  pthread_mutex_lock(&pool.lock);
+  if (n > pool.max - pool.count)
+    n = pool.max - pool.count;
+  pthread_mutex_unlock(&pool.lock);
+  if (n == 0)
+    return;
+
+  pool.prewarm = calloc(n, sizeof(pthread_t));
+  if (pool.prewarm == NULL)
+    return;
+  for (i = 0; i < n; i++) {
+    if (pthread_create(&pool.prewarm[i], NULL, conn_prewarm_thread, NULL))
+      break;
+  }
+  pool.prewarm_count = i;
+}
+
+void conn_pool_destroy(void) {
+  unsigned i;
+
+  for (i = 0; i < pool.prewarm_count; i++)
+    pthread_join(pool.prewarm[i], NULL);
+  free(pool.prewarm);
+  pool.prewarm = NULL;
+  pool.prewarm_count = 0;
+
+  pthread_mutex_lock(&pool.lock);
+  while (pool.idle) {
+    struct ftpfs_conn *conn = pool.idle;
+    pool.idle = conn->next;
+    conn_free(conn);
+    pool.count--;
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  pthread_cond_destroy(&pool.available);
+  pthread_mutex_destroy(&pool.lock);
+}
+
+struct ftpfs_conn *conn_pool_get(void) {
+  return conn_pool_get_unless(NULL, NULL);
+}
+
+struct ftpfs_conn *conn_pool_get_unless(int (*stop)(void *), void *arg) {
+  struct ftpfs_conn *conn = NULL;
+
+  pthread_mutex_lock(&pool.lock);
+  while (conn == NULL) {
+    if (stop && stop(arg)) {
+      /* Pass on the wakeup that may have been meant for someone else */
+      if (pool.idle)
+        pthread_cond_signal(&pool.available);
+      pthread_mutex_unlock(&pool.lock);
+      return NULL;
+    } else if (pool.idle) {
+      conn = pool.idle;
+      pool.idle = conn->next;
+    } else if (pool.count < pool.max) {
+      /* Don't hold the pool while we set up the handle */
+      pool.count++;
+      pthread_mutex_unlock(&pool.lock);
+      conn = conn_new();
+      pthread_mutex_lock(&pool.lock);
+      if (conn == NULL) {
+        pool.count--;
+        if (pool.count == 0) {
+          fprintf(stderr, "Error initializing libcurl\n");
+          exit(1);
+        }
+      } else {
+        DEBUG(1, "conn_pool: opened connection %u/%u\n", pool.count, pool.max);
+      }
+    } else {
+      pthread_cond_wait(&pool.available, &pool.lock);
+    }
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  conn->next = NULL;
+  conn->error_buf[0] = '\0';
+  return conn;
+}
+
+void conn_pool_wake(void) {
+  pthread_mutex_lock(&pool.lock);
+  pthread_cond_broadcast(&pool.available);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+void conn_pool_put(struct ftpfs_conn *conn) {
+  pthread_mutex_lock(&pool.lock);
+  conn->next = pool.idle;
+  pool.idle = conn;
+  pthread_cond_signal(&pool.available);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+static void share_lock(CURL *easy, curl_lock_data data,
+                       curl_lock_access access, void *userp) {
+  (void) easy;
+  (void) access;
+  (void) userp;
+  pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *easy, curl_lock_data data, void *userp) {
+  (void) easy;
+  (void) userp;
+  pthread_mutex_unlock(&share_locks[data]);
+}
+
+int conn_share_init(void) {
+  int i;
+
+  ftpfs.share = curl_share_init();
+  if (ftpfs.share == NULL)
+    return -1;
+
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_init(&share_locks[i], NULL);
+  curl_share_setopt(ftpfs.share, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt(ftpfs.share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt(ftpfs.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(ftpfs.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  return 0;
+}
+
+void conn_share_destroy(void) {
+  int i;
+
+  if (ftpfs.share == NULL)
+    return;
+  curl_share_cleanup(ftpfs.share);
+  ftpfs.share = NULL;
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_destroy(&share_locks[i]);
+}
@@ -0,0 +1,45 @@
+#ifndef __CURLFTPFS_CONN_POOL_H__
+#define __CURLFTPFS_CONN_POOL_H__ 1
+
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <curl/curl.h>
+
+#define DEFAULT_MAX_CONNECTIONS 4
+
+/* An authenticated control connection that can be checked out by a single
+ * operation at a time. */
+struct ftpfs_conn {
+  CURL *easy;
+  char error_buf[CURL_ERROR_SIZE];
+  struct ftpfs_conn *next;
+};
+
+int  conn_pool_init(unsigned max_conns);
+void conn_pool_destroy(void);
+/* Hands an already configured handle over to the pool */
+void conn_pool_adopt(CURL *easy);
+
+/* Logs in up to n more connections in the background, at once */
+void conn_pool_prewarm(unsigned n);
+
+/* Blocks until a connection is available. Never returns NULL. */
+struct ftpfs_conn *conn_pool_get(void);
+/* The same, but returns NULL instead once stop(arg) holds. It is checked
+ * with the pool locked, whenever a connection comes back and after
+ * conn_pool_wake(). */
+struct ftpfs_conn *conn_pool_get_unless(int (*stop)(void *), void *arg);
+void conn_pool_wake(void);
+void conn_pool_put(struct ftpfs_conn *conn);
+
+/* The share every handle is given by set_common_curl_stuff(), so that
+ * new connections resume the TLS session of the first one */
+int  conn_share_init(void);
+void conn_share_destroy(void);
+
+#endif
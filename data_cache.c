@@ -0,0 +1,817 @@
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>    /* free(), strtoul(), strtoll(), qsort() */
+#include <stdio.h>     /* stderr, fprintf(), FILE, fopen(), fgets() */
+#include <string.h>    /* strcmp(), strlen(), strerror(), memcpy() */
+#include <errno.h>     /* errno, EEXIST, EINTR */
+#include <limits.h>    /* PATH_MAX */
+#include <unistd.h>    /* close(), pread(), write(), unlink(), rmdir() */
+#include <fcntl.h>     /* open(), O_* */
+#include <dirent.h>    /* opendir(), readdir(), closedir() */
+#include <sys/stat.h>  /* stat(), mkdir(), <struct stat> */
+#include <sys/time.h>  /* futimes() */
+
+#include <pthread.h> /* pthread_*() */
+#include <glib.h>    /* GHashTable, GQueue, g_*() */
+
+#include "error.h"
+#include "ftpfs.h"
+#include "data_cache.h"
+
+struct dc_block {
+  struct data_cache_file *file;
+  unsigned long index;
+  size_t size;
+  time_t used;   /* only while loading the cache from disk */
+  GList *lru;
+};
+
+struct data_cache_file {
+  char *name;      /* directory below the cache dir */
+  char *path;
+  time_t mtime;
+  off_t size;
+  unsigned long nblocks;
+  struct dc_block **blocks;
+  unsigned gen;    /* bumped whenever the blocks are dropped */
+};
+
+/* A block waiting for the writer thread */
+struct dc_store {
+  struct data_cache_file *file;
+  unsigned long index;
+  unsigned gen;
+  size_t size;
+  char data[];
+};
+
+/* Bytes that may wait to be written. Blocks beyond that aren't kept, so
+ * that a slow disk costs cache hits rather than stalling downloads. */
+#define DC_STORE_MAX (32 * DATA_CACHE_BLOCK)
+
+/* A block a thread keeps open to splice from */
+struct dc_thread_fd {
+  struct data_cache_file *file;
+  unsigned long index;
+  unsigned file_gen;  /* file->gen when the block was opened */
+  int fd;
+  unsigned gen;
+};
+
+struct dc_thread {
+  struct dc_thread_fd fds[DATA_CACHE_FDS];
+  unsigned gen;
+};
+
+/* Marks a directory as ours to fill and to clean up */
+#define DC_MARKER ".curlftpfs-data-cache"
+
+struct data_cache {
+  pthread_mutex_t lock;
+  pthread_key_t thread_key;
+  char *dir;
+  unsigned long long max_size;
+  unsigned long long size;
+  GHashTable *files;   /* name -> struct data_cache_file */
+  GQueue retired;      /* files replaced by a colliding key */
+  GQueue lru;          /* of struct dc_block, most recently used first */
+  GQueue stores;       /* of struct dc_store, oldest first */
+  size_t store_bytes;
+  pthread_cond_t store_cond;
+  pthread_t writer;
+  int writer_running;
+  int stopping;
+};
+
+static struct data_cache dc;
+
+/* FNV-1a 64 */
+static unsigned long long dc_hash(const char *s, unsigned long long h) {
+  for (; *s; s++) {
+    h ^= (unsigned char) *s;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static char *dc_make_name(const char *path, time_t mtime, off_t size) {
+  char *key = g_strdup_printf("%s\n%lld\n%lld", path, (long long) mtime,
+                              (long long) size);
+  char *name = g_strdup_printf("%016llx",
+                               dc_hash(key, 14695981039346656037ULL));
+  g_free(key);
+  return name;
+}
+
+/* Whether name is one dc_make_name() could have made */
+static int dc_is_name(const char *name) {
+  int i;
+
+  for (i = 0; i < 16; i++)
+    if (!((name[i] >= '0' && name[i] <= '9') ||
+          (name[i] >= 'a' && name[i] <= 'f')))
+      return 0;
+  return name[16] == '\0';
+}
+
+static char *dc_block_path(struct data_cache_file *file, unsigned long index) {
+  return g_strdup_printf("%s/%s/%lu", dc.dir, file->name, index);
+}
+
+static unsigned long dc_nblocks(off_t size) {
+  return (size + DATA_CACHE_BLOCK - 1) / DATA_CACHE_BLOCK;
+}
+
+static struct data_cache_file *dc_file_new(const char *name, const char *path,
+                                           time_t mtime, off_t size) {
+  struct data_cache_file *file = g_new0(struct data_cache_file, 1);
+
+  file->name    = g_strdup(name);
+  file->path    = g_strdup(path);
+  file->mtime   = mtime;
+  file->size    = size;
+  file->nblocks = dc_nblocks(size);
+  file->blocks  = g_new0(struct dc_block *, file->nblocks ? file->nblocks : 1);
+  return file;
+}
+
+static void dc_file_free(gpointer data) {
+  struct data_cache_file *file = data;
+
+  g_free(file->blocks);
+  g_free(file->path);
+  g_free(file->name);
+  g_free(file);
+}
+
+/* Must be called with dc.lock held */
+static void dc_block_drop(struct dc_block *block, int remove_file) {
+  struct data_cache_file *file = block->file;
+
+  if (remove_file) {
+    char *path = dc_block_path(file, block->index);
+    unlink(path);
+    g_free(path);
+  }
+
+  if (block->lru) {
+    g_queue_unlink(&dc.lru, block->lru);
+    g_list_free_1(block->lru);
+  }
+  file->blocks[block->index] = NULL;
+  dc.size -= block->size;
+  g_free(block);
+}
+
+/* Must be called with dc.lock held */
+static void dc_evict(void) {
+  while (dc.size > dc.max_size && dc.lru.tail) {
+    struct dc_block *block = dc.lru.tail->data;
+    DEBUG(2, "data_cache: evicting %s/%lu\n", block->file->name, block->index);
+    dc_block_drop(block, 1);
+  }
+}
+
+/* Must be called with dc.lock held */
+static void dc_file_clear(struct data_cache_file *file) {
+  unsigned long i;
+  GList *l, *next;
+
+  /* Stores already under way see the new gen and give up */
+  file->gen++;
+  for (l = dc.stores.head; l; l = next) {
+    struct dc_store *store = l->data;
+    next = l->next;
+    if (store->file == file) {
+      dc.store_bytes -= store->size;
+      g_queue_delete_link(&dc.stores, l);
+      g_free(store);
+    }
+  }
+  for (i = 0; i < file->nblocks; i++)
+    if (file->blocks[i])
+      dc_block_drop(file->blocks[i], 1);
+}
+
+static int dc_write_key(struct data_cache_file *file) {
+  char *path = g_strdup_printf("%s/%s/key", dc.dir, file->name);
+  FILE *f = fopen(path, "w");
+  int err = -1;
+
+  if (f) {
+    fprintf(f, "%lld %lld %s\n", (long long) file->mtime,
+            (long long) file->size, file->path);
+    err = fclose(f) ? -1 : 0;
+  }
+  if (err)
+    DEBUG(1, "data_cache: can't write %s: %s\n", path, strerror(errno));
+  g_free(path);
+  return err;
+}
+
+static struct data_cache_file *dc_read_key(const char *name) {
+  char *path = g_strdup_printf("%s/%s/key", dc.dir, name);
+  char line[PATH_MAX + 64];
+  struct data_cache_file *file = NULL;
+  FILE *f = fopen(path, "r");
+  g_free(path);
+
+  if (f == NULL)
+    return NULL;
+
+  if (fgets(line, sizeof line, f)) {
+    char *p = line, *end;
+    long long mtime, size;
+    size_t len = strlen(line);
+
+    if (len && line[len - 1] == '\n')
+      line[len - 1] = '\0';
+
+    mtime = strtoll(p, &end, 10);
+    if (end != p && *end == ' ') {
+      p = end + 1;
+      size = strtoll(p, &end, 10);
+      if (end != p && *end == ' ' && size >= 0)
+        file = dc_file_new(name, end + 1, mtime, size);
+    }
+  }
+  fclose(f);
+  return file;
+}
+
+static int dc_remove_dir(const char *name) {
+  char *path = g_strdup_printf("%s/%s", dc.dir, name);
+  DIR *d = opendir(path);
+  struct dirent *de;
+  int err;
+
+  if (d) {
+    while ((de = readdir(d)) != NULL) {
+      char *entry;
+      if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+        continue;
+      entry = g_strdup_printf("%s/%s", path, de->d_name);
+      unlink(entry);
+      g_free(entry);
+    }
+    closedir(d);
+  }
+  err = rmdir(path);
+  g_free(path);
+  return err;
+}
+
+static void dc_load_blocks(struct data_cache_file *file, GPtrArray *loaded) {
+  char *path = g_strdup_printf("%s/%s", dc.dir, file->name);
+  DIR *d = opendir(path);
+  struct dirent *de;
+
+  if (d == NULL) {
+    g_free(path);
+    return;
+  }
+
+  while ((de = readdir(d)) != NULL) {
+    char *entry, *end;
+    unsigned long index;
+    struct stat st;
+
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+        !strcmp(de->d_name, "key"))
+      continue;
+
+    entry = g_strdup_printf("%s/%s", path, de->d_name);
+    index = strtoul(de->d_name, &end, 10);
+    /* Leftovers of an interrupted store, blocks that don't belong here
+     * and blocks of the wrong size all go */
+    if (*end || end == de->d_name || index >= file->nblocks ||
+        stat(entry, &st) == -1 ||
+        st.st_size != (index + 1 < file->nblocks ? DATA_CACHE_BLOCK :
+                       file->size - (off_t) index * DATA_CACHE_BLOCK)) {
+      unlink(entry);
+    } else {
+      struct dc_block *block = g_new0(struct dc_block, 1);
+      block->file  = file;
+      block->index = index;
+      block->size  = st.st_size;
+      block->used  = st.st_mtime;
+      file->blocks[index] = block;
+      dc.size += block->size;
+      g_ptr_array_add(loaded, block);
+    }
+    g_free(entry);
+  }
+  closedir(d);
+  g_free(path);
+}
+
+static int dc_by_use(const void *a, const void *b) {
+  const struct dc_block *x = *(struct dc_block * const *) a;
+  const struct dc_block *y = *(struct dc_block * const *) b;
+  return (y->used > x->used) - (y->used < x->used);
+}
+
+/* Picks up what a previous mount left behind, oldest blocks last */
+static void dc_load(void) {
+  GPtrArray *loaded = g_ptr_array_new();
+  DIR *d = opendir(dc.dir);
+  struct dirent *de;
+  unsigned i;
+
+  if (d == NULL)
+    return;
+
+  while ((de = readdir(d)) != NULL) {
+    struct data_cache_file *file;
+
+    /* Nothing but what we made goes, whatever else is in there */
+    if (!dc_is_name(de->d_name))
+      continue;
+
+    file = dc_read_key(de->d_name);
+    if (file == NULL) {
+      dc_remove_dir(de->d_name);
+      continue;
+    }
+    g_hash_table_insert(dc.files, file->name, file);
+    dc_load_blocks(file, loaded);
+  }
+  closedir(d);
+
+  qsort(loaded->pdata, loaded->len, sizeof(gpointer), dc_by_use);
+  for (i = 0; i < loaded->len; i++) {
+    struct dc_block *block = g_ptr_array_index(loaded, i);
+    block->lru = g_list_alloc();
+    block->lru->data = block;
+    g_queue_push_tail_link(&dc.lru, block->lru);
+  }
+  g_ptr_array_free(loaded, TRUE);
+
+  DEBUG(1, "data_cache: %u blocks, %llu bytes in %s\n",
+        g_queue_get_length(&dc.lru), dc.size, dc.dir);
+  dc_evict();
+}
+
+static void dc_thread_free(void *data) {
+  struct dc_thread *thread = data;
+  int i;
+
+  for (i = 0; i < DATA_CACHE_FDS; i++)
+    if (thread->fds[i].file)
+      close(thread->fds[i].fd);
+  g_free(thread);
+}
+
+/* Writes a block to a temporary name, to be renamed into place once the
+ * block turns out to be still wanted */
+static int dc_write_block(struct dc_store *store, const char *tmp) {
+  const char *p = store->data;
+  size_t left = store->size;
+  int fd;
+
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    DEBUG(1, "data_cache: can't create %s: %s\n", tmp, strerror(errno));
+    return -1;
+  }
+  while (left) {
+    ssize_t res = write(fd, p, left);
+    if (res == -1 && errno == EINTR)
+      continue;
+    if (res <= 0) {
+      DEBUG(1, "data_cache: can't write %s: %s\n", tmp, strerror(errno));
+      close(fd);
+      unlink(tmp);
+      return -1;
+    }
+    p += res;
+    left -= res;
+  }
+  if (close(fd) == -1) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* Does the file I/O of data_cache_store(), which runs on the event loop
+ * and mustn't wait for the disk */
+static void *dc_writer(void *arg) {
+  (void) arg;
+
+  pthread_mutex_lock(&dc.lock);
+  for (;;) {
+    struct dc_store *store;
+    struct data_cache_file *file;
+    char *path, *tmp;
+    int err;
+
+    while (dc.stores.head == NULL && !dc.stopping)
+      pthread_cond_wait(&dc.store_cond, &dc.lock);
+    store = g_queue_pop_head(&dc.stores);
+    if (store == NULL)
+      break;
+    dc.store_bytes -= store->size;
+    file = store->file;
+    path = dc_block_path(file, store->index);
+    tmp  = g_strdup_printf("%s/%s/.%lu.tmp", dc.dir, file->name,
+                           store->index);
+    pthread_mutex_unlock(&dc.lock);
+
+    err = dc_write_block(store, tmp);
+
+    pthread_mutex_lock(&dc.lock);
+    if (err == 0) {
+      if (store->gen != file->gen || file->blocks[store->index] ||
+          rename(tmp, path) == -1) {
+        unlink(tmp);
+      } else {
+        struct dc_block *block = g_new0(struct dc_block, 1);
+        block->file  = file;
+        block->index = store->index;
+        block->size  = store->size;
+        block->lru   = g_list_alloc();
+        block->lru->data = block;
+        g_queue_push_head_link(&dc.lru, block->lru);
+        file->blocks[store->index] = block;
+        dc.size += store->size;
+        dc_evict();
+      }
+    }
+    g_free(tmp);
+    g_free(path);
+    g_free(store);
+  }
+  pthread_mutex_unlock(&dc.lock);
+  return NULL;
+}
+
+/* Makes sure dir is one of ours: new, empty or marked as a data cache.
+ * Anything else may hold files of the user, which dc_load() would take
+ * for leftovers. */
+static int dc_claim(const char *dir) {
+  char *marker = g_strdup_printf("%s/%s", dir, DC_MARKER);
+  struct stat st;
+  struct dirent *de;
+  DIR *d;
+  int fd, err = 0;
+
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+    fprintf(stderr, "data_cache: can't create %s: %s\n", dir, strerror(errno));
+    g_free(marker);
+    return -1;
+  }
+  if (stat(marker, &st) == 0) {
+    g_free(marker);
+    return 0;
+  }
+
+  d = opendir(dir);
+  if (d == NULL) {
+    fprintf(stderr, "data_cache: can't open %s: %s\n", dir, strerror(errno));
+    g_free(marker);
+    return -1;
+  }
+  while ((de = readdir(d)) != NULL) {
+    if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+      fprintf(stderr, "data_cache: %s isn't empty, and has no %s in it\n",
+              dir, DC_MARKER);
+      err = -1;
+      break;
+    }
+  }
+  closedir(d);
+
+  if (err == 0) {
+    fd = open(marker, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd == -1 && errno != EEXIST) {
+      fprintf(stderr, "data_cache: can't create %s: %s\n", marker,
+              strerror(errno));
+      err = -1;
+    } else if (fd != -1) {
+      close(fd);
+    }
+  }
+  g_free(marker);
+  return err;
+}
+
+int data_cache_init(const char *dir, unsigned size_mb) {
+  if (dc_claim(dir) == -1)
+    return -1;
+
+  pthread_mutex_init(&dc.lock, NULL);
+  pthread_cond_init(&dc.store_cond, NULL);
+  pthread_key_create(&dc.thread_key, dc_thread_free);
+  dc.dir      = g_strdup(dir);
+  dc.max_size = (unsigned long long) size_mb * 1024 * 1024;
+  dc.size     = 0;
+  dc.files    = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                      dc_file_free);
+  g_queue_init(&dc.lru);
+  g_queue_init(&dc.stores);
+  g_queue_init(&dc.retired);
+
+  dc_load();
+  return 0;
+}
+
+void data_cache_destroy(void) {
+  if (dc.dir == NULL)
+    return;
+
+  /* Let the writer finish what is queued */
+  pthread_mutex_lock(&dc.lock);
+  dc.stopping = 1;
+  pthread_cond_signal(&dc.store_cond);
+  pthread_mutex_unlock(&dc.lock);
+  if (dc.writer_running)
+    pthread_join(dc.writer, NULL);
+
+  pthread_mutex_lock(&dc.lock);
+  while (dc.lru.head) {
+    struct dc_block *block = dc.lru.head->data;
+    dc_block_drop(block, 0);
+  }
+  g_hash_table_destroy(dc.files);
+  while (dc.retired.head)
+    dc_file_free(g_queue_pop_head(&dc.retired));
+  g_free(dc.dir);
+  dc.dir = NULL;
+  pthread_mutex_unlock(&dc.lock);
+  pthread_key_delete(dc.thread_key);
+  pthread_cond_destroy(&dc.store_cond);
+  pthread_mutex_destroy(&dc.lock);
+}
+
+int data_cache_enabled(void) {
+  return dc.dir != NULL;
+}
+
+struct data_cache_file *data_cache_open(const char *path, time_t mtime,
+                                        off_t size) {
+  struct data_cache_file *file;
+  char *name;
+
+  if (dc.dir == NULL)
+    return NULL;
+
+  name = dc_make_name(path, mtime, size);
+
+  pthread_mutex_lock(&dc.lock);
+  file = g_hash_table_lookup(dc.files, name);
+  if (file && (file->mtime != mtime || file->size != size ||
+               strcmp(file->path, path))) {
+    /* Two keys with the same hash; the newer one wins. Handles may
+     * still point at the old one, so it lives on until unmount. */
+    dc_file_clear(file);
+    g_hash_table_steal(dc.files, name);
+    g_queue_push_tail(&dc.retired, file);
+    dc_remove_dir(name);
+    file = NULL;
+  }
+  if (file == NULL) {
+    char *dir = g_strdup_printf("%s/%s", dc.dir, name);
+    if (mkdir(dir, 0700) == 0 || errno == EEXIST) {
+      file = dc_file_new(name, path, mtime, size);
+      if (dc_write_key(file) == 0) {
+        g_hash_table_insert(dc.files, file->name, file);
+      } else {
+        dc_file_free(file);
+        file = NULL;
+      }
+    } else {
+      DEBUG(1, "data_cache: can't create %s: %s\n", dir, strerror(errno));
+    }
+    g_free(dir);
+  }
+  pthread_mutex_unlock(&dc.lock);
+
+  g_free(name);
+  return file;
+}
+
+/* Marks blocks first to last as used, if we have them all, and tells the
+ * generation of the file they belong to */
+static int dc_use_blocks(struct data_cache_file *file, unsigned long first,
+                         unsigned long last, unsigned *gen) {
+  unsigned long i;
+
+  pthread_mutex_lock(&dc.lock);
+  for (i = first; i <= last; i++) {
+    if (file->blocks[i] == NULL) {
+      pthread_mutex_unlock(&dc.lock);
+      return -1;
+    }
+  }
+  for (i = first; i <= last; i++) {
+    g_queue_unlink(&dc.lru, file->blocks[i]->lru);
+    g_queue_push_head_link(&dc.lru, file->blocks[i]->lru);
+  }
+  if (gen)
+    *gen = file->gen;
+  pthread_mutex_unlock(&dc.lock);
+  return 0;
+}
+
+ssize_t data_cache_read(struct data_cache_file *file, off_t offset,
+                        char *buf, size_t size) {
+  unsigned long first, last, i;
+  size_t done = 0;
+
+  if (offset >= file->size)
+    return 0;
+  if (size > (size_t) (file->size - offset))
+    size = file->size - offset;
+  if (size == 0)
+    return 0;
+
+  first = offset / DATA_CACHE_BLOCK;
+  last  = (offset + size - 1) / DATA_CACHE_BLOCK;
+
+  if (dc_use_blocks(file, first, last, NULL) == -1)
+    return -1;
+
+  if (buf == NULL)
+    return size;
+
+  /* A block evicted from under us just turns this into a miss */
+  for (i = first; i <= last; i++) {
+    off_t start = (off_t) i * DATA_CACHE_BLOCK;
+    off_t from  = offset + done - start;
+    size_t len  = DATA_CACHE_BLOCK - from;
+    char *path  = dc_block_path(file, i);
+    int fd      = open(path, O_RDONLY);
+    ssize_t res;
+
+    g_free(path);
+    if (fd == -1)
+      return -1;
+
+    if (len > size - done)
+      len = size - done;
+    res = pread(fd, buf + done, len, from);
+    /* Keep the order of use for the next mount */
+    futimes(fd, NULL);
+    close(fd);
+    if (res != (ssize_t) len)
+      return -1;
+    done += len;
+  }
+
+  return done;
+}
+
+int data_cache_fds(struct data_cache_file *file, off_t offset, size_t size,
+                   int fds[DATA_CACHE_FDS]) {
+  struct dc_thread *thread;
+  unsigned long first, last, i;
+  unsigned file_gen;
+  int n = 0;
+
+  if (size == 0 || offset + (off_t) size > file->size)
+    return -1;
+
+  first = offset / DATA_CACHE_BLOCK;
+  last  = (offset + size - 1) / DATA_CACHE_BLOCK;
+  if (last - first >= DATA_CACHE_FDS)
+    return -1;
+
+  if (dc_use_blocks(file, first, last, &file_gen) == -1)
+    return -1;
+
+  thread = pthread_getspecific(dc.thread_key);
+  if (thread == NULL) {
+    thread = g_new0(struct dc_thread, 1);
+    pthread_setspecific(dc.thread_key, thread);
+  }
+  /* Descriptors handed out by the previous call may go now */
+  thread->gen++;
+
+  for (i = first; i <= last; i++) {
+    struct dc_thread_fd *slot = NULL;
+    int k;
+
+    /* A block dropped and stored again since is another file on disk */
+    for (k = 0; k < DATA_CACHE_FDS; k++) {
+      if (thread->fds[k].file == file && thread->fds[k].index == i &&
+          thread->fds[k].file_gen == file_gen) {
+        slot = &thread->fds[k];
+        break;
+      }
+    }
+    if (slot == NULL) {
+      char *path = dc_block_path(file, i);
+      int fd = open(path, O_RDONLY);
+
+      g_free(path);
+      if (fd == -1)
+        return -1;
+      futimes(fd, NULL);
+
+      for (k = 0; k < DATA_CACHE_FDS; k++) {
+        if (thread->fds[k].file == NULL || thread->fds[k].gen != thread->gen) {
+          slot = &thread->fds[k];
+          break;
+        }
+      }
+      if (slot->file)
+        close(slot->fd);
+      slot->file  = file;
+      slot->index = i;
+      slot->file_gen = file_gen;
+      slot->fd    = fd;
+    }
+    slot->gen = thread->gen;
+    fds[n++] = slot->fd;
+  }
+
+  return n;
+}
+
+int data_cache_has_block(struct data_cache_file *file, unsigned long index) {
+  int res;
+
+  pthread_mutex_lock(&dc.lock);
+  res = index < file->nblocks && file->blocks[index] != NULL;
+  pthread_mutex_unlock(&dc.lock);
+  return res;
+}
+
+void data_cache_store(struct data_cache_file *file, unsigned long index,
+                      const struct iovec *iov, int iovcnt) {
+  struct dc_store *store;
+  size_t size = 0;
+  GList *l;
+  int i;
+
+  if (index >= file->nblocks)
+    return;
+  for (i = 0; i < iovcnt; i++)
+    size += iov[i].iov_len;
+
+  pthread_mutex_lock(&dc.lock);
+  if (file->blocks[index] || dc.stopping ||
+      dc.store_bytes + size > DC_STORE_MAX)
+    goto out;
+  for (l = dc.stores.head; l; l = l->next) {
+    struct dc_store *queued = l->data;
+    if (queued->file == file && queued->index == index)
+      goto out;
+  }
+  /* Threads don't survive daemonizing, so start on first use */
+  if (!dc.writer_running) {
+    int err = pthread_create(&dc.writer, NULL, dc_writer, NULL);
+    if (err) {
+      DEBUG(1, "data_cache: can't start the writer: %s\n", strerror(err));
+      goto out;
+    }
+    dc.writer_running = 1;
+  }
+
+  store = g_malloc(sizeof(*store) + size);
+  store->file  = file;
+  store->index = index;
+  store->gen   = file->gen;
+  store->size  = 0;
+  for (i = 0; i < iovcnt; i++) {
+    memcpy(store->data + store->size, iov[i].iov_base, iov[i].iov_len);
+    store->size += iov[i].iov_len;
+  }
+  g_queue_push_tail(&dc.stores, store);
+  dc.store_bytes += size;
+  pthread_cond_signal(&dc.store_cond);
+
+out:
+  pthread_mutex_unlock(&dc.lock);
+}
+
+void data_cache_discard(struct data_cache_file *file) {
+  pthread_mutex_lock(&dc.lock);
+  dc_file_clear(file);
+  pthread_mutex_unlock(&dc.lock);
+}
+
+void data_cache_forget(const char *path) {
+  GHashTableIter iter;
+  gpointer value;
+
+  if (dc.dir == NULL)
+    return;
+
+  pthread_mutex_lock(&dc.lock);
+  g_hash_table_iter_init(&iter, dc.files);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    struct data_cache_file *file = value;
+    if (!strcmp(file->path, path))
+      dc_file_clear(file);
+  }
+  pthread_mutex_unlock(&dc.lock);
+}
@@ -0,0 +1,58 @@
+#ifndef __CURLFTPFS_DATA_CACHE_H__
+#define __CURLFTPFS_DATA_CACHE_H__ 1
+
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <sys/types.h> /* <off_t>, <ssize_t> */
+#include <sys/uio.h>   /* <struct iovec> */
+#include <time.h>      /* <time_t> */
+
+#define DATA_CACHE_BLOCK (256*1024)
+#define DEFAULT_DATA_CACHE_SIZE 1024 /* MiB */
+/* Blocks a single splice may span */
+#define DATA_CACHE_FDS 4
+
+/* One version of a remote file, as identified by its path, mtime and
+ * size. A file that changes on the server gets a new entry, so stale
+ * blocks are never served; they just age out. */
+struct data_cache_file;
+
+int  data_cache_init(const char *dir, unsigned size_mb);
+void data_cache_destroy(void);
+int  data_cache_enabled(void);
+
+/* Returns NULL if the file can't be cached */
+struct data_cache_file *data_cache_open(const char *path, time_t mtime,
+                                        off_t size);
+
+/* Reads from the blocks on disk. If any block in the range is missing,
+ * returns -1 without reading anything. With buf == NULL it only checks
+ * that the data is there. */
+ssize_t data_cache_read(struct data_cache_file *file, off_t offset,
+                        char *buf, size_t size);
+
+/* Opens the blocks holding the range for splicing from, one descriptor
+ * per block. They stay open until the calling thread calls this again.
+ * Returns the number of blocks, or -1 if any is missing or the range
+ * spans more than DATA_CACHE_FDS of them. */
+int  data_cache_fds(struct data_cache_file *file, off_t offset, size_t size,
+                    int fds[DATA_CACHE_FDS]);
+
+int  data_cache_has_block(struct data_cache_file *file, unsigned long index);
+/* A block is DATA_CACHE_BLOCK bytes long, except for the last one. The
+ * data is copied and written out by a thread of the cache's own, so this
+ * never waits for the disk; blocks that don't fit the queue are dropped. */
+void data_cache_store(struct data_cache_file *file, unsigned long index,
+                      const struct iovec *iov, int iovcnt);
+
+/* Drops what we have of a file that turned out not to match its key */
+void data_cache_discard(struct data_cache_file *file);
+/* Drops every version of path, after we changed it ourselves */
+void data_cache_forget(const char *path);
+
+#endif
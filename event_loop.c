@@ -0,0 +1,387 @@
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include "config.h"
+
+#include <stdlib.h> /* exit() */
+#include <stdio.h>  /* stderr, fprintf() */
+#include <string.h> /* memset(), strerror() */
+#include <errno.h>  /* errno, EINTR, EEXIST, ENOENT */
+#include <unistd.h> /* pipe(), read(), write(), close() */
+#include <fcntl.h>  /* fcntl(), O_NONBLOCK, FD_CLOEXEC */
+#include <time.h>   /* clock_gettime(), <struct timespec> */
+
+#include <pthread.h> /* pthread_*() */
+
+#ifdef HAVE_SYS_EPOLL_H
+#  include <sys/epoll.h> /* epoll_*() */
+#else
+#  include <sys/select.h> /* select(), FD_*() */
+#endif
+
+#include "error.h"
+#include "ftpfs.h"
+#include "event_loop.h"
+
+#define MAX_EVENTS 64
+
+/* libcurl doesn't always leave a timer behind for a transfer that could
+ * make progress on its own (an FTP PASV reply read in the same call that
+ * sent the command, for one), so while transfers are running we never
+ * sleep for longer than this. */
+#define LOOP_POLL_MS 100
+
+struct event_loop {
+  pthread_t thread;
+  int running;
+  int wake_fds[2];
+#ifdef HAVE_SYS_EPOLL_H
+  int epoll_fd;
+#endif
+  int timer_set;
+  struct timespec deadline;
+  int running_handles;
+};
+
+static struct event_loop loop;
+
+static void loop_wakeup(void) {
+  char c = 0;
+  /* A full pipe already guarantees a wakeup */
+  if (write(loop.wake_fds[1], &c, 1) == -1 && errno != EAGAIN)
+    DEBUG(1, "event_loop: wakeup failed: %s\n", strerror(errno));
+}
+
+static void loop_drain(void) {
+  char junk[64];
+  while (read(loop.wake_fds[0], junk, sizeof junk) > 0);
+}
+
+/* Milliseconds until libcurl's timer expires, or -1 if none is pending */
+static long loop_timeout(void) {
+  struct timespec now;
+  long ms;
+
+  if (!loop.timer_set)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = (loop.deadline.tv_sec - now.tv_sec) * 1000 +
+       (loop.deadline.tv_nsec - now.tv_nsec) / 1000000;
+  return ms > 0 ? ms : 0;
+}
+
+static int loop_timer_cb(CURLM *multi, long timeout_ms, void *userp) {
+  (void) multi;
+  (void) userp;
+
+  if (timeout_ms < 0) {
+    loop.timer_set = 0;
+  } else {
+    clock_gettime(CLOCK_MONOTONIC, &loop.deadline);
+    loop.deadline.tv_sec  += timeout_ms / 1000;
+    loop.deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (loop.deadline.tv_nsec >= 1000000000) {
+      loop.deadline.tv_sec++;
+      loop.deadline.tv_nsec -= 1000000000;
+    }
+    loop.timer_set = 1;
+  }
+
+  /* Handles are added and resumed from the FUSE threads */
+  if (!pthread_equal(pthread_self(), loop.thread))
+    loop_wakeup();
+
+  return 0;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int loop_socket_cb(CURL *easy, curl_socket_t s, int what, void *userp,
+                          void *socketp) {
+  struct epoll_event ev;
+  (void) easy;
+  (void) userp;
+
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, s, NULL);
+    return 0;
+  }
+
+  memset(&ev, 0, sizeof ev);
+  ev.events  = ((what & CURL_POLL_IN)  ? EPOLLIN  : 0) |
+               ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+  ev.data.fd = s;
+
+  /* libcurl may hand a cached connection to a new transfer, so a socket
+   * we know about isn't necessarily still in the epoll set */
+  if (socketp == NULL) {
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, s, &ev) == -1 && errno == EEXIST)
+      epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, s, &ev);
+    curl_multi_assign(ftpfs.multi, s, &loop);
+  } else if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, s, &ev) == -1 &&
+             errno == ENOENT) {
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, s, &ev);
+  }
+
+  return 0;
+}
+#endif
+
+static void loop_check_done(void) {
+  CURLMsg *msg;
+  int msgs_left;
+
+  while ((msg = curl_multi_info_read(ftpfs.multi, &msgs_left)) != NULL) {
+    struct loop_xfer *xfer = NULL;
+    CURLcode result = msg->data.result;
+
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &xfer);
+    if (xfer && xfer->done)
+      xfer->done(xfer, result);
+  }
+}
+
+static void loop_perform(void) {
+  CURLMcode curlMCode;
+
+  while ((curlMCode = curl_multi_perform(ftpfs.multi, &loop.running_handles)) ==
+         CURLM_CALL_MULTI_PERFORM);
+  if (curlMCode != CURLM_OK)
+    DEBUG(1, "curl_multi_perform problem: %d\n", curlMCode);
+}
+
+static void loop_socket_action(curl_socket_t s, int flags) {
+#ifdef HAVE_SYS_EPOLL_H
+  CURLMcode curlMCode;
+#endif
+
+  if (s == CURL_SOCKET_TIMEOUT)
+    loop.timer_set = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+  curlMCode = curl_multi_socket_action(ftpfs.multi, s, flags,
+                                       &loop.running_handles);
+  if (curlMCode != CURLM_OK)
+    DEBUG(1, "curl_multi_socket_action problem: %d\n", curlMCode);
+#else
+  /* The select() fallback can't tell libcurl which socket is ready */
+  (void) s;
+  (void) flags;
+  loop_perform();
+#endif
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Returns the number of events handled. Called and returns with
+ * ftpfs.lock held. */
+static int loop_wait(long timeout) {
+  struct epoll_event events[MAX_EVENTS];
+  int n, i;
+
+  pthread_mutex_unlock(&ftpfs.lock);
+  n = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, timeout);
+  pthread_mutex_lock(&ftpfs.lock);
+
+  if (n == -1 && errno != EINTR)
+    DEBUG(1, "event_loop: epoll_wait failed: %s\n", strerror(errno));
+
+  for (i = 0; i < n; i++) {
+    int flags = 0;
+
+    if (events[i].data.fd == loop.wake_fds[0]) {
+      loop_drain();
+      continue;
+    }
+
+    if (events[i].events & EPOLLIN)
+      flags |= CURL_CSELECT_IN;
+    if (events[i].events & EPOLLOUT)
+      flags |= CURL_CSELECT_OUT;
+    if (events[i].events & (EPOLLERR | EPOLLHUP))
+      flags |= CURL_CSELECT_ERR;
+
+    loop_socket_action(events[i].data.fd, flags);
+  }
+
+  return n > 0 ? n : 0;
+}
+
+#else
+
+/* Without epoll we ask libcurl for its descriptors on every round, which
+ * also limits us to FD_SETSIZE. Each round runs every transfer, so there
+ * is never anything left for the caller to do: returns 1. Called and
+ * returns with ftpfs.lock held. */
+static int loop_wait(long timeout) {
+  struct timeval tv, *tvp = NULL;
+  fd_set fdread, fdwrite, fdexcep;
+  int maxfd = -1;
+
+  FD_ZERO(&fdread);
+  FD_ZERO(&fdwrite);
+  FD_ZERO(&fdexcep);
+  curl_multi_fdset(ftpfs.multi, &fdread, &fdwrite, &fdexcep, &maxfd);
+  FD_SET(loop.wake_fds[0], &fdread);
+  if (loop.wake_fds[0] > maxfd)
+    maxfd = loop.wake_fds[0];
+
+  if (timeout >= 0) {
+    tv.tv_sec  = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    tvp = &tv;
+  }
+
+  pthread_mutex_unlock(&ftpfs.lock);
+  if (select(maxfd + 1, &fdread, &fdwrite, &fdexcep, tvp) == -1 && errno != EINTR)
+    DEBUG(1, "event_loop: select failed: %s\n", strerror(errno));
+  pthread_mutex_lock(&ftpfs.lock);
+
+  if (FD_ISSET(loop.wake_fds[0], &fdread))
+    loop_drain();
+
+  loop_socket_action(CURL_SOCKET_TIMEOUT, 0);
+  return 1;
+}
+
+#endif
+
+static void *loop_thread(void *data) {
+  (void) data;
+
+  pthread_mutex_lock(&ftpfs.lock);
+  while (loop.running) {
+    long timeout = loop_timeout();
+    int idle = 0;
+
+    if (loop.running_handles && (timeout < 0 || timeout > LOOP_POLL_MS))
+      timeout = LOOP_POLL_MS;
+
+    if (timeout != 0)
+      idle = loop_wait(timeout) == 0;
+
+    if (loop.timer_set && loop_timeout() == 0)
+      loop_socket_action(CURL_SOCKET_TIMEOUT, 0);
+    else if (idle && loop.running_handles)
+      loop_perform();
+
+    loop_check_done();
+  }
+  pthread_mutex_unlock(&ftpfs.lock);
+
+  return NULL;
+}
+
+static int set_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    return -1;
+  return fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+int event_loop_start(void) {
+  int err;
+
+  if (pipe(loop.wake_fds) == -1) {
+    fprintf(stderr, "event_loop: pipe failed: %s\n", strerror(errno));
+    return -1;
+  }
+  if (set_nonblock(loop.wake_fds[0]) == -1 ||
+      set_nonblock(loop.wake_fds[1]) == -1) {
+    fprintf(stderr, "event_loop: fcntl failed: %s\n", strerror(errno));
+    goto fail;
+  }
+
+#ifdef HAVE_SYS_EPOLL_H
+  {
+    struct epoll_event ev;
+
+    loop.epoll_fd = epoll_create(MAX_EVENTS);
+    if (loop.epoll_fd == -1) {
+      fprintf(stderr, "event_loop: epoll_create failed: %s\n", strerror(errno));
+      goto fail;
+    }
+
+    memset(&ev, 0, sizeof ev);
+    ev.events  = EPOLLIN;
+    ev.data.fd = loop.wake_fds[0];
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.wake_fds[0], &ev);
+  }
+
+  curl_multi_setopt(ftpfs.multi, CURLMOPT_SOCKETFUNCTION, loop_socket_cb);
+#endif
+  curl_multi_setopt(ftpfs.multi, CURLMOPT_TIMERFUNCTION, loop_timer_cb);
+
+  loop.timer_set = 0;
+  loop.running_handles = 0;
+  loop.running = 1;
+  err = pthread_create(&loop.thread, NULL, loop_thread, NULL);
+  if (err) {
+    fprintf(stderr, "failed to create thread: %s\n", strerror(err));
+#ifdef HAVE_SYS_EPOLL_H
+    close(loop.epoll_fd);
+#endif
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  close(loop.wake_fds[0]);
+  close(loop.wake_fds[1]);
+  return -1;
+}
+
+void event_loop_stop(void) {
+  pthread_mutex_lock(&ftpfs.lock);
+  if (!loop.running) {
+    pthread_mutex_unlock(&ftpfs.lock);
+    return;
+  }
+  loop.running = 0;
+  pthread_mutex_unlock(&ftpfs.lock);
+
+  loop_wakeup();
+  pthread_join(loop.thread, NULL);
+
+  curl_multi_setopt(ftpfs.multi, CURLMOPT_TIMERFUNCTION, NULL);
+#ifdef HAVE_SYS_EPOLL_H
+  curl_multi_setopt(ftpfs.multi, CURLMOPT_SOCKETFUNCTION, NULL);
+  close(loop.epoll_fd);
+#endif
+  close(loop.wake_fds[0]);
+  close(loop.wake_fds[1]);
+}
+
+void event_loop_add(struct loop_xfer *xfer) {
+  CURLMcode curlMCode;
+
+  curl_easy_setopt_or_die(xfer->easy, CURLOPT_PRIVATE, xfer);
+  curlMCode = curl_multi_add_handle(ftpfs.multi, xfer->easy);
+  if (curlMCode != CURLM_OK) {
+    fprintf(stderr, "curl_multi_add_handle problem: %d\n", curlMCode);
+    exit(1);
+  }
+}
+
+void event_loop_remove(struct loop_xfer *xfer) {
+  CURLMcode curlMCode;
+
+  curlMCode = curl_multi_remove_handle(ftpfs.multi, xfer->easy);
+  if (curlMCode != CURLM_OK) {
+    fprintf(stderr, "curl_multi_remove_handle problem: %d\n", curlMCode);
+    exit(1);
+  }
+}
+
+void event_loop_resume(struct loop_xfer *xfer) {
+  curl_easy_pause(xfer->easy, CURLPAUSE_CONT);
+  loop_wakeup();
+}
@@ -0,0 +1,29 @@
+#ifndef __CURLFTPFS_EVENT_LOOP_H__
+#define __CURLFTPFS_EVENT_LOOP_H__ 1
+
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <curl/curl.h>
+
+/* A transfer driven by the event loop. done() is called from the loop
+ * thread, with ftpfs.lock held, once libcurl reports the transfer as
+ * finished. The handle is still attached to ftpfs.multi at that point. */
+struct loop_xfer {
+  CURL *easy;
+  void (*done)(struct loop_xfer *xfer, CURLcode result);
+};
+
+int  event_loop_start(void);
+void event_loop_stop(void);
+
+/* The following must be called with ftpfs.lock held */
+void event_loop_add(struct loop_xfer *xfer);
+void event_loop_remove(struct loop_xfer *xfer);
+void event_loop_resume(struct loop_xfer *xfer);
+
+#endif
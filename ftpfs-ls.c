@@ -14,6 +14,9 @@
 
 #include <time.h>
 #include <string.h>
+#include <limits.h>
+#include <strings.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -33,73 +36,187 @@ struct cache {
 
 extern struct cache cache;
 
-static int parse_dir_unix(const char *line,
-                          struct stat *sbuf,
-                          char *file,
-                          char *link) {
-  char mode[12];
-  long nlink = 1;
-  char user[33];
-  char group[33];
+/* One entry of a listing. name and link point into the line. */
+struct entry {
+  struct stat stat;
+  const char *name;
+  size_t name_len;
+  const char *link;
+  size_t link_len;
+  /* The cdir or pdir line of an MLSx reply */
+  int self;
+};
+
+/* A string that is reused from one entry to the next */
+struct strbuf {
+  char *p;
+  size_t size;
+};
+
+/* Puts s at offset at of the buffer, NUL terminated */
+static char *strbuf_put(struct strbuf *b, size_t at, const char *s, size_t len) {
+  if (at + len + 1 > b->size) {
+    b->size = b->size ? b->size * 2 : 256;
+    if (b->size < at + len + 1)
+      b->size = at + len + 1;
+    b->p = g_realloc(b->p, b->size);
+  }
+  memcpy(b->p + at, s, len);
+  b->p[at + len] = '\0';
+  return b->p;
+}
+
+/* Converts the line [line, *end) from the server's charset into b, and
+ * returns where the line is now. Lines that conversion wouldn't change
+ * stay where they are. */
+static const char *strbuf_convert(struct strbuf *b, const char *line,
+                                  const char **end) {
+  size_t len = *end - line;
+  size_t size = MB_LEN_MAX * len + 1;
+  ssize_t n;
+
+  if (convert_charsets_noop(ftpfs.codepage, ftpfs.iocharset, line, len))
+    return line;
+  if (b->size < size) {
+    b->size = size;
+    b->p = g_realloc(b->p, b->size);
+  }
+  n = convert_charsets_buf(ftpfs.codepage, ftpfs.iocharset, line, len,
+                           b->p, b->size);
+  if (n == -1)
+    return line;
+  *end = b->p + n;
+  return b->p;
+}
+
+/* The scanners below walk [*p, end) the way the sscanf() conversions
+ * named in their comments would, and advance *p past what they took. */
+
+/* "%Ns" */
+static int scan_word(const char **p, const char *end, size_t max,
+                     const char **word, size_t *len) {
+  const char *s = *p;
+  const char *e;
+
+  while (s < end && isspace((unsigned char)*s)) s++;
+  for (e = s; e < end && (size_t)(e - s) < max &&
+              !isspace((unsigned char)*e); e++)
+    ;
+  if (e == s)
+    return 0;
+  *word = s;
+  *len = e - s;
+  *p = e;
+  return 1;
+}
+
+/* "%*[ \t]" */
+static int scan_blanks(const char **p, const char *end) {
+  const char *s = *p;
+
+  while (s < end && (*s == ' ' || *s == '\t')) s++;
+  if (s == *p)
+    return 0;
+  *p = s;
+  return 1;
+}
+
+/* "%llu" */
+static int scan_number(const char **p, const char *end,
+                       unsigned long long *value) {
+  const char *s = *p;
+  const char *digits;
+  unsigned long long n = 0;
+
+  while (s < end && isspace((unsigned char)*s)) s++;
+  for (digits = s; s < end && *s >= '0' && *s <= '9'; s++)
+    n = n * 10 + (*s - '0');
+  if (s == digits)
+    return 0;
+  *value = n;
+  *p = s;
+  return 1;
+}
+
+/* Copies a word into a small buffer, for strptime() */
+static void word_copy(char *buf, const char *word, size_t len) {
+  memcpy(buf, word, len);
+  buf[len] = '\0';
+}
+
+/* "user group size month day year name", after the mode and link count */
+static int scan_unix_fields(const char *p, const char *end,
+                            unsigned long long *size,
+                            char month[4], char day[3], char year[6],
+                            struct entry *e) {
+  const char *word;
+  size_t len;
+
+  if (!scan_word(&p, end, 32, &word, &len) || !scan_blanks(&p, end) ||
+      !scan_word(&p, end, 32, &word, &len) || !scan_blanks(&p, end) ||
+      !scan_number(&p, end, size) || !scan_blanks(&p, end))
+    return 0;
+  if (!scan_word(&p, end, 3, &word, &len) || !scan_blanks(&p, end))
+    return 0;
+  word_copy(month, word, len);
+  if (!scan_word(&p, end, 2, &word, &len) || !scan_blanks(&p, end))
+    return 0;
+  word_copy(day, word, len);
+  if (!scan_word(&p, end, 5, &word, &len))
+    return 0;
+  word_copy(year, word, len);
+  /* One separator, then the name takes the rest of the line */
+  if (end - p < 2)
+    return 0;
+  e->name = p + 1;
+  e->name_len = end - p - 1;
+  return 1;
+}
+
+static int parse_dir_unix(const char *line, const char *end,
+                          const struct tm *now, struct entry *e) {
+  struct stat *sbuf = &e->stat;
+  const char *mode;
+  size_t mode_len;
+  unsigned long long nlink = 1;
   unsigned long long size;
   char month[4];
   char day[3];
   char year[6];
-  char *link_marker;
-  int i;
+  const char *p = line;
+  const char *q;
+  size_t i;
   char date[20];
   struct tm tm;
-  time_t tt;
-  int res;
 
-  memset(file, 0, sizeof(char)*1024);
-  memset(&tm, 0, sizeof(tm));
-  memset(&tt, 0, sizeof(tt));
-
-#define SPACES "%*[ \t]"
-  res = sscanf(line,
-               "%11s"
-               "%ld"  SPACES
-               "%32s" SPACES
-               "%32s" SPACES
-               "%llu" SPACES
-               "%3s"  SPACES
-               "%2s"  SPACES
-               "%5s"  "%*c"
-               "%1023c",
-               mode, &nlink, user, group, &size, month, day, year, file);
-  if (res < 9) {
-    res = sscanf(line,
-                 "%11s"
-                 "%32s" SPACES
-                 "%32s" SPACES
-                 "%llu" SPACES
-                 "%3s"  SPACES
-                 "%2s"  SPACES
-                 "%5s"  "%*c"
-                 "%1023c",
-                 mode, user, group, &size, month, day, year, file);
-    if (res < 8) {
+  if (!scan_word(&p, end, 11, &mode, &mode_len))
+    return 0;
+  /* The link count is optional; a count that was read is kept even when
+   * the line turns out to have no group */
+  q = p;
+  if (!scan_number(&q, end, &nlink) || !scan_blanks(&q, end) ||
+      !scan_unix_fields(q, end, &size, month, day, year, e)) {
+    if (!scan_unix_fields(p, end, &size, month, day, year, e))
       return 0;
-    }
   }
-#undef SPACES
 
-  link_marker = strstr(file, " -> ");
-  if (link_marker) {
-    strcpy(link, link_marker + 4);
-    *link_marker = '\0';
+  for (i = 0; i + 4 <= e->name_len; i++) {
+    if (!memcmp(e->name + i, " -> ", 4)) {
+      e->link = e->name + i + 4;
+      e->link_len = e->name_len - i - 4;
+      e->name_len = i;
+      break;
+    }
   }
 
-  i = 0;
-  if (mode[i] == 'd') {
+  if (mode[0] == 'd') {
     sbuf->st_mode |= S_IFDIR;
-  } else if (mode[i] == 'l') {
+  } else if (mode[0] == 'l') {
     sbuf->st_mode |= S_IFLNK;
   } else {
     sbuf->st_mode |= S_IFREG;
   }
-  for (i = 1; i < 10; ++i) {
+  for (i = 1; i < 10 && i < mode_len; ++i) {
     if (mode[i] != '-') {
       sbuf->st_mode |= 1 << (9 - i);
     }
@@ -118,9 +235,7 @@ static int parse_dir_unix(const char *line,
   }
 
   sprintf(date,"%s,%s,%s", year, month, day);
-  tt = time(NULL);
-  gmtime_r(&tt, &tm);
-  tm.tm_sec = tm.tm_min = tm.tm_hour = 0;
+  tm = *now;
   if(strchr(year, ':')) {
     int cur_mon = tm.tm_mon;  /* save current month */
     strptime(date, "%H:%M,%b,%d", &tm);
@@ -138,33 +253,34 @@ static int parse_dir_unix(const char *line,
   return 1;
 }
 
-static int parse_dir_win(const char *line,
-                         struct stat *sbuf,
-                         char *file,
-                         char *link) {
+static int parse_dir_win(const char *line, const char *end,
+                         const struct tm *now, struct entry *e) {
+  struct stat *sbuf = &e->stat;
+  const char *p = line;
+  const char *word;
+  size_t len;
   char date[9];
   char hour[8];
   char size[33];
   struct tm tm;
-  time_t tt;
-  int res;
-  (void)link;
-
-  memset(file, 0, sizeof(char)*1024);
-  memset(&tm, 0, sizeof(tm));
-  memset(&tt, 0, sizeof(tt));
 
-  res = sscanf(line, "%8s%*[ \t]%7s%*[ \t]%32s%*[ \t]%1023c",
-               date, hour, size, file);
-  if (res < 4) {
+  if (!scan_word(&p, end, 8, &word, &len) || !scan_blanks(&p, end))
     return 0;
-  }
+  word_copy(date, word, len);
+  if (!scan_word(&p, end, 7, &word, &len) || !scan_blanks(&p, end))
+    return 0;
+  word_copy(hour, word, len);
+  if (!scan_word(&p, end, 32, &word, &len) || !scan_blanks(&p, end) ||
+      p == end)
+    return 0;
+  word_copy(size, word, len);
+  e->name = p;
+  e->name_len = end - p;
 
-  DEBUG(2, "date: %s hour: %s size: %s file: %s\n", date, hour, size, file);
+  DEBUG(2, "date: %s hour: %s size: %s file: %.*s\n",
+        date, hour, size, (int)e->name_len, e->name);
 
-  tt = time(NULL);
-  gmtime_r(&tt, &tm);
-  tm.tm_sec = tm.tm_min = tm.tm_hour = 0;
+  tm = *now;
   strptime(date, "%m-%d-%y", &tm);
   strptime(hour, "%I:%M%p", &tm);
 
@@ -188,28 +304,177 @@ static int parse_dir_win(const char *line,
   return 1;
 }
 
-static int parse_dir_netware(const char *line,
-                             struct stat *sbuf,
-                             char *file,
-                             char *link) {
+static int parse_dir_netware(const char *line, const char *end,
+                             const struct tm *now, struct entry *e) {
   (void) line;
-  (void) sbuf;
-  (void) file;
-  (void) link;
+  (void) end;
+  (void) now;
+  (void) e;
   return 0;
 }
 
+/* Seconds since the epoch for an MLSx time value, YYYYMMDDHHMMSS[.sss],
+ * which is always in UTC. Doesn't go through mktime() and the timezone. */
+static time_t parse_mlsx_time(const char *value, size_t len) {
+  static const int width[6] = { 4, 2, 2, 2, 2, 2 };
+  long v[6];
+  long y, m, era, yoe, doy, doe, days;
+  int i, j;
 
-int parse_dir(const char* list, const char* dir,
-              const char* name, struct stat* sbuf,
-              char* linkbuf, int linklen,
-              fuse_cache_dirh_t h, fuse_cache_dirfil_t filler) {
-  char *file;
-  char *link;
+  if (len < 14)
+    return 0;
+  for (i = 0; i < 6; i++) {
+    v[i] = 0;
+    for (j = 0; j < width[i]; j++, value++) {
+      if (*value < '0' || *value > '9')
+        return 0;
+      v[i] = v[i] * 10 + (*value - '0');
+    }
+  }
+
+  /* Days from 1970-01-01 to the civil date */
+  y = v[0] - (v[1] <= 2);
+  m = v[1];
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + v[2] - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  days = era * 146097 + doe - 719468;
+
+  return (time_t) days * 86400 + v[3] * 3600 + v[4] * 60 + v[5];
+}
+
+/* Value of a number fact, ending wherever the digits do */
+static unsigned long long fact_number(const char *value, const char *end,
+                                      int base) {
+  unsigned long long n = 0;
+
+  for (; value < end && *value >= '0' && *value < '0' + base; value++)
+    n = n * base + (*value - '0');
+  return n;
+}
+
+/* An MLSD line: "fact=value;fact=value; name". The cdir and pdir lines
+ * come back with e->self set. */
+static int parse_dir_mlsx(const char *line, const char *line_end,
+                          const struct tm *now, struct entry *e) {
+  struct stat *sbuf = &e->stat;
+  const char *facts = line;
+  const char *name = memchr(line, ' ', line_end - line);
+  mode_t type = S_IFREG;
+  mode_t perm = 0;
+  int have_perm = 0;
+  unsigned long long size = 0;
+  (void) now;
+
+  if (name == NULL || name + 1 == line_end)
+    return 0;
+
+  while (facts < name) {
+    const char *end = memchr(facts, ';', name - facts);
+    const char *eq = memchr(facts, '=', (end ? end : name) - facts);
+    const char *value;
+    size_t key_len, value_len;
+
+    if (end == NULL)
+      end = name;
+    if (eq == NULL) {
+      facts = end + 1;
+      continue;
+    }
+    key_len = eq - facts;
+    value = eq + 1;
+    value_len = end - value;
+
+#define FACT_IS(s) (key_len == sizeof(s) - 1 && !strncasecmp(facts, s, key_len))
+#define VALUE_IS(s) (value_len == sizeof(s) - 1 && !strncasecmp(value, s, value_len))
+    if (FACT_IS("type")) {
+      if (VALUE_IS("cdir") || VALUE_IS("pdir")) {
+        type = S_IFDIR;
+        e->self = 1;
+      } else if (VALUE_IS("dir")) {
+        type = S_IFDIR;
+      } else if (value_len >= 14 && !strncasecmp(value, "OS.unix=slink:", 14)) {
+        e->link = value + 14;
+        e->link_len = value_len - 14;
+        type = S_IFLNK;
+      } else if (VALUE_IS("OS.unix=symlink")) {
+        type = S_IFLNK;
+      }
+    } else if (FACT_IS("size") || FACT_IS("sizd")) {
+      size = fact_number(value, end, 10);
+    } else if (FACT_IS("modify")) {
+      sbuf->st_atime = sbuf->st_ctime = sbuf->st_mtime =
+        parse_mlsx_time(value, value_len);
+    } else if (FACT_IS("UNIX.mode")) {
+      perm = fact_number(value, end, 8) & 07777;
+      have_perm = 1;
+    }
+#undef VALUE_IS
+#undef FACT_IS
+
+    facts = end + 1;
+  }
+
+  e->name = name + 1;
+  e->name_len = line_end - name - 1;
+
+  if (!have_perm)
+    perm = type == S_IFDIR ? 0755 : type == S_IFLNK ? 0777 : 0644;
+  sbuf->st_mode |= type | perm;
+  sbuf->st_nlink = 1;
+  sbuf->st_size = size;
+  if (ftpfs.blksize) {
+    sbuf->st_blksize = ftpfs.blksize;
+    sbuf->st_blocks =
+      ((size + ftpfs.blksize - 1) & ~((unsigned long long) ftpfs.blksize - 1)) >> 9;
+  }
+
+  return 1;
+}
+
+/* Hands the link target of an entry to the cache and to linkbuf */
+static void add_link(const struct entry *e, const char *full_path,
+                     struct strbuf *link, char *linkbuf, int linklen) {
+  const char *reallink;
+  size_t prefix_len = 0;
+  int linksize;
+
+  if (e->link[0] == '/' && ftpfs.symlink_prefix_len) {
+    prefix_len = ftpfs.symlink_prefix_len;
+    strbuf_put(link, 0, ftpfs.symlink_prefix, prefix_len);
+  }
+  reallink = strbuf_put(link, prefix_len, e->link, e->link_len);
+  linksize = prefix_len + e->link_len;
+  if (cache_enabled()) {
+    cache_add_link(full_path, reallink, linksize+1);
+    DEBUG(1, "cache_add_link: %s %s\n", full_path, reallink);
+  }
+  if (linkbuf && linklen) {
+    if (linksize > linklen) linksize = linklen - 1;
+    strncpy(linkbuf, reallink, linksize);
+    linkbuf[linksize] = '\0';
+  }
+}
+
+/* Walks the listing in place. Names, paths and lines converted from the
+ * server's charset are built in buffers that live for the whole call, so
+ * a long listing costs no allocations per entry. */
+static int parse_list(const char* list, const char* dir,
+                      const char* name, struct stat* sbuf,
+                      char* linkbuf, int linklen,
+                      fuse_cache_dirh_t h, fuse_cache_dirfil_t filler,
+                      int mlsd) {
+  struct strbuf path = { NULL, 0 };
+  struct strbuf link = { NULL, 0 };
+  struct strbuf conv = { NULL, 0 };
+  size_t dir_len = strlen(dir);
   const char *start = list;
-  const char *end = list;
+  const char *end;
   char found = 0;
-  struct stat stat_buf;
+  struct entry e;
+  struct tm now;
+  time_t tt;
 
   if (sbuf) memset(sbuf, 0, sizeof(struct stat));
 
@@ -221,79 +486,214 @@ int parse_dir(const char* list, const char* dir,
     return 0;
   }
 
-  file = malloc(1024);
-  link = malloc(1024);
+  /* Dates in the listing are filled in on top of today */
+  tt = time(NULL);
+  gmtime_r(&tt, &now);
+  now.tm_sec = now.tm_min = now.tm_hour = 0;
+
+  strbuf_put(&path, 0, dir, dir_len);
 
   while ((end = strchr(start, '\n')) != NULL) {
-    char* line;
+    const char *line = start;
+    const char *file;
     int res;
 
-    memset(&stat_buf, 0, sizeof(stat_buf));
+    start = end + 1;
+    if (end > line && *(end-1) == '\r') end--;
 
-    if (end > start && *(end-1) == '\r') end--;
+    if (ftpfs.codepage)
+      line = strbuf_convert(&conv, line, &end);
 
-    line = malloc(end - start + 1);
-    strncpy(line, start, end - start);
-    line[end - start] = '\0';
-    start = *end == '\r' ? end + 2 : end + 1;
+    memset(&e, 0, sizeof(e));
+    if (mlsd)
+      res = parse_dir_mlsx(line, end, &now, &e);
+    else
+      res = parse_dir_unix(line, end, &now, &e) ||
+            parse_dir_win(line, end, &now, &e) ||
+            parse_dir_netware(line, end, &now, &e);
 
-    if (ftpfs.codepage) {
-      convert_charsets(ftpfs.codepage, ftpfs.iocharset, &line);
-    }
+    if (res && !e.self) {
+      const char *full_path = strbuf_put(&path, dir_len, e.name, e.name_len);
+      file = full_path + dir_len;
 
-    file[0] = link[0] = '\0';
-    res = parse_dir_unix(line, &stat_buf, file, link) ||
-          parse_dir_win(line, &stat_buf, file, link) ||
-          parse_dir_netware(line, &stat_buf, file, link);
-
-    if (res) {
-      char *full_path = g_strdup_printf("%s%s", dir, file);
-
-      if (link[0]) {
-        char *reallink;
-        int linksize;
-        if (link[0] == '/' && ftpfs.symlink_prefix_len) {
-          reallink = g_strdup_printf("%s%s", ftpfs.symlink_prefix, link);
-        } else {
-          reallink = g_strdup(link);
-        }
-        linksize = strlen(reallink);
-        if (cache_enabled()) {
-          cache_add_link(full_path, reallink, linksize+1);
-          DEBUG(1, "cache_add_link: %s %s\n", full_path, reallink);
-        }
-        if (linkbuf && linklen) {
-          if (linksize > linklen) linksize = linklen - 1;
-          strncpy(linkbuf, reallink, linksize);
-          linkbuf[linksize] = '\0';
-        }
-        free(reallink);
-      }
+      if (e.link_len)
+        add_link(&e, full_path, &link, linkbuf, linklen);
 
       if (h && filler) {
         DEBUG(1, "filler: %s\n", file);
-        filler(h, file, &stat_buf);
+        filler(h, file, &e.stat);
       } else {
         if (cache_enabled()) {
           DEBUG(1, "cache_add_attr: %s\n", full_path);
-          cache_add_attr(full_path, &stat_buf);
+          cache_add_attr(full_path, &e.stat);
         }
       }
 
       DEBUG(2, "comparing %s %s\n", name, file);
       if (name && !strcmp(name, file)) {
-        if (sbuf) *sbuf = stat_buf;
+        if (sbuf) *sbuf = e.stat;
         found = 1;
       }
+    }
+  }
+
+  g_free(path.p);
+  g_free(link.p);
+  g_free(conv.p);
+
+  return !found;
+}
 
-      free(full_path);
+int parse_dir(const char* list, const char* dir,
+              const char* name, struct stat* sbuf,
+              char* linkbuf, int linklen,
+              fuse_cache_dirh_t h, fuse_cache_dirfil_t filler) {
+  return parse_list(list, dir, name, sbuf, linkbuf, linklen, h, filler, 0);
+}
+
+int parse_dir_mlsd(const char* list, const char* dir,
+                   const char* name, struct stat* sbuf,
+                   char* linkbuf, int linklen,
+                   fuse_cache_dirh_t h, fuse_cache_dirfil_t filler) {
+  return parse_list(list, dir, name, sbuf, linkbuf, linklen, h, filler, 1);
+}
+
+int parse_mlst(const char* reply, const char* path, struct stat* sbuf,
+               char* linkbuf, int linklen) {
+  struct strbuf link = { NULL, 0 };
+  struct strbuf conv = { NULL, 0 };
+  const char *start = reply;
+  const char *line = NULL;
+  const char *line_end = NULL;
+  const char *end;
+  struct entry e;
+  int res;
+
+  /* The facts are on the one line of the reply that starts with a space.
+   * Replies to the commands before MLST come first, so take the last. */
+  while ((end = strchr(start, '\n')) != NULL) {
+    if (*start == ' ') {
+      line = start + 1;
+      line_end = end > start && *(end-1) == '\r' ? end - 1 : end;
     }
+    start = end + 1;
+  }
+  if (line == NULL)
+    return 1;
+
+  if (ftpfs.codepage)
+    line = strbuf_convert(&conv, line, &line_end);
+
+  memset(&e, 0, sizeof(e));
+  res = parse_dir_mlsx(line, line_end, NULL, &e);
+  if (res) {
+    if (e.link_len)
+      add_link(&e, path, &link, linkbuf, linklen);
+    *sbuf = e.stat;
+  }
+
+  g_free(conv.p);
+  g_free(link.p);
+
+  return !res;
+}
+
+int parse_avbl(const char* reply, struct ftp_space* space) {
+  const char *line = reply;
+  const char *found = NULL;
+  char *end;
+  long long avail;
+
+  /* Replies to the commands before AVBL come first, so take the last */
+  while (line && *line) {
+    if (!strncmp(line, "213 ", 4))
+      found = line + 4;
+    line = strchr(line, '\n');
+    if (line) line++;
+  }
+  if (found == NULL || !isdigit((unsigned char) *found))
+    return 1;
+
+  avail = strtoll(found, &end, 10);
+  if (*end != '\r' && *end != '\n' && *end != '\0' && *end != ' ')
+    return 1;
+  space->bytes_free = avail;
+  return 0;
+}
+
+/* A number mod_quotatab printed with %.2f. Done by hand, since strtod()
+ * would go by the locale's decimal point. */
+static int quota_number(const char **p, double unit, double *value) {
+  const char *s = *p + strspn(*p, " \t");
+  double n = 0, scale = 1;
 
-    free(line);
+  if (!isdigit((unsigned char) *s))
+    return 0;
+  while (isdigit((unsigned char) *s))
+    n = n * 10 + (*s++ - '0');
+  if (*s == '.') {
+    for (s++; isdigit((unsigned char) *s); s++) {
+      scale /= 10;
+      n += (*s - '0') * scale;
+    }
   }
+  *value = n * unit;
+  *p = s;
+  return 1;
+}
 
-  free(file);
-  free(link);
+/* "used/limit", or "unlimited", which leaves the counts alone */
+static int quota_pair(const char *p, double unit,
+                      long long *limit, long long *avail) {
+  double used, max;
+
+  if (!quota_number(&p, unit, &used) || *p++ != '/' ||
+      !quota_number(&p, unit, &max))
+    return 0;
+  *limit = max;
+  *avail = max > used ? max - used : 0;
+  return 1;
+}
+
+int parse_quota(const char* reply, struct ftp_space* space) {
+  static const struct {
+    const char *name;
+    double unit;
+  } units[] = {
+    { "bytes:", 1 },
+    { "Kb:", 1024.0 },
+    { "Mb:", 1024.0 * 1024 },
+    { "Gb:", 1024.0 * 1024 * 1024 },
+  };
+  const char *line = reply;
+  int found = 0;
+  size_t i;
+
+  /* What counts is what may still be uploaded:
+   *   200-  Uploaded Mb:\t12.50/100.00
+   *   200-  Uploaded files:\tunlimited */
+  while (line && *line) {
+    const char *p = line;
+    if (isdigit((unsigned char) p[0]) && isdigit((unsigned char) p[1]) &&
+        isdigit((unsigned char) p[2]) && (p[3] == '-' || p[3] == ' '))
+      p += 4;
+    p += strspn(p, " \t");
+    if (!strncmp(p, "Uploaded ", 9)) {
+      p += 9;
+      if (!strncmp(p, "files:", 6)) {
+        found |= quota_pair(p + 6, 1, &space->files, &space->files_free);
+      } else {
+        for (i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+          size_t len = strlen(units[i].name);
+          if (!strncmp(p, units[i].name, len))
+            found |= quota_pair(p + len, units[i].unit,
+                                &space->bytes, &space->bytes_free);
+        }
+      }
+    }
+    line = strchr(line, '\n');
+    if (line) line++;
+  }
 
   return !found;
 }
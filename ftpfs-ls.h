@@ -15,5 +15,28 @@ int parse_dir(const char* list, const char* dir,
               const char* name, struct stat* sbuf,
               char* linkbuf, int linklen,
               fuse_cache_dirh_t h, fuse_cache_dirfil_t filler);
+/* The same for the output of MLSD (RFC 3659) */
+int parse_dir_mlsd(const char* list, const char* dir,
+                   const char* name, struct stat* sbuf,
+                   char* linkbuf, int linklen,
+                   fuse_cache_dirh_t h, fuse_cache_dirfil_t filler);
+/* The stat of path from the reply to MLST (RFC 3659). Fills linkbuf if
+ * it is a symlink whose target the server gave. */
+int parse_mlst(const char* reply, const char* path, struct stat* sbuf,
+               char* linkbuf, int linklen);
+
+/* How much room the server says there is. Counts it didn't give are -1. */
+struct ftp_space {
+  long long bytes;
+  long long bytes_free;
+  long long files;
+  long long files_free;
+};
+
+/* The free bytes from the reply to AVBL */
+int parse_avbl(const char* reply, struct ftp_space* space);
+/* The limits from the reply to SITE QUOTA, as ProFTPD's mod_quotatab
+ * gives them */
+int parse_quota(const char* reply, struct ftp_space* space);
 
 #endif  /* __CURLFTPFS_FTPFS_LS_H__ */
@@ -12,19 +12,20 @@
 
 #include "config.h"
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <stdint.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <fuse.h>
 #include <fuse_opt.h>
 #include <glib.h>
-#include <semaphore.h>
 #include <assert.h>
 
 #include "error.h"
@@ -34,38 +35,113 @@
 #include "ftpfs-ls.h"
 #include "cache.h"
 #include "passwd.h"
+#include "conn_pool.h"
+#include "event_loop.h"
+#include "data_cache.h"
+#include "stats.h"
 #include "ftpfs.h"
 
 #define MAX_BUFFER_LEN (300*1024)
+/* Consecutive sequential reads before the read-ahead window kicks in */
+#define READAHEAD_TRIGGER 2
+/* Range fetched by each connection of a parallel read. Big enough that
+ * setting up a new transfer doesn't show, and a multiple of the data
+ * cache block so that segments can be cached as they come in. */
+#define PARALLEL_SEGMENT (2*1024*1024)
+/* A handle keeps the last few ranges it fetched for readers that jump
+ * around, in chunks of this size. A read away from the stream fetches
+ * just the chunks it needs, so that the stream doesn't have to move. */
+#define READ_CHUNK (64*1024)
+#define READ_CHUNKS 16
 
 struct ftpfs ftpfs;
 static char error_buf[CURL_ERROR_SIZE];
+/* Read-only handles by open_path, under ftpfs.lock */
+static GHashTable *shared_files;
+
+struct ftpfs_file;
+
+/* One of the range fetches of a parallel read */
+struct read_segment {
+  struct loop_xfer xfer;
+  struct ftpfs_file *fh;
+  uint8_t *p;
+  size_t size;       /* of p */
+  off_t offset;
+  size_t len;        /* 0 if the segment is idle */
+  size_t got;
+  int attached;
+  int done;
+  CURLcode result;
+  char error_buf[CURL_ERROR_SIZE];
+};
+
+struct read_chunk {
+  off_t offset;
+  size_t len;        /* 0 if unused, short only at the end of the file */
+  unsigned long used;
+  uint8_t *p;
+};
+
+struct ftpfs_reader;
 
 struct ftpfs_file {
-  struct buffer buf;
+  struct ring buf;
   int dirty;
   int copied;
-  off_t last_offset;
   int can_shrink;
-  pthread_t thread_id;
+  int lazy;          /* opened without fetching anything */
+  int seq_reads;     /* of the reader that read last */
+  struct loop_xfer read_xfer;
+  pthread_cond_t read_cond;
+  int read_waiters;
+  int read_attached;
+  int read_paused;
+  int read_done;
+  CURLcode read_result;
+  off_t read_want;
+  off_t read_floor;
+  struct data_cache_file *dc_file;
+  off_t remote_size;  /* -1 if we don't know it */
+  unsigned long dc_next;
+  int dc_bad;
+  struct read_segment *segs;
+  int par_state;     /* 1 while reading in parallel, -1 once it failed */
+  off_t par_next;
+  struct read_chunk *chunks;
+  unsigned long chunk_clock;
+  struct read_segment range;
+  int refs;          /* opens sharing the handle */
+  struct ftpfs_reader *readers;
+  int shared;        /* in shared_files */
   mode_t mode;
   char * open_path;
   char * full_path;
-  struct buffer stream_buf;
-  CURL *write_conn;
-  sem_t data_avail;
-  sem_t data_need;
-  sem_t data_written;
-  sem_t ready;
+  struct ring stream_buf;
+  CURL *write_conn;  /* set while an upload is running */
+  struct loop_xfer write_xfer;
+  int write_paused;
+  pthread_cond_t write_cond;
   int isready;
   int eof;
-  int written_flag;
+  int write_done;
   int write_fail_cause;
+  off_t write_start;  /* pos when the upload started */
+  off_t write_sent;   /* what libcurl reports it sent */
+  long write_code;    /* the server's final reply */
   int write_may_start;
   char curl_error_buffer[CURL_ERROR_SIZE];
   off_t pos;
 };
 
+/* What each open has to itself, even when it shares the handle */
+struct ftpfs_reader {
+  struct ftpfs_file *fh;
+  struct ftpfs_reader *next;
+  off_t last_offset;
+  int seq_reads;
+};
+
 void ftpfs_curl_easy_setopt_abort(void) {
   fprintf(stderr, "Error setting curl: %s\n", error_buf);
   exit(1);
@@ -76,26 +152,6 @@ void ftpfs_curl_easy_perform_abort(void) {
   exit(1);
 }
 
-void cancel_previous_multi(void) {
-  CURLMcode curlMCode;
-  /* curl_multi_cleanup(ftpfs.multi); */
-
-  if (!ftpfs.attached_to_multi)
-    return;
-
-  DEBUG(1, "cancel previous multi\n");
-
-  curlMCode = curl_multi_remove_handle(ftpfs.multi, ftpfs.connection);
-  if (curlMCode != CURLM_OK) {
-    fprintf(stderr, "curl_multi_remove_handle problem: %d\n", curlMCode);
-    exit(1);
-  }
-
-  ftpfs.attached_to_multi = 0;
-
-  return;
-}
-
 static int op_return(int err, const char * operation)
 {
   if(!err)
@@ -118,8 +174,9 @@ static size_t write_data(void *ptr, size_t size, size_t nmemb, void *data) {
   }
   DEBUG(2, "write_data: %zu\n", to_copy);
   DEBUG(3, "%*s\n", (int)to_copy, (char*)ptr);
-  memcpy(ptr, fh->buf.p + fh->copied, to_copy);
+  ring_copy(&fh->buf, fh->copied, ptr, to_copy);
   fh->copied += to_copy;
+  stats_add(STATS_BYTES_OUT, to_copy);
   return to_copy;
 }
 
@@ -128,15 +185,85 @@ static size_t read_data(void *ptr, size_t size, size_t nmemb, void *data) {
   if (buf == NULL) return size * nmemb;
   if (buf_add_mem(buf, ptr, size * nmemb) == -1)
     return 0;
+  stats_add(STATS_BYTES_IN, size * nmemb);
 
   DEBUG(2, "read_data: %zu\n", size * nmemb);
   DEBUG(3, "%*s\n", (int)(size * nmemb), (char*)ptr);
   return size * nmemb;
 }
 
+/* Collects the replies the server sends on the control connection */
+static size_t reply_header(void *ptr, size_t size, size_t nmemb, void *data) {
+  struct buffer* buf = (struct buffer*)data;
+  if (buf_add_mem(buf, ptr, size * nmemb) == -1)
+    return 0;
+  return size * nmemb;
+}
+
+/* For transfers that are over in one round trip or so */
+static CURLcode timed_perform(CURL *easy, enum stats_timer timer) {
+  uint64_t start = stats_start();
+  CURLcode res = curl_easy_perform(easy);
+  stats_time(timer, start);
+  return res;
+}
+
+static const char *list_command(void) {
+  return ftpfs.custom_list ? ftpfs.custom_list : "LIST -a";
+}
+
+/* Fetches the listing of dir_path into buf, with MLSD if the server has
+ * it. *mlsd tells which parser the listing needs. */
+static CURLcode ftpfs_list(const char *dir_path, struct buffer *buf,
+                           int *mlsd) {
+  CURLcode curl_res;
+  struct ftpfs_conn* conn = conn_pool_get();
+
+  *mlsd = ftpfs.mlsd;
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_URL, dir_path);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_WRITEDATA, buf);
+  if (*mlsd)
+    curl_easy_setopt_or_die(conn->easy, CURLOPT_CUSTOMREQUEST, "MLSD");
+  curl_res = timed_perform(conn->easy, STATS_FTP_LIST);
+  if (curl_res != 0) {
+    DEBUG(1, "%s\n", conn->error_buf);
+  }
+
+  if (*mlsd) {
+    long code = 0;
+    curl_easy_setopt_or_die(conn->easy, CURLOPT_CUSTOMREQUEST, list_command());
+    curl_easy_getinfo(conn->easy, CURLINFO_RESPONSE_CODE, &code);
+    /* Advertised in FEAT but not actually there */
+    if (curl_res != 0 && code >= 500 && code <= 504) {
+      DEBUG(1, "MLSD failed with %ld, using %s from now on\n", code,
+            list_command());
+      ftpfs.mlsd = 0;
+      *mlsd = 0;
+      buf_clear(buf);
+      curl_res = timed_perform(conn->easy, STATS_FTP_LIST);
+      if (curl_res != 0) {
+        DEBUG(1, "%s\n", conn->error_buf);
+      }
+    }
+  }
+  conn_pool_put(conn);
+
+  return curl_res;
+}
+
+static int parse_listing(int mlsd, const char* list, const char* dir,
+                         const char* name, struct stat* sbuf,
+                         char* linkbuf, int linklen,
+                         fuse_cache_dirh_t h, fuse_cache_dirfil_t filler) {
+  if (mlsd)
+    return parse_dir_mlsd(list, dir, name, sbuf, linkbuf, linklen, h, filler);
+  return parse_dir(list, dir, name, sbuf, linkbuf, linklen, h, filler);
+}
+
 static int ftpfs_getdir(const char* path, fuse_cache_dirh_t h,
                         fuse_cache_dirfil_t filler) {
   int err = 0;
+  int mlsd;
   CURLcode curl_res;
   struct buffer buf;
   char* dir_path = get_fulldir_path(path);
@@ -144,20 +271,14 @@ static int ftpfs_getdir(const char* path, fuse_cache_dirh_t h,
   DEBUG(1, "ftpfs_getdir: %s\n", dir_path);
   buf_init(&buf);
 
-  pthread_mutex_lock(&ftpfs.lock);
-  cancel_previous_multi();
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_URL, dir_path);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEDATA, &buf);
-  curl_res = curl_easy_perform(ftpfs.connection);
-  pthread_mutex_unlock(&ftpfs.lock);
+  curl_res = ftpfs_list(dir_path, &buf, &mlsd);
 
   if (curl_res != 0) {
-    DEBUG(1, "%s\n", error_buf);
     err = -EIO;
   } else {
     buf_null_terminate(&buf);
-    parse_dir((char*)buf.p, dir_path + strlen(ftpfs.host) - 1,
-              NULL, NULL, NULL, 0, h, filler);
+    parse_listing(mlsd, (char*)buf.p, dir_path + strlen(ftpfs.host) - 1,
+                  NULL, NULL, NULL, 0, h, filler);
   }
 
   free(dir_path);
@@ -165,32 +286,190 @@ static int ftpfs_getdir(const char* path, fuse_cache_dirh_t h,
   return op_return(err, "ftpfs_getdir");
 }
 
-static int ftpfs_getattr(const char* path, struct stat* sbuf) {
+/* Stats a single name with MLST, so that the parent needn't be listed.
+ * Returns -EAGAIN if the server couldn't tell and listing is the way. */
+static int ftpfs_mlst(const char* path, struct stat* sbuf,
+                      char* linkbuf, int linklen) {
   int err;
+  long code = 0;
   CURLcode curl_res;
   struct buffer buf;
+  struct curl_slist* header = NULL;
+  struct ftpfs_conn* conn;
   char* name;
+  char* cmd;
   char* dir_path = get_dir_path(path);
 
-  DEBUG(2, "ftpfs_getattr: %s dir_path=%s\n", path, dir_path);
+  name = strdup(strrchr(path, '/') + 1);
+  if (ftpfs.codepage) {
+    convert_charsets(ftpfs.iocharset, ftpfs.codepage, &name);
+  }
+  cmd = g_strdup_printf("MLST %s", name);
+  header = curl_slist_append(header, cmd);
   buf_init(&buf);
 
-  pthread_mutex_lock(&ftpfs.lock);
-  cancel_previous_multi();
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_URL, dir_path);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEDATA, &buf);
-  curl_res = curl_easy_perform(ftpfs.connection);
-  pthread_mutex_unlock(&ftpfs.lock);
+  conn = conn_pool_get();
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_URL, dir_path);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_POSTQUOTE, header);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_NOBODY, 1);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_WRITEDATA, NULL);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_HEADERFUNCTION, reply_header);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_HEADERDATA, &buf);
+
+  curl_res = timed_perform(conn->easy, STATS_FTP_COMMAND);
+  curl_easy_getinfo(conn->easy, CURLINFO_RESPONSE_CODE, &code);
+
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_POSTQUOTE, NULL);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_NOBODY, 0);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_HEADERDATA, NULL);
+  if (curl_res != 0)
+    DEBUG(1, "%s\n", conn->error_buf);
+  conn_pool_put(conn);
 
-  if (curl_res != 0) {
-    DEBUG(1, "%s\n", error_buf);
+  if (curl_res == 0) {
+    buf_null_terminate(&buf);
+    err = parse_mlst((char*)buf.p, path, sbuf, linkbuf, linklen) ? -EAGAIN : 0;
+  } else if (code == 550) {
+    /* Either the name or its parent isn't there */
+    err = -ENOENT;
+  } else {
+    if (code >= 500 && code <= 504) {
+      DEBUG(1, "MLST failed with %ld, listing directories from now on\n",
+            code);
+      ftpfs.mlst = 0;
+    }
+    err = -EAGAIN;
+  }
+
+  curl_slist_free_all(header);
+  g_free(cmd);
+  free(name);
+  free(dir_path);
+  buf_free(&buf);
+  return err;
+}
+
+/* Stats a regular file with SIZE and MDTM. Anything else, including
+ * directories, reports -EAGAIN so that the parent gets listed. */
+static int ftpfs_size_mdtm(const char* path, struct stat* sbuf) {
+  CURLcode curl_res;
+  long filetime = -1;
+  struct ftpfs_conn* conn;
+  char* full_path = get_full_path(path);
+#if LIBCURL_VERSION_NUM >= 0x073700
+  curl_off_t size = -1;
+#else
+  double size = -1;
+#endif
+
+  conn = conn_pool_get();
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_URL, full_path);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_NOBODY, 1);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_FILETIME, 1);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_WRITEDATA, NULL);
+
+  curl_res = timed_perform(conn->easy, STATS_FTP_COMMAND);
+  if (curl_res == 0) {
+    curl_easy_getinfo(conn->easy, CURLINFO_FILETIME, &filetime);
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_easy_getinfo(conn->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+#else
+    curl_easy_getinfo(conn->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &size);
+#endif
+  } else {
+    DEBUG(1, "%s\n", conn->error_buf);
+  }
+
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_NOBODY, 0);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_FILETIME, 0);
+  conn_pool_put(conn);
+  free(full_path);
+
+  if (size < 0 || filetime == -1)
+    return -EAGAIN;
+
+  memset(sbuf, 0, sizeof(struct stat));
+  sbuf->st_mode = S_IFREG | 0644;
+  sbuf->st_nlink = 1;
+  sbuf->st_size = size;
+  if (ftpfs.blksize) {
+    sbuf->st_blksize = ftpfs.blksize;
+    sbuf->st_blocks =
+      (((unsigned long long) size + ftpfs.blksize - 1) &
+       ~((unsigned long long) ftpfs.blksize - 1)) >> 9;
+  }
+  sbuf->st_atime = sbuf->st_ctime = sbuf->st_mtime = filetime;
+  return 0;
+}
+
+/* Asks for the size of a regular file with a single SIZE. Returns -EAGAIN
+ * if the server couldn't tell. */
+static int ftpfs_size(const char* path, off_t* size) {
+  CURLcode curl_res;
+  struct ftpfs_conn* conn;
+  char* full_path = get_full_path(path);
+#if LIBCURL_VERSION_NUM >= 0x073700
+  curl_off_t len = -1;
+#else
+  double len = -1;
+#endif
+
+  conn = conn_pool_get();
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_URL, full_path);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_NOBODY, 1);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_WRITEDATA, NULL);
+
+  curl_res = timed_perform(conn->easy, STATS_FTP_COMMAND);
+  if (curl_res == 0) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_easy_getinfo(conn->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len);
+#else
+    curl_easy_getinfo(conn->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &len);
+#endif
+  } else {
+    DEBUG(1, "%s\n", conn->error_buf);
+  }
+
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_NOBODY, 0);
+  conn_pool_put(conn);
+  free(full_path);
+
+  if (len < 0)
+    return -EAGAIN;
+  *size = len;
+  return 0;
+}
+
+static int ftpfs_getattr(const char* path, struct stat* sbuf) {
+  int err;
+  int mlsd;
+  struct buffer buf;
+  char* name;
+  char* dir_path;
+
+  if (path[1] != '\0') {
+    err = -EAGAIN;
+    if (ftpfs.mlst)
+      err = ftpfs_mlst(path, sbuf, NULL, 0);
+    if (err == -EAGAIN && ftpfs.size_mdtm)
+      err = ftpfs_size_mdtm(path, sbuf);
+    if (err != -EAGAIN)
+      return err ? op_return(err, "ftpfs_getattr") : 0;
   }
+
+  dir_path = get_dir_path(path);
+  DEBUG(2, "ftpfs_getattr: %s dir_path=%s\n", path, dir_path);
+  buf_init(&buf);
+
+  ftpfs_list(dir_path, &buf, &mlsd);
+
   buf_null_terminate(&buf);
 
   name = strrchr(path, '/');
   ++name;
-  err = parse_dir((char*)buf.p, dir_path + strlen(ftpfs.host) - 1,
-                  name, sbuf, NULL, 0, NULL, NULL);
+  err = parse_listing(mlsd, (char*)buf.p, dir_path + strlen(ftpfs.host) - 1,
+                      name, sbuf, NULL, 0, NULL, NULL);
 
   free(dir_path);
   buf_free(&buf);
@@ -199,294 +478,921 @@ static int ftpfs_getattr(const char* path, struct stat* sbuf) {
 }
 
 
-static int check_running(void) {
-  int running_handles = 0;
-  curl_multi_perform(ftpfs.multi, &running_handles);
-  return running_handles;
+static struct ftpfs_reader *get_ftpfs_reader(struct fuse_file_info *fi) {
+  return (struct ftpfs_reader *) (uintptr_t) fi->fh;
 }
 
 static struct ftpfs_file *get_ftpfs_file(struct fuse_file_info *fi) {
-  return (struct ftpfs_file *) (uintptr_t) fi->fh;
+  return get_ftpfs_reader(fi)->fh;
 }
 
-static size_t ftpfs_read_chunk(const char* full_path, char* rbuf,
-                               size_t size, off_t offset,
-                               struct fuse_file_info* fi,
-                               int update_offset) {
-  int running_handles = 0;
-  int err = 0;
-  size_t to_copy;
-  struct ftpfs_file* fh = get_ftpfs_file(fi);
+/* How far the stream may run ahead of its reader. Once a reader has
+ * shown to be sequential it gets the full read-ahead window. */
+static off_t read_window(struct ftpfs_file *fh) {
+  if (fh->seq_reads >= READAHEAD_TRIGGER && ftpfs.readahead > MAX_BUFFER_LEN)
+    return ftpfs.readahead;
+  return MAX_BUFFER_LEN;
+}
 
-  DEBUG(2, "ftpfs_read_chunk: %s %p %zu %lld %p %p\n",
-        full_path, rbuf, size, (long long) offset, (void *) fi, (void *) fh);
+/* Must be called with ftpfs.lock held */
+static struct read_chunk *read_chunk_find(struct ftpfs_file *fh,
+                                          off_t offset) {
+  unsigned i;
 
-  pthread_mutex_lock(&ftpfs.lock);
+  if (fh->chunks == NULL)
+    return NULL;
+  for (i = 0; i < READ_CHUNKS; i++) {
+    if (fh->chunks[i].len && fh->chunks[i].offset == offset)
+      return &fh->chunks[i];
+  }
+  return NULL;
+}
 
-  DEBUG(2, "buffer size: %zu %lld\n", fh->buf.len, (long long) fh->buf.begin_offset);
+/* Returns where to put the len bytes at offset, in place of the chunk
+ * least recently used. Must be called with ftpfs.lock held. */
+static uint8_t *read_chunk_add(struct ftpfs_file *fh, off_t offset,
+                               size_t len) {
+  struct read_chunk *chunk;
+  unsigned i;
+
+  if (fh->chunks == NULL)
+    fh->chunks = g_new0(struct read_chunk, READ_CHUNKS);
+
+  chunk = read_chunk_find(fh, offset);
+  if (chunk == NULL) {
+    chunk = &fh->chunks[0];
+    for (i = 1; i < READ_CHUNKS && chunk->len; i++) {
+      if (!fh->chunks[i].len || fh->chunks[i].used < chunk->used)
+        chunk = &fh->chunks[i];
+    }
+  }
+  if (chunk->p == NULL) {
+    chunk->p = malloc(READ_CHUNK);
+    if (chunk->p == NULL)
+      return NULL;
+  }
+  chunk->offset = offset;
+  chunk->len = len;
+  chunk->used = ++fh->chunk_clock;
+  return chunk->p;
+}
 
-  if ((fh->buf.len < size + offset - fh->buf.begin_offset) ||
-      offset < fh->buf.begin_offset ||
-      offset > fh->buf.begin_offset + fh->buf.len) {
-    /* We can't answer this from cache */
-    if (ftpfs.current_fh != fh ||
-        offset < fh->buf.begin_offset ||
-        offset > fh->buf.begin_offset + fh->buf.len ||
-        !check_running()) {
-      CURLMcode curlMCode;
-
-      DEBUG(1, "We need to restart the connection %p\n", ftpfs.connection);
-      DEBUG(2, "current_fh=%p fh=%p\n", (void *) ftpfs.current_fh, (void *) fh);
-      DEBUG(2, "buf.begin_offset=%lld offset=%lld\n", (long long) fh->buf.begin_offset, (long long) offset);
-
-      buf_clear(&fh->buf);
-      fh->buf.begin_offset = offset;
-      ftpfs.current_fh = fh;
-
-      cancel_previous_multi();
-
-      curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_URL, full_path);
-      curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEDATA, &fh->buf);
-      if (offset) {
-        char range[15];
-        snprintf(range, 15, "%lld-", (long long) offset);
-        curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_RANGE, range);
-      }
+/* Copies a range from the chunks. Returns -1 unless all of it is there.
+ * Must be called with ftpfs.lock held. */
+static ssize_t read_chunks_copy(struct ftpfs_file *fh, char *rbuf,
+                                size_t size, off_t offset) {
+  size_t done = 0;
+
+  /* Whatever is past the end is for the stream to find out */
+  if (fh->remote_size >= 0) {
+    if (offset >= fh->remote_size)
+      return -1;
+    if (size > (size_t) (fh->remote_size - offset))
+      size = fh->remote_size - offset;
+  }
 
-      curlMCode = curl_multi_add_handle(ftpfs.multi, ftpfs.connection);
-      if (curlMCode != CURLM_OK)
-      {
-          fprintf(stderr, "curl_multi_add_handle problem: %d\n", curlMCode);
-          exit(1);
-      }
-      ftpfs.attached_to_multi = 1;
-    }
+  while (done < size) {
+    off_t pos = offset + done;
+    struct read_chunk *chunk = read_chunk_find(fh, pos - pos % READ_CHUNK);
+    size_t from = pos % READ_CHUNK;
+    size_t to_copy;
+
+    if (chunk == NULL)
+      return -1;
+    chunk->used = ++fh->chunk_clock;
+    if (from >= chunk->len)
+      break;
+    to_copy = chunk->len - from;
+    if (to_copy > size - done)
+      to_copy = size - done;
+    if (rbuf)
+      memcpy(rbuf + done, chunk->p + from, to_copy);
+    done += to_copy;
+    if (chunk->len < READ_CHUNK)
+      break;
+  }
+  return done;
+}
 
-    while(CURLM_CALL_MULTI_PERFORM ==
-        curl_multi_perform(ftpfs.multi, &running_handles));
+/* Keeps the whole chunks the stream has around where it was last read,
+ * before it moves, for when the reader comes back to them.
+ * Must be called with ftpfs.lock held. */
+static void read_chunks_save(struct ftpfs_file *fh, off_t around) {
+  off_t begin = fh->buf.begin_offset;
+  off_t end = begin + fh->buf.len;
+  off_t pos = around - around % READ_CHUNK - READ_CHUNKS / 4 * READ_CHUNK;
+  off_t stop = pos + READ_CHUNKS / 2 * READ_CHUNK;
+
+  if (pos < begin)
+    pos = begin + (READ_CHUNK - begin % READ_CHUNK) % READ_CHUNK;
+  for (; pos < stop && pos + READ_CHUNK <= end; pos += READ_CHUNK) {
+    uint8_t *p;
+    if (read_chunk_find(fh, pos))
+      continue;
+    p = read_chunk_add(fh, pos, READ_CHUNK);
+    if (p == NULL)
+      return;
+    ring_copy(&fh->buf, pos - begin, p, READ_CHUNK);
+  }
+}
 
-    curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_RANGE, NULL);
+/* Where the stream may drop what came before once it needs the room:
+ * pos for a reader of its own. Readers sharing the handle keep what the
+ * slowest of them still needs, unless that would stall the others.
+ * Must be called with ftpfs.lock held. */
+static off_t read_floor(struct ftpfs_file *fh, off_t pos) {
+  off_t lowest = fh->read_want - MAX_BUFFER_LEN - read_window(fh);
+  struct ftpfs_reader *reader;
+
+  if (fh->refs == 1)
+    return pos;
+  for (reader = fh->readers; reader; reader = reader->next) {
+    if (reader->last_offset < pos)
+      pos = reader->last_offset;
+  }
+  return pos > lowest ? pos : lowest;
+}
 
-    while ((fh->buf.len < size + offset - fh->buf.begin_offset) &&
-        running_handles) {
-      struct timeval timeout;
-      int rc; /* select() return code */
+/* Hands every block the stream has completed to the data cache.
+ * Must be called with ftpfs.lock held. */
+static void read_stream_cache(struct ftpfs_file *fh) {
+  off_t end = fh->buf.begin_offset + fh->buf.len;
 
-      fd_set fdread;
-      fd_set fdwrite;
-      fd_set fdexcep;
-      int maxfd;
+  if (fh->dc_file == NULL || fh->dc_bad)
+    return;
 
-      FD_ZERO(&fdread);
-      FD_ZERO(&fdwrite);
-      FD_ZERO(&fdexcep);
+  if (end > fh->remote_size) {
+    /* Not the file we were told about: don't keep any of it */
+    DEBUG(1, "data_cache: %s is larger than listed\n", fh->open_path);
+    fh->dc_bad = 1;
+    data_cache_discard(fh->dc_file);
+    return;
+  }
 
-      /* set a suitable timeout to play around with */
-      timeout.tv_sec = 1;
-      timeout.tv_usec = 0;
+  for (;;) {
+    off_t start = (off_t) fh->dc_next * DATA_CACHE_BLOCK;
+    off_t stop = start + DATA_CACHE_BLOCK;
+    struct iovec iov[2];
+    int n;
+
+    if (start >= fh->remote_size)
+      break;
+    if (stop > fh->remote_size)
+      stop = fh->remote_size;
+    if (stop > end)
+      break;
+    if (start >= fh->buf.begin_offset) {
+      n = ring_iov(&fh->buf, start - fh->buf.begin_offset, stop - start, iov);
+      data_cache_store(fh->dc_file, fh->dc_next, iov, n);
+    }
+    fh->dc_next++;
+  }
+}
 
-      /* get file descriptors from the transfers */
-      curl_multi_fdset(ftpfs.multi, &fdread, &fdwrite, &fdexcep, &maxfd);
+/* Receives the data of a handle's own download stream, from the event
+ * loop. Once the stream is far enough ahead of its reader, we pause it so
+ * that the others sharing ftpfs.multi don't have to wait for it. */
+static size_t read_stream_data(void *ptr, size_t size, size_t nmemb,
+                               void *data) {
+  struct ftpfs_file *fh = (struct ftpfs_file *) data;
+  off_t ahead = fh->buf.begin_offset + fh->buf.len - fh->read_want;
+  size_t len = size * nmemb;
+
+  if (fh->can_shrink) {
+    /* Make room by forgetting what the reader is done with */
+    if (ring_space(&fh->buf) < len && fh->read_floor > fh->buf.begin_offset) {
+      size_t done = fh->read_floor - fh->buf.begin_offset;
+      size_t need = len - ring_space(&fh->buf);
+      ring_drop(&fh->buf, need < done ? need : done);
+    }
 
-      rc = select(maxfd+1, &fdread, &fdwrite, &fdexcep, &timeout);
-      if (rc == -1) {
-          err = 1;
-          break;
-      }
-      while(CURLM_CALL_MULTI_PERFORM ==
-            curl_multi_perform(ftpfs.multi, &running_handles));
+    if (ahead >= read_window(fh) || ring_space(&fh->buf) < len) {
+      DEBUG(2, "read_stream_data: pausing %p ahead=%lld\n",
+            (void *) fh, (long long) ahead);
+      fh->read_paused = 1;
+      return CURL_WRITEFUNC_PAUSE;
     }
+  }
 
-    if (running_handles == 0) {
-      int msgs_left = 1;
-      while (msgs_left) {
-        CURLMsg* msg = curl_multi_info_read(ftpfs.multi, &msgs_left);
-        if (msg == NULL ||
-            msg->msg != CURLMSG_DONE ||
-            msg->data.result != CURLE_OK) {
-          DEBUG(1, "error: curl_multi_info %d\n", msg->msg);
-          err = 1;
-        }
-      }
+  if (ring_add_mem(&fh->buf, ptr, len) == -1)
+    return 0;
+  stats_add(STATS_BYTES_IN, len);
+  read_stream_cache(fh);
+
+  DEBUG(2, "read_stream_data: %zu\n", len);
+  if (fh->read_waiters)
+    pthread_cond_broadcast(&fh->read_cond);
+  return len;
+}
+
+static void read_stream_done(struct loop_xfer *xfer, CURLcode result) {
+  struct ftpfs_file *fh = (struct ftpfs_file *)
+    ((char *) xfer - offsetof(struct ftpfs_file, read_xfer));
+
+  fh->read_done = 1;
+  fh->read_result = result;
+  if (result != CURLE_OK)
+    DEBUG(1, "error: curl_multi_info %d %s\n", result, fh->curl_error_buffer);
+  else if (fh->dc_file && !fh->dc_bad &&
+           fh->buf.begin_offset + (off_t) fh->buf.len != fh->remote_size) {
+    DEBUG(1, "data_cache: %s is smaller than listed\n", fh->open_path);
+    fh->dc_bad = 1;
+    data_cache_discard(fh->dc_file);
+  }
+  pthread_cond_broadcast(&fh->read_cond);
+}
+
+/* Must be called with ftpfs.lock held */
+static void read_stream_detach(struct ftpfs_file *fh) {
+  if (!fh->read_attached)
+    return;
+
+  DEBUG(1, "cancel previous multi %p\n", (void *) fh);
+
+  event_loop_remove(&fh->read_xfer);
+  fh->read_attached = 0;
+  fh->read_paused = 0;
+}
+
+/* Must be called with ftpfs.lock held */
+static int read_stream_start(struct ftpfs_file *fh, const char *full_path,
+                             off_t offset) {
+  CURL *easy = fh->read_xfer.easy;
+
+  if (easy == NULL) {
+    easy = curl_easy_init();
+    if (easy == NULL) {
+      fprintf(stderr, "Error initializing libcurl\n");
+      return -1;
     }
+    set_common_curl_stuff(easy);
+    curl_easy_setopt_or_die(easy, CURLOPT_WRITEFUNCTION, read_stream_data);
+    curl_easy_setopt_or_die(easy, CURLOPT_WRITEDATA, fh);
+    curl_easy_setopt_or_die(easy, CURLOPT_ERRORBUFFER, fh->curl_error_buffer);
+    fh->read_xfer.easy = easy;
+    fh->read_xfer.done = read_stream_done;
   }
 
-  to_copy = fh->buf.len + fh->buf.begin_offset - offset;
-  size = size > to_copy ? to_copy : size;
-  if (rbuf) {
-    memcpy(rbuf, fh->buf.p + offset - fh->buf.begin_offset, size);
+  read_stream_detach(fh);
+
+  /* Start on a block boundary, so that what we get can be cached */
+  if (fh->dc_file && !fh->dc_bad) {
+    fh->dc_next = offset / DATA_CACHE_BLOCK;
+    offset = (off_t) fh->dc_next * DATA_CACHE_BLOCK;
   }
 
-  if (update_offset) {
-    fh->last_offset = offset + size;
+  DEBUG(1, "We need to restart the connection %p\n", (void *) easy);
+  DEBUG(2, "buf.begin_offset=%lld offset=%lld\n", (long long) fh->buf.begin_offset, (long long) offset);
+
+  ring_clear(&fh->buf);
+  fh->buf.begin_offset = offset;
+  fh->read_floor = offset;
+  fh->read_done = 0;
+  fh->read_result = CURLE_OK;
+
+  curl_easy_setopt_or_die(easy, CURLOPT_URL, full_path);
+  if (offset) {
+    char range[15];
+    snprintf(range, 15, "%lld-", (long long) offset);
+    curl_easy_setopt_or_die(easy, CURLOPT_RANGE, range);
+  } else {
+    curl_easy_setopt_or_die(easy, CURLOPT_RANGE, NULL);
   }
 
-  /* Check if the buffer is growing and we can delete a part of it */
-  if (fh->can_shrink && fh->buf.len > MAX_BUFFER_LEN) {
-    DEBUG(2, "Shrinking buffer from %zu to %zu bytes\n",
-          fh->buf.len, to_copy - size);
-    memmove(fh->buf.p,
-            fh->buf.p + offset - fh->buf.begin_offset + size,
-            to_copy - size);
-    fh->buf.len = to_copy - size;
-    fh->buf.begin_offset = offset + size;
+  event_loop_add(&fh->read_xfer);
+  fh->read_attached = 1;
+
+  return 0;
+}
+
+static size_t segment_data(void *ptr, size_t size, size_t nmemb,
+                           void *data) {
+  struct read_segment *seg = (struct read_segment *) data;
+  size_t len = size * nmemb;
+  size_t to_copy = seg->len - seg->got;
+
+  if (to_copy > len)
+    to_copy = len;
+  memcpy(seg->p + seg->got, ptr, to_copy);
+  seg->got += to_copy;
+  stats_add(STATS_BYTES_IN, len);
+
+  if (seg->fh->read_waiters)
+    pthread_cond_broadcast(&seg->fh->read_cond);
+  return len;
+}
+
+static void segment_done(struct loop_xfer *xfer, CURLcode result) {
+  struct read_segment *seg = (struct read_segment *)
+    ((char *) xfer - offsetof(struct read_segment, xfer));
+  struct ftpfs_file *fh = seg->fh;
+
+  seg->done = 1;
+  seg->result = result;
+  if (result != CURLE_OK)
+    DEBUG(1, "error: segment at %lld: %d %s\n",
+          (long long) seg->offset, result, seg->error_buf);
+  if (result == CURLE_FTP_COULDNT_USE_REST && seg == &fh->range) {
+    DEBUG(1, "server doesn't support REST, not fetching ranges\n");
+    ftpfs.no_range = 1;
   }
 
-  pthread_mutex_unlock(&ftpfs.lock);
+  if (result == CURLE_OK && seg->got == seg->len && seg == &fh->range) {
+    size_t pos;
+    for (pos = 0; pos < seg->len; pos += READ_CHUNK) {
+      size_t len = seg->len - pos < READ_CHUNK ? seg->len - pos : READ_CHUNK;
+      uint8_t *p = read_chunk_add(fh, seg->offset + pos, len);
+      if (p == NULL)
+        break;
+      memcpy(p, seg->p + pos, len);
+    }
+  }
 
-  if (err) return CURLFTPFS_BAD_READ;
-  return size;
+  /* The cache only queues a copy of each block; its writer thread does
+   * the disk I/O, away from the loop and ftpfs.lock */
+  if (result == CURLE_OK && seg->got == seg->len &&
+      seg->offset % DATA_CACHE_BLOCK == 0 && fh->dc_file && !fh->dc_bad) {
+    size_t pos;
+    for (pos = 0; pos < seg->len; pos += DATA_CACHE_BLOCK) {
+      struct iovec iov;
+      iov.iov_base = seg->p + pos;
+      iov.iov_len = seg->len - pos < DATA_CACHE_BLOCK ?
+                    seg->len - pos : DATA_CACHE_BLOCK;
+      data_cache_store(fh->dc_file, (seg->offset + pos) / DATA_CACHE_BLOCK,
+                       &iov, 1);
+    }
+  }
+  pthread_cond_broadcast(&fh->read_cond);
 }
 
-static size_t write_data_bg(void *ptr, size_t size, size_t nmemb, void *data) {
-  struct ftpfs_file *fh = data;
-  size_t to_copy = size * nmemb;
+/* Must be called with ftpfs.lock held */
+static void segment_stop(struct read_segment *seg) {
+  if (seg->attached) {
+    event_loop_remove(&seg->xfer);
+    seg->attached = 0;
+  }
+  seg->len = 0;
+}
 
-  if (!fh->isready) {
-    sem_post(&fh->ready);
-    fh->isready = 1;
+/* Fetches up to max bytes from offset on.
+ * Must be called with ftpfs.lock held. */
+static int segment_start(struct ftpfs_file *fh, struct read_segment *seg,
+                         off_t offset, size_t max) {
+  CURL *easy = seg->xfer.easy;
+  char range[48];
+
+  segment_stop(seg);
+  if (offset >= fh->remote_size)
+    return 0;
+
+  if (seg->size < max) {
+    uint8_t *p = realloc(seg->p, max);
+    if (p == NULL)
+      return -1;
+    seg->p = p;
+    seg->size = max;
   }
 
-  if (fh->stream_buf.len == 0 && fh->written_flag) {
-    sem_post(&fh->data_written); /* ftpfs_write can return */
+  if (easy == NULL) {
+    easy = curl_easy_init();
+    if (easy == NULL) {
+      fprintf(stderr, "Error initializing libcurl\n");
+      return -1;
+    }
+    set_common_curl_stuff(easy);
+    curl_easy_setopt_or_die(easy, CURLOPT_WRITEFUNCTION, segment_data);
+    curl_easy_setopt_or_die(easy, CURLOPT_WRITEDATA, seg);
+    curl_easy_setopt_or_die(easy, CURLOPT_ERRORBUFFER, seg->error_buf);
+    curl_easy_setopt_or_die(easy, CURLOPT_URL, fh->full_path);
+    seg->xfer.easy = easy;
+    seg->xfer.done = segment_done;
+    seg->fh = fh;
+  }
+
+  seg->offset = offset;
+  seg->len = fh->remote_size - offset < (off_t) max ?
+             fh->remote_size - offset : max;
+  seg->got = 0;
+  seg->done = 0;
+  seg->result = CURLE_OK;
+
+  DEBUG(2, "segment_start: %lld+%zu\n", (long long) offset, seg->len);
+  snprintf(range, sizeof range, "%lld-%lld", (long long) offset,
+           (long long) (offset + seg->len - 1));
+  curl_easy_setopt_or_die(easy, CURLOPT_RANGE, range);
+
+  event_loop_add(&seg->xfer);
+  seg->attached = 1;
+  return 0;
+}
+
+/* Must be called with ftpfs.lock held */
+static void read_parallel_stop(struct ftpfs_file *fh) {
+  unsigned i;
+
+  if (fh->segs == NULL)
+    return;
+  for (i = 0; i < ftpfs.parallel_get; i++)
+    segment_stop(&fh->segs[i]);
+}
+
+/* Points every segment at the next range from offset on.
+ * Must be called with ftpfs.lock held. */
+static int read_parallel_start(struct ftpfs_file *fh, off_t offset) {
+  unsigned i;
+
+  if (fh->segs == NULL)
+    fh->segs = g_new0(struct read_segment, ftpfs.parallel_get);
+
+  read_stream_detach(fh);
+  fh->par_next = offset - offset % PARALLEL_SEGMENT;
+  for (i = 0; i < ftpfs.parallel_get; i++) {
+    if (segment_start(fh, &fh->segs[i], fh->par_next,
+                      PARALLEL_SEGMENT) == -1)
+      return -1;
+    fh->par_next += PARALLEL_SEGMENT;
   }
+  return 0;
+}
 
-  sem_wait(&fh->data_avail);
+static struct read_segment *read_parallel_find(struct ftpfs_file *fh,
+                                               off_t offset) {
+  unsigned i;
 
-  DEBUG(2, "write_data_bg: data_avail eof=%d\n", fh->eof);
+  for (i = 0; i < ftpfs.parallel_get; i++) {
+    struct read_segment *seg = &fh->segs[i];
+    if (seg->len && offset >= seg->offset &&
+        offset < seg->offset + (off_t) seg->len)
+      return seg;
+  }
+  return NULL;
+}
 
-  if (fh->eof)
+/* Serves a sequential read from segments fetched over several
+ * connections at once. Returns -1 if a segment failed, so that the
+ * caller can fall back to a single stream.
+ * Must be called with ftpfs.lock held. */
+static ssize_t read_parallel(struct ftpfs_file *fh, char *rbuf, size_t size,
+                             off_t offset) {
+  size_t done = 0;
+  unsigned i;
+
+  if (offset >= fh->remote_size)
     return 0;
+  if (size > (size_t) (fh->remote_size - offset))
+    size = fh->remote_size - offset;
+
+  if (fh->segs == NULL || read_parallel_find(fh, offset) == NULL) {
+    DEBUG(1, "read_parallel: starting %u segments at %lld\n",
+          ftpfs.parallel_get, (long long) offset);
+    if (read_parallel_start(fh, offset) == -1)
+      return -1;
+  }
 
-  DEBUG(2, "write_data_bg: %zu %zu\n", to_copy, fh->stream_buf.len);
-  if (to_copy > fh->stream_buf.len)
-    to_copy = fh->stream_buf.len;
+  while (done < size) {
+    off_t pos = offset + done;
+    struct read_segment *seg = read_parallel_find(fh, pos);
+    off_t seg_offset;
+    size_t from, to_copy;
+
+    /* Another reader moved the segments on */
+    if (seg == NULL) {
+      if (read_parallel_start(fh, pos) == -1)
+        return -1;
+      continue;
+    }
 
-  memcpy(ptr, fh->stream_buf.p, to_copy);
-  if (fh->stream_buf.len > to_copy) {
-    size_t newlen = fh->stream_buf.len - to_copy;
-    memmove(fh->stream_buf.p, fh->stream_buf.p + to_copy, newlen);
-    fh->stream_buf.len = newlen;
-    sem_post(&fh->data_avail);
-    DEBUG(2, "write_data_bg: data_avail\n");
+    seg_offset = seg->offset;
+    from = pos - seg->offset;
+    to_copy = seg->len - from;
+    if (to_copy > size - done)
+      to_copy = size - done;
+
+    fh->read_waiters++;
+    while (seg->len && seg->offset == seg_offset &&
+           seg->got < from + to_copy && !seg->done)
+      pthread_cond_wait(&fh->read_cond, &ftpfs.lock);
+    fh->read_waiters--;
+
+    if (!seg->len || seg->offset != seg_offset)
+      continue;
+    if (seg->got < from + to_copy)
+      return -1;
+
+    if (rbuf)
+      memcpy(rbuf + done, seg->p + from, to_copy);
+    done += to_copy;
+  }
 
-  } else {
-    fh->stream_buf.len = 0;
-    fh->written_flag = 1;
-    sem_post(&fh->data_need);
-    DEBUG(2, "write_data_bg: data_need\n");
+  /* Segments the reader has left behind go fetch the next ranges */
+  for (i = 0; i < ftpfs.parallel_get; i++) {
+    struct read_segment *seg = &fh->segs[i];
+    if (seg->len && seg->offset + (off_t) seg->len <= offset &&
+        fh->par_next < fh->remote_size) {
+      if (segment_start(fh, seg, fh->par_next, PARALLEL_SEGMENT) == -1)
+        return -1;
+      fh->par_next += PARALLEL_SEGMENT;
+    }
   }
 
-  return to_copy;
+  return done;
 }
 
-int write_thread_ctr = 0;
+/* Serves a read that is away from the stream from the chunks, fetching
+ * the missing ones over a connection of their own. Returns -1 if the
+ * caller should move the stream instead.
+ * Must be called with ftpfs.lock held. */
+static ssize_t read_range(struct ftpfs_file *fh, char *rbuf, size_t size,
+                          off_t offset) {
+  struct read_segment *seg = &fh->range;
+  /* Whole blocks can go to the data cache as well */
+  off_t unit = fh->dc_file && !fh->dc_bad ? DATA_CACHE_BLOCK : READ_CHUNK;
+  off_t start = offset - offset % unit;
+  off_t end = offset + size;
+  int fetched = 0;
+
+  end += (unit - end % unit) % unit;
+  if (end > fh->remote_size)
+    end = fh->remote_size;
+  if (end - start > READ_CHUNKS / 2 * READ_CHUNK)
+    return -1;
+
+  for (;;) {
+    ssize_t res;
+
+    /* Another reader may be fetching just what we need */
+    fh->read_waiters++;
+    while (seg->len && !seg->done)
+      pthread_cond_wait(&fh->read_cond, &ftpfs.lock);
+    fh->read_waiters--;
+
+    res = read_chunks_copy(fh, rbuf, size, offset);
+    if (res >= 0 || fetched || ftpfs.no_range)
+      return res;
+
+    DEBUG(2, "read_range: %lld-%lld\n", (long long) start, (long long) end);
+    if (segment_start(fh, seg, start, end - start) == -1)
+      return -1;
+    stats_add(STATS_READ_RANGE, 1);
+    fetched = 1;
+  }
+}
 
-static void *ftpfs_write_thread(void *data) {
-  struct ftpfs_file *fh = data;
-  CURLcode curl_res;
+static size_t ftpfs_read_chunk(const char* full_path, char* rbuf,
+                               size_t size, off_t offset,
+                               struct fuse_file_info* fi,
+                               int update_offset) {
+  int err = 0;
+  size_t to_copy;
+  off_t window, skip = 0;
+  struct ftpfs_reader *reader = get_ftpfs_reader(fi);
+  struct ftpfs_file* fh = reader->fh;
+
+  DEBUG(2, "ftpfs_read_chunk: %s %p %zu %lld %p %p\n",
+        full_path, rbuf, size, (long long) offset, (void *) fi, (void *) fh);
+
+  if (fh->dc_file && !fh->dc_bad) {
+    ssize_t res = data_cache_read(fh->dc_file, offset, rbuf, size);
+    if (res >= 0) {
+      DEBUG(2, "data_cache: hit %lld %zd\n", (long long) offset, res);
+      if (update_offset) {
+        pthread_mutex_lock(&ftpfs.lock);
+        reader->last_offset = offset + res;
+        pthread_mutex_unlock(&ftpfs.lock);
+      }
+      return res;
+    }
+  }
 
-  DEBUG(2, "enter streaming write thread #%d path=%s pos=%lld\n", ++write_thread_ctr, fh->full_path, (long long) fh->pos);
+  pthread_mutex_lock(&ftpfs.lock);
+
+  DEBUG(2, "buffer size: %zu %lld\n", fh->buf.len, (long long) fh->buf.begin_offset);
 
+  /* The kernel may hand us a sequential stream slightly out of order, so
+   * anything close to where the last read stopped counts */
+  if (update_offset) {
+    if (offset >= reader->last_offset - MAX_BUFFER_LEN &&
+        offset <= reader->last_offset + MAX_BUFFER_LEN)
+      reader->seq_reads++;
+    else
+      reader->seq_reads = 0;
+    fh->seq_reads = reader->seq_reads;
+  }
+  window = read_window(fh);
+
+  /* A large file read sequentially comes in faster over several
+   * connections than over one */
+  /* Readers sharing the handle would pull the segments back and forth */
+  if (fh->par_state == 1 &&
+      (fh->seq_reads < READAHEAD_TRIGGER || fh->refs > 1)) {
+    read_parallel_stop(fh);
+    fh->par_state = 0;
+  } else if (fh->par_state == 0 && update_offset && fh->can_shrink &&
+             fh->seq_reads >= READAHEAD_TRIGGER && fh->refs == 1 &&
+             ftpfs.parallel_get > 1 &&
+             fh->remote_size >= (off_t) ftpfs.parallel_min_size) {
+    fh->par_state = 1;
+  }
+  if (fh->par_state == 1) {
+    ssize_t res = read_parallel(fh, rbuf, size, offset);
+    if (res >= 0) {
+      reader->last_offset = offset + res;
+      pthread_mutex_unlock(&ftpfs.lock);
+      return res;
+    }
+    DEBUG(1, "read_parallel failed, falling back to a single stream\n");
+    read_parallel_stop(fh);
+    fh->par_state = -1;
+  }
 
-  curl_easy_setopt_or_die(fh->write_conn, CURLOPT_URL, fh->full_path);
-  curl_easy_setopt_or_die(fh->write_conn, CURLOPT_UPLOAD, 1);
-  curl_easy_setopt_or_die(fh->write_conn, CURLOPT_READFUNCTION, write_data_bg);
-  curl_easy_setopt_or_die(fh->write_conn, CURLOPT_READDATA, fh);
-  curl_easy_setopt_or_die(fh->write_conn, CURLOPT_LOW_SPEED_LIMIT, 1);
-  curl_easy_setopt_or_die(fh->write_conn, CURLOPT_LOW_SPEED_TIME, 60);
+  /* Size the ring once for the window and the request, and for readers
+   * lagging behind by up to a window if the handle is shared; a streaming
+   * reader never makes it grow after that */
+  if (fh->can_shrink &&
+      ring_reserve(&fh->buf, window + 2 * MAX_BUFFER_LEN +
+                   (fh->refs > 1 ? window : 0) +
+                   (size > MAX_BUFFER_LEN ? size : 0)) == -1) {
+    pthread_mutex_unlock(&ftpfs.lock);
+    return CURLFTPFS_BAD_READ;
+  }
 
-  fh->curl_error_buffer[0] = '\0';
-  curl_easy_setopt_or_die(fh->write_conn, CURLOPT_ERRORBUFFER, fh->curl_error_buffer);
+  /* A sequential reader that skips a little ahead is better off waiting
+   * for the stream than restarting it */
+  if (fh->seq_reads >= READAHEAD_TRIGGER)
+    skip = window;
+
+again:
+  if (update_offset &&
+      ((fh->buf.len < size + offset - fh->buf.begin_offset) ||
+       offset < fh->buf.begin_offset ||
+       offset > fh->buf.begin_offset + fh->buf.len)) {
+    ssize_t res = read_chunks_copy(fh, rbuf, size, offset);
+    if (res >= 0) {
+      stats_add(STATS_READ_CHUNK_HIT, 1);
+    } else if (fh->can_shrink && !ftpfs.no_range &&
+               offset < fh->remote_size &&
+               fh->read_attached && fh->read_result == CURLE_OK &&
+               (offset < fh->buf.begin_offset ||
+                (fh->seq_reads < READAHEAD_TRIGGER &&
+                 offset > fh->buf.begin_offset + fh->buf.len + skip))) {
+      /* Leave the stream for the reader to come back to, or it would
+       * have to start over */
+      res = read_range(fh, rbuf, size, offset);
+    }
+    if (res >= 0) {
+      reader->last_offset = offset + res;
+      pthread_mutex_unlock(&ftpfs.lock);
+      return res;
+    }
+  }
 
-  if (fh->pos > 0) {
-    /* resuming a streaming write */
-    /*
-    char range[15];
-    snprintf(range, 15, "%lld-", (long long) fh->pos);
-    curl_easy_setopt_or_die(fh->write_conn, CURLOPT_RANGE, range);
-    */
+  if ((fh->buf.len < size + offset - fh->buf.begin_offset) ||
+      offset < fh->buf.begin_offset ||
+      offset > fh->buf.begin_offset + fh->buf.len) {
+    /* We can't answer this from cache */
+    off_t last_read = fh->read_floor;
+    fh->read_want = offset + size;
+    fh->read_floor = read_floor(fh, offset);
+    if (!fh->read_attached ||
+        offset < fh->buf.begin_offset ||
+        offset > fh->buf.begin_offset + fh->buf.len + skip ||
+        (fh->read_done && fh->read_result != CURLE_OK)) {
+      if (fh->read_xfer.easy != NULL)
+        stats_add(STATS_READ_RESTART, 1);
+      read_chunks_save(fh, last_read);
+      if (read_stream_start(fh, full_path, offset) == -1) {
+        pthread_mutex_unlock(&ftpfs.lock);
+        return CURLFTPFS_BAD_READ;
+      }
+    } else if (fh->read_paused) {
+      fh->read_paused = 0;
+      event_loop_resume(&fh->read_xfer);
+    }
+
+    /* The event loop wakes us up as data for this stream comes in */
+    fh->read_waiters++;
+    while (offset >= fh->buf.begin_offset &&
+        (fh->buf.len < size + offset - fh->buf.begin_offset) &&
+        !fh->read_done) {
+      pthread_cond_wait(&fh->read_cond, &ftpfs.lock);
+    }
+    fh->read_waiters--;
+
+    /* Another reader of the handle moved the stream past us */
+    if (offset < fh->buf.begin_offset)
+      goto again;
+
+    if (fh->read_done && fh->read_result != CURLE_OK)
+      err = 1;
+  }
+
+  /* A stream that ended before reaching a skipped-to offset hit EOF */
+  if (offset > fh->buf.begin_offset + fh->buf.len)
+    to_copy = 0;
+  else
+    to_copy = fh->buf.len + fh->buf.begin_offset - offset;
+  size = size > to_copy ? to_copy : size;
+  if (rbuf) {
+    ring_copy(&fh->buf, offset - fh->buf.begin_offset, rbuf, size);
+  }
+
+  if (update_offset) {
+    reader->last_offset = offset + size;
+  }
+
+  /* The stream may overwrite everything before this once it needs the
+   * room. Until then it stays around for readers that look back. */
+  fh->read_floor = read_floor(fh, offset + size);
+
+  pthread_mutex_unlock(&ftpfs.lock);
+
+  if (err) return CURLFTPFS_BAD_READ;
+  return size;
+}
 
-    curl_easy_setopt_or_die(fh->write_conn, CURLOPT_APPEND, 1);
+/* Feeds the upload from the queue ftpfs_write fills, from the event loop.
+ * An empty queue pauses the upload until there is more to send. */
+static size_t write_data_bg(void *ptr, size_t size, size_t nmemb, void *data) {
+  struct ftpfs_file *fh = data;
+  size_t to_copy = size * nmemb;
 
-    /*curl_easy_setopt_or_die(fh->write_conn, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)fh->pos); */
+  if (!fh->isready) {
+    fh->isready = 1;
+    pthread_cond_broadcast(&fh->write_cond);
   }
 
-  curl_res = curl_easy_perform(fh->write_conn);
+  if (fh->stream_buf.len == 0 && !fh->eof) {
+    fh->write_paused = 1;
+    return CURL_READFUNC_PAUSE;
+  }
+
+  DEBUG(2, "write_data_bg: %zu %zu eof=%d\n", to_copy, fh->stream_buf.len,
+        fh->eof);
+  if (to_copy > fh->stream_buf.len)
+    to_copy = fh->stream_buf.len;
+
+  ring_copy(&fh->stream_buf, 0, ptr, to_copy);
+  ring_drop(&fh->stream_buf, to_copy);
+  stats_add(STATS_BYTES_OUT, to_copy);
+  /* There's room in the queue again */
+  pthread_cond_broadcast(&fh->write_cond);
 
-  curl_easy_setopt_or_die(fh->write_conn, CURLOPT_UPLOAD, 0);
+  return to_copy;
+}
 
-  if (!fh->isready)
-    sem_post(&fh->ready);
+static void write_stream_done(struct loop_xfer *xfer, CURLcode result) {
+  struct ftpfs_file *fh = (struct ftpfs_file *)
+    ((char *) xfer - offsetof(struct ftpfs_file, write_xfer));
 
-  if (curl_res != CURLE_OK)
+  if (result != CURLE_OK)
+  {
+    DEBUG(1, "write problem: %d(%s) text=%s\n", result, curl_easy_strerror(result), fh->curl_error_buffer);
+    fh->write_fail_cause = result;
+  }
+  else
   {
-    DEBUG(1, "write problem: %d(%s) text=%s\n", curl_res, curl_easy_strerror(curl_res), fh->curl_error_buffer);
-    fh->write_fail_cause = curl_res;
-    /* problem - let ftpfs_write continue to avoid hang */
-    sem_post(&fh->data_need);
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t sent = -1;
+    curl_easy_getinfo(xfer->easy, CURLINFO_SIZE_UPLOAD_T, &sent);
+#else
+    double sent = -1;
+    curl_easy_getinfo(xfer->easy, CURLINFO_SIZE_UPLOAD, &sent);
+#endif
+    fh->write_sent = sent;
+    curl_easy_getinfo(xfer->easy, CURLINFO_RESPONSE_CODE, &fh->write_code);
   }
+  /* let ftpfs_write and ftpfs_flush continue to avoid hang */
+  fh->isready = 1;
+  fh->write_done = 1;
+  pthread_cond_broadcast(&fh->write_cond);
+}
 
-  DEBUG(2, "leaving streaming write thread #%d curl_res=%d\n", write_thread_ctr--, curl_res);
+/* Must be called with ftpfs.lock held */
+static void write_stream_kick(struct ftpfs_file *fh) {
+  if (fh->write_paused) {
+    fh->write_paused = 0;
+    event_loop_resume(&fh->write_xfer);
+  }
+}
 
-  sem_post(&fh->data_written); /* ftpfs_write may return */
+/* Upload handles of finished writes, kept for the next ones. Their
+ * connections stay logged in, in the connection cache of ftpfs.multi,
+ * so a new upload usually goes out on one of them. Protected by
+ * ftpfs.lock. */
+static GPtrArray *idle_uploads;
+
+/* Must be called with ftpfs.lock held */
+static CURL *upload_handle_get(void) {
+  CURL *easy;
+
+  if (idle_uploads && idle_uploads->len)
+    return g_ptr_array_remove_index_fast(idle_uploads, idle_uploads->len - 1);
+
+  easy = curl_easy_init();
+  if (easy == NULL)
+    return NULL;
+  set_common_curl_stuff(easy);
+  curl_easy_setopt_or_die(easy, CURLOPT_UPLOAD, 1);
+  curl_easy_setopt_or_die(easy, CURLOPT_READFUNCTION, write_data_bg);
+  curl_easy_setopt_or_die(easy, CURLOPT_LOW_SPEED_LIMIT, 1);
+  curl_easy_setopt_or_die(easy, CURLOPT_LOW_SPEED_TIME, 60);
+  return easy;
+}
 
-  return NULL;
+/* Must be called with ftpfs.lock held */
+static void upload_handle_put(CURL *easy) {
+  if (idle_uploads == NULL)
+    idle_uploads = g_ptr_array_new();
+  if (idle_uploads->len >= ftpfs.max_connections) {
+    curl_easy_cleanup(easy);
+    return;
+  }
+  /* Don't leave it pointing into a handle that is about to go away */
+  curl_easy_setopt_or_die(easy, CURLOPT_READDATA, NULL);
+  curl_easy_setopt_or_die(easy, CURLOPT_ERRORBUFFER, NULL);
+  g_ptr_array_add(idle_uploads, easy);
+}
+
+static void upload_handles_free(void) {
+  unsigned i;
+
+  if (idle_uploads == NULL)
+    return;
+  for (i = 0; i < idle_uploads->len; i++)
+    curl_easy_cleanup(g_ptr_array_index(idle_uploads, i));
+  g_ptr_array_free(idle_uploads, TRUE);
+  idle_uploads = NULL;
 }
 
 /* returns 1 on success, 0 on failure */
 static int start_write_thread(struct ftpfs_file *fh)
 {
+  CURL *easy;
+
   if (fh->write_conn != NULL)
   {
     fprintf(stderr, "assert fh->write_conn == NULL failed!\n");
     exit(1);
   }
 
-  fh->written_flag=0;
+  DEBUG(2, "starting streaming write path=%s pos=%lld\n", fh->full_path, (long long) fh->pos);
+
+  pthread_mutex_lock(&ftpfs.lock);
   fh->isready=0;
   fh->eof=0;
-  sem_init(&fh->data_avail, 0, 0);
-  sem_init(&fh->data_need, 0, 0);
-  sem_init(&fh->data_written, 0, 0);
-  sem_init(&fh->ready, 0, 0);
+  fh->write_done=0;
+  fh->write_paused=0;
+  fh->write_start=fh->pos;
+  fh->write_sent=-1;
+  fh->write_code=0;
+
+  easy = upload_handle_get();
+  if (easy == NULL) {
+    pthread_mutex_unlock(&ftpfs.lock);
+    fprintf(stderr, "Error initializing libcurl\n");
+    return 0;
+  }
 
-    fh->write_conn = curl_easy_init();
-    if (fh->write_conn == NULL) {
-      fprintf(stderr, "Error initializing libcurl\n");
-      return 0;
-    } else {
-      int err;
-      set_common_curl_stuff(fh->write_conn);
-      err = pthread_create(&fh->thread_id, NULL, ftpfs_write_thread, fh);
-      if (err) {
-        fprintf(stderr, "failed to create thread: %s\n", strerror(err));
-        /* FIXME: destroy curl_easy */
-        return 0;
-      }
-    }
+  curl_easy_setopt_or_die(easy, CURLOPT_URL, fh->full_path);
+  curl_easy_setopt_or_die(easy, CURLOPT_READDATA, fh);
+  fh->curl_error_buffer[0] = '\0';
+  curl_easy_setopt_or_die(easy, CURLOPT_ERRORBUFFER, fh->curl_error_buffer);
+  /* resuming a streaming write */
+  curl_easy_setopt_or_die(easy, CURLOPT_APPEND, fh->pos > 0 ? 1L : 0L);
+
+  fh->write_conn = easy;
+  fh->write_xfer.easy = easy;
+  fh->write_xfer.done = write_stream_done;
+  event_loop_add(&fh->write_xfer);
+  pthread_mutex_unlock(&ftpfs.lock);
   return 1;
 }
 
+/* Waits until the upload has started, i.e. the server accepted STOR */
+static void wait_write_thread(struct ftpfs_file *fh)
+{
+  pthread_mutex_lock(&ftpfs.lock);
+  while (!fh->isready)
+    pthread_cond_wait(&fh->write_cond, &ftpfs.lock);
+  pthread_mutex_unlock(&ftpfs.lock);
+}
+
 static int finish_write_thread(struct ftpfs_file *fh)
 {
-    if (fh->write_fail_cause == CURLE_OK)
-    {
-      sem_wait(&fh->data_need);  /* only wait when there has been no error */
-    }
-    sem_post(&fh->data_avail);
+    /* write_data_bg ends the upload once the queue has drained */
+    pthread_mutex_lock(&ftpfs.lock);
     fh->eof = 1;
+    write_stream_kick(fh);
+    while (!fh->write_done)
+      pthread_cond_wait(&fh->write_cond, &ftpfs.lock);
+    DEBUG(2, "finish_write_thread upload done. write_fail_cause=%d\n", fh->write_fail_cause);
 
-    pthread_join(fh->thread_id, NULL);
-    DEBUG(2, "finish_write_thread after pthread_join. write_fail_cause=%d\n", fh->write_fail_cause);
-
-    curl_easy_cleanup(fh->write_conn);
+    event_loop_remove(&fh->write_xfer);
+    upload_handle_put(fh->write_conn);
     fh->write_conn = NULL;
-
-    sem_destroy(&fh->data_avail);
-    sem_destroy(&fh->data_need);
-    sem_destroy(&fh->data_written);
-    sem_destroy(&fh->ready);
+    fh->write_xfer.easy = NULL;
+    ring_clear(&fh->stream_buf);
+    pthread_mutex_unlock(&ftpfs.lock);
 
     if (fh->write_fail_cause != CURLE_OK)
     {
@@ -497,19 +1403,118 @@ static int finish_write_thread(struct ftpfs_file *fh)
 
 
 static void free_ftpfs_file(struct ftpfs_file *fh) {
+  if (fh->read_xfer.easy) {
+    pthread_mutex_lock(&ftpfs.lock);
+    read_stream_detach(fh);
+    pthread_mutex_unlock(&ftpfs.lock);
+    curl_easy_cleanup(fh->read_xfer.easy);
+  }
+  if (fh->segs) {
+    unsigned i;
+    pthread_mutex_lock(&ftpfs.lock);
+    read_parallel_stop(fh);
+    pthread_mutex_unlock(&ftpfs.lock);
+    for (i = 0; i < ftpfs.parallel_get; i++) {
+      if (fh->segs[i].xfer.easy)
+        curl_easy_cleanup(fh->segs[i].xfer.easy);
+      free(fh->segs[i].p);
+    }
+    g_free(fh->segs);
+  }
+  if (fh->range.xfer.easy) {
+    pthread_mutex_lock(&ftpfs.lock);
+    segment_stop(&fh->range);
+    pthread_mutex_unlock(&ftpfs.lock);
+    curl_easy_cleanup(fh->range.xfer.easy);
+  }
+  free(fh->range.p);
+  if (fh->chunks) {
+    unsigned i;
+    for (i = 0; i < READ_CHUNKS; i++)
+      free(fh->chunks[i].p);
+    g_free(fh->chunks);
+  }
   if (fh->write_conn)
-    curl_easy_cleanup(fh->write_conn);
+    finish_write_thread(fh);
+  pthread_cond_destroy(&fh->read_cond);
+  pthread_cond_destroy(&fh->write_cond);
   g_free(fh->full_path);
   g_free(fh->open_path);
-  sem_destroy(&fh->data_avail);
-  sem_destroy(&fh->data_need);
-  sem_destroy(&fh->data_written);
-  sem_destroy(&fh->ready);
-  if (fh->buf.size) { buf_free(&fh->buf); }
-  if (fh->stream_buf.size) { buf_free(&fh->stream_buf); }
+  ring_free(&fh->buf);
+  ring_free(&fh->stream_buf);
   free(fh);
 }
 
+/* Read-only opens of a file that is open already share its handle, so
+ * that readers that come together download the file once. Returns the
+ * handle with one more reference, or NULL. */
+static struct ftpfs_file *shared_file_get(const char *path,
+                                          struct ftpfs_reader *reader) {
+  struct ftpfs_file *fh = NULL;
+
+  pthread_mutex_lock(&ftpfs.lock);
+  if (shared_files)
+    fh = g_hash_table_lookup(shared_files, path);
+  if (fh) {
+    fh->refs++;
+    reader->next = fh->readers;
+    fh->readers = reader;
+  }
+  pthread_mutex_unlock(&ftpfs.lock);
+  return fh;
+}
+
+static void shared_file_add(struct ftpfs_file *fh) {
+  pthread_mutex_lock(&ftpfs.lock);
+  if (shared_files == NULL)
+    shared_files = g_hash_table_new(g_str_hash, g_str_equal);
+  /* Two opens raced; the second keeps its handle to itself */
+  if (g_hash_table_lookup(shared_files, fh->open_path) == NULL) {
+    g_hash_table_insert(shared_files, fh->open_path, fh);
+    fh->shared = 1;
+  }
+  pthread_mutex_unlock(&ftpfs.lock);
+}
+
+/* Must be called with ftpfs.lock held */
+static void shared_file_remove(struct ftpfs_file *fh) {
+  if (fh->shared) {
+    g_hash_table_remove(shared_files, fh->open_path);
+    fh->shared = 0;
+  }
+}
+
+/* Returns the references left */
+static int shared_file_put(struct ftpfs_reader *reader) {
+  struct ftpfs_file *fh = reader->fh;
+  struct ftpfs_reader **p;
+  int refs;
+
+  pthread_mutex_lock(&ftpfs.lock);
+  for (p = &fh->readers; *p != reader; p = &(*p)->next)
+    ;
+  *p = reader->next;
+  refs = --fh->refs;
+  if (refs == 0)
+    shared_file_remove(fh);
+  pthread_mutex_unlock(&ftpfs.lock);
+  return refs;
+}
+
+/* Drops what we have of path, after we changed it ourselves. Handles
+ * still open keep reading what they have, later opens start afresh. */
+static void forget_file(const char *path) {
+  struct ftpfs_file *fh;
+
+  data_cache_forget(path);
+
+  pthread_mutex_lock(&ftpfs.lock);
+  fh = shared_files ? g_hash_table_lookup(shared_files, path) : NULL;
+  if (fh)
+    shared_file_remove(fh);
+  pthread_mutex_unlock(&ftpfs.lock);
+}
+
 #if 0
 
 static int buffer_file(struct ftpfs_file *fh) {
@@ -517,12 +1522,11 @@ static int buffer_file(struct ftpfs_file *fh) {
   /* If we want to write to the file, we have to load it all at once,
      modify it in memory and then upload it as a whole as most FTP servers
      don't support resume for uploads. */
-  pthread_mutex_lock(&ftpfs.lock);
-  cancel_previous_multi();
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_URL, fh->full_path);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEDATA, &fh->buf);
-  curl_res = curl_easy_perform(ftpfs.connection);
-  pthread_mutex_unlock(&ftpfs.lock);
+  struct ftpfs_conn *conn = conn_pool_get();
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_URL, fh->full_path);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_WRITEDATA, &fh->buf);
+  curl_res = curl_easy_perform(conn->easy);
+  conn_pool_put(conn);
 
   if (curl_res != 0) {
     return -EACCES;
@@ -537,17 +1541,17 @@ static int create_empty_file(const char * path)
 {
   int err = 0;
   CURLcode curl_res;
+  struct ftpfs_conn *conn;
   char *full_path = get_full_path(path);
 
-  pthread_mutex_lock(&ftpfs.lock);
-  cancel_previous_multi();
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_URL, full_path);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_INFILESIZE, 0);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_UPLOAD, 1);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_READDATA, NULL);
-  curl_res = curl_easy_perform(ftpfs.connection);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_UPLOAD, 0);
-  pthread_mutex_unlock(&ftpfs.lock);
+  conn = conn_pool_get();
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_URL, full_path);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_INFILESIZE, 0);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_UPLOAD, 1);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_READDATA, NULL);
+  curl_res = curl_easy_perform(conn->easy);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_UPLOAD, 0);
+  conn_pool_put(conn);
 
   if (curl_res != 0) {
     err = -EPERM;
@@ -598,44 +1602,84 @@ static int ftpfs_open_common(const char* path, mode_t mode,
 
   int err = 0;
   struct ftpfs_file* fh;
+  struct ftpfs_reader *reader;
   char * flagsAsStr = flags_to_string(fi->flags);
   DEBUG(2, "ftpfs_open_common: %s\n", flagsAsStr);
 
+  reader = g_new0(struct ftpfs_reader, 1);
+  fi->fh = (unsigned long) reader;
+
+  if ((fi->flags & O_ACCMODE) == O_RDONLY && !(fi->flags & O_CREAT)) {
+    reader->fh = shared_file_get(path, reader);
+    if (reader->fh) {
+      DEBUG(1, "opening %s O_RDONLY, sharing %p\n", path,
+            (void *) reader->fh);
+      stats_add(STATS_READ_SHARED, 1);
+      g_free(flagsAsStr);
+      return op_return(0, "ftpfs_open");
+    }
+  }
+
   fh = malloc(sizeof *fh);
 
   memset(fh, 0, sizeof(*fh));
-  buf_init(&fh->buf);
+  ring_init(&fh->buf);
   fh->mode = mode;
   fh->dirty = 0;
   fh->copied = 0;
-  fh->last_offset = 0;
   fh->can_shrink = 0;
-  buf_init(&fh->stream_buf);
-  /* sem_init(&fh->data_avail, 0, 0);
-  sem_init(&fh->data_need, 0, 0);
-  sem_init(&fh->data_written, 0, 0);
-  sem_init(&fh->ready, 0, 0); */
+  fh->seq_reads = 0;
+  fh->remote_size = -1;
+  fh->refs = 1;
+  fh->readers = reader;
+  pthread_cond_init(&fh->read_cond, NULL);
+  pthread_cond_init(&fh->write_cond, NULL);
+  ring_init(&fh->stream_buf);
   fh->open_path = strdup(path);
   fh->full_path = get_full_path(path);
-  fh->written_flag = 0;
   fh->write_fail_cause = CURLE_OK;
   fh->curl_error_buffer[0] = '\0';
   fh->write_may_start = 0;
-  fi->fh = (unsigned long) fh;
+  reader->fh = fh;
 
   if ((fi->flags & O_ACCMODE) == O_RDONLY) {
     if (fi->flags & O_CREAT) {
       err = ftpfs_mknod(path, (mode & 07777) | S_IFREG, 0);
     } else {
+      struct stat st;
       size_t size;
       /* If it's read-only, we can load the file a bit at a time, as necessary*/
       DEBUG(1, "opening %s O_RDONLY\n", path);
       fh->can_shrink = 1;
-      size = ftpfs_read_chunk(fh->full_path, NULL, 1, 0, fi, 0);
+      /* The size is worth asking the server for if the data cache,
+       * parallel reads or a lazy open need it. Range reads only use it if
+       * we know it. */
+      if (cache_get_attr(path, &st) == 0 ||
+          ((data_cache_enabled() || ftpfs.parallel_get > 1 ||
+            ftpfs.lazy_open) &&
+           ftpfs_getattr(path, &st) == 0)) {
+        if (S_ISREG(st.st_mode)) {
+          fh->dc_file = data_cache_open(path, st.st_mtime, st.st_size);
+          fh->remote_size = st.st_size;
+        }
+      }
+      /* Opens that come along meanwhile wait on this stream too */
+      shared_file_add(fh);
+      /* A file we know of is fetched from wherever it is first read */
+      if (ftpfs.lazy_open && fh->remote_size >= 0) {
+        DEBUG(1, "opening %s lazily\n", path);
+        fh->lazy = 1;
+        size = 0;
+      } else {
+        size = ftpfs_read_chunk(fh->full_path, NULL, 1, 0, fi, 0);
+      }
 
       if (size == CURLFTPFS_BAD_READ) {
         DEBUG(1, "initial read failed size=%zu\n", size);
         err = -EACCES;
+        pthread_mutex_lock(&ftpfs.lock);
+        shared_file_remove(fh);
+        pthread_mutex_unlock(&ftpfs.lock);
       }
     }
   }
@@ -651,6 +1695,9 @@ static int ftpfs_open_common(const char* path, mode_t mode,
 #endif
 
 
+    /* Whatever we write may keep the listed size and mtime */
+    forget_file(path);
+
     if ((fi->flags & O_APPEND))
     {
       DEBUG(1, "opening %s with O_APPEND - not supported!\n", path);
@@ -677,10 +1724,9 @@ static int ftpfs_open_common(const char* path, mode_t mode,
 
           if (start_write_thread(fh))
           {
-            sem_wait(&fh->ready);
+            wait_write_thread(fh);
             /* chmod makes only sense on O_CREAT */
             if (fi->flags & O_CREAT) ftpfs_chmod(path, mode);
-            sem_post(&fh->data_need);
           }
           else
           {
@@ -701,8 +1747,12 @@ static int ftpfs_open_common(const char* path, mode_t mode,
   }
 
   fin:
-  if (err)
-    free_ftpfs_file(fh);
+  /* Whoever joined the handle meanwhile still uses it */
+  if (err) {
+    if (shared_file_put(reader) == 0)
+      free_ftpfs_file(fh);
+    g_free(reader);
+  }
 
   g_free(flagsAsStr);
   return op_return(err, "ftpfs_open");
@@ -719,6 +1769,27 @@ static int ftpfs_create(const char* path, mode_t mode,
 }
 #endif
 
+/* A lazily opened file reports what the open would have, had the
+ * server turned down the RETR then */
+static int lazy_read_error(struct ftpfs_file *fh) {
+  CURLcode result;
+
+  pthread_mutex_lock(&ftpfs.lock);
+  result = fh->read_result;
+  pthread_mutex_unlock(&ftpfs.lock);
+
+  switch (result) {
+  case CURLE_REMOTE_FILE_NOT_FOUND:
+    return -ENOENT;
+  case CURLE_FTP_COULDNT_RETR_FILE:
+  case CURLE_REMOTE_ACCESS_DENIED:
+  case CURLE_LOGIN_DENIED:
+    return -EACCES;
+  default:
+    return -EIO;
+  }
+}
+
 static int ftpfs_read(const char* path, char* rbuf, size_t size, off_t offset,
                       struct fuse_file_info* fi) {
   int ret;
@@ -737,7 +1808,9 @@ static int ftpfs_read(const char* path, char* rbuf, size_t size, off_t offset,
   full_path = get_full_path(path);
   size_read = ftpfs_read_chunk(full_path, rbuf, size, offset, fi, 1);
   free(full_path);
-  if (size_read == CURLFTPFS_BAD_READ) {
+  if (size_read == CURLFTPFS_BAD_READ && fh->lazy) {
+    ret = lazy_read_error(fh);
+  } else if (size_read == CURLFTPFS_BAD_READ) {
     ret = -EIO;
   } else {
     ret = size_read;
@@ -747,6 +1820,82 @@ static int ftpfs_read(const char* path, char* rbuf, size_t size, off_t offset,
   return ret;
 }
 
+#if FUSE_VERSION >= 29
+/* Cached blocks are handed to FUSE as file descriptors, so that it can
+ * splice them to the kernel without copying them through us. Anything
+ * else comes from the stream the same way ftpfs_read gets it. */
+static int ftpfs_read_buf(const char* path, struct fuse_bufvec **bufp,
+                          size_t size, off_t offset,
+                          struct fuse_file_info* fi) {
+  struct ftpfs_file *fh = get_ftpfs_file(fi);
+  struct fuse_bufvec *bv;
+  int fds[DATA_CACHE_FDS];
+  int n = -1, res, i;
+
+  DEBUG(2, "ftpfs_read_buf: %s size=%zu offset=%lld\n", path, size,
+        (long long) offset);
+
+  if (fh->dc_file && !fh->dc_bad && offset < fh->remote_size) {
+    if (size > (size_t) (fh->remote_size - offset))
+      size = fh->remote_size - offset;
+    n = data_cache_fds(fh->dc_file, offset, size, fds);
+  }
+
+  if (n > 0) {
+    off_t pos = offset;
+    size_t left = size;
+
+    bv = malloc(sizeof(*bv) + (n - 1) * sizeof(struct fuse_buf));
+    if (bv == NULL)
+      return -ENOMEM;
+    bv->count = n;
+    bv->idx = 0;
+    bv->off = 0;
+    for (i = 0; i < n; i++) {
+      size_t from = pos % DATA_CACHE_BLOCK;
+      size_t len = DATA_CACHE_BLOCK - from;
+      if (len > left)
+        len = left;
+      bv->buf[i].size = len;
+      bv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      bv->buf[i].mem = NULL;
+      bv->buf[i].fd = fds[i];
+      bv->buf[i].pos = from;
+      pos += len;
+      left -= len;
+    }
+
+    pthread_mutex_lock(&ftpfs.lock);
+    get_ftpfs_reader(fi)->last_offset = offset + size;
+    pthread_mutex_unlock(&ftpfs.lock);
+
+    *bufp = bv;
+    return 0;
+  }
+
+  bv = malloc(sizeof(*bv));
+  if (bv == NULL)
+    return -ENOMEM;
+  *bv = FUSE_BUFVEC_INIT(size);
+  bv->buf[0].mem = malloc(size ? size : 1);
+  if (bv->buf[0].mem == NULL) {
+    free(bv);
+    return -ENOMEM;
+  }
+
+  res = ftpfs_read(path, bv->buf[0].mem, size, offset, fi);
+  if (res < 0) {
+    free(bv->buf[0].mem);
+    free(bv);
+    return res;
+  }
+  bv->buf[0].size = res;
+
+  *bufp = bv;
+  return 0;
+}
+#endif
+
 static int ftpfs_mknod(const char* path, mode_t mode, dev_t rdev) {
   int err = 0;
 
@@ -766,41 +1915,183 @@ static int ftpfs_mknod(const char* path, mode_t mode, dev_t rdev) {
 }
 
 
-static int ftpfs_do_cmd(struct curl_slist *header, const char *path) {
-  struct buffer buf;
-  const char   *url = NULL;
-  CURLcode      curl_res;
-  int           err = 0;
-
-  buf_init(&buf);
-  if (path)
-    url = get_dir_path(path);
-  else
-    url = ftpfs.host;
+/* A metadata operation waiting for a connection. Whoever gets one first
+ * sends the commands of everyone waiting on the same directory along
+ * with its own, so a burst of chmods or mkdirs costs one round trip per
+ * command instead of a whole transfer each. */
+struct cmd_req {
+  const struct curl_slist *cmds;
+  const char *url;
+  int err;
+  int done;
+  struct cmd_req *next;
+};
 
-  pthread_mutex_lock(&ftpfs.lock);
+static pthread_mutex_t cmd_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cmd_done = PTHREAD_COND_INITIALIZER;
+static struct cmd_req *cmd_queue;
 
-  cancel_previous_multi();
+/* Final replies are the lines with a space after the code */
+static int reply_code(const char *line) {
+  if (line[0] >= '1' && line[0] <= '5' &&
+      line[1] >= '0' && line[1] <= '9' &&
+      line[2] >= '0' && line[2] <= '9' && line[3] == ' ')
+    return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+  return 0;
+}
 
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_POSTQUOTE, header);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_URL,       url);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEDATA, &buf);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_NOBODY,  ftpfs.safe_nobody);
+/* Sends the commands of a batch after one another on conn and sets the
+ * result of each request from the replies to its own commands */
+static void cmd_batch_send(struct ftpfs_conn *conn, struct cmd_req *batch) {
+  struct curl_slist *header = NULL;
+  const struct curl_slist *cmd;
+  struct buffer buf, body;
+  struct cmd_req *req;
+  CURLcode curl_res;
+  int *codes;
+  char *line;
+  unsigned n = 0, got = 0, next;
+
+  /* Each command is marked to go on after a failure, so that one request
+   * failing leaves the others be; the replies say who failed */
+  for (req = batch; req; req = req->next) {
+    for (cmd = req->cmds; cmd; cmd = cmd->next) {
+      char *starred = g_strdup_printf("*%s", cmd->data);
+      header = curl_slist_append(header, starred);
+      g_free(starred);
+      n++;
+    }
+  }
+  DEBUG(1, "ftpfs_do_cmd: %u commands in %s\n", n, batch->url);
 
-  curl_res = curl_easy_perform(ftpfs.connection);
+  buf_init(&buf);
+  buf_init(&body);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_POSTQUOTE, header);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_URL,       batch->url);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_WRITEDATA, &body);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_NOBODY,  ftpfs.safe_nobody);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_HEADERFUNCTION, reply_header);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_HEADERDATA, &buf);
 
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_POSTQUOTE, NULL);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_NOBODY,    0);
+  curl_res = timed_perform(conn->easy, STATS_FTP_COMMAND);
 
-  pthread_mutex_unlock(&ftpfs.lock);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_POSTQUOTE, NULL);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_NOBODY,    0);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_HEADERDATA, NULL);
 
   if (curl_res != 0)
-    err = -EPERM;
+    DEBUG(1, "%s\n", conn->error_buf);
+
+  /* Our commands went last, so theirs are the last n replies */
+  codes = g_new(int, n);
+  buf_null_terminate(&buf);
+  for (line = (char*)buf.p; line && *line; line = strchr(line, '\n')) {
+    int code;
+    if (*line == '\n')
+      line++;
+    code = reply_code(line);
+    if (code)
+      codes[got++ % n] = code;
+  }
+  next = got >= n ? got - n : 0;
+
+  for (req = batch; req; req = req->next) {
+    req->err = curl_res != 0 || got < n ? -EPERM : 0;
+    for (cmd = req->cmds; cmd && !req->err; cmd = cmd->next) {
+      int code = codes[next++ % n];
+      if (code >= 400) {
+        DEBUG(1, "ftpfs_do_cmd: %s: %d\n", cmd->data, code);
+        req->err = -EPERM;
+      }
+    }
+    /* Skip the rest of a failed request */
+    for (; cmd; cmd = cmd->next)
+      next++;
+  }
 
-  free((char *) url);
+  g_free(codes);
+  curl_slist_free_all(header);
   buf_free(&buf);
+  buf_free(&body);
+}
 
-  return err;
+/* Whether someone else has already sent the commands of req */
+static int cmd_req_done(void *arg) {
+  struct cmd_req *req = arg;
+  int done;
+
+  pthread_mutex_lock(&cmd_lock);
+  done = req->done;
+  pthread_mutex_unlock(&cmd_lock);
+  return done;
+}
+
+/* Runs the commands in header in the directory of path, or at the top if
+ * path is NULL */
+static int ftpfs_do_cmd(struct curl_slist *header, const char *path) {
+  struct cmd_req     req, **pp, *batch = NULL, **tail = &batch;
+  struct ftpfs_conn *conn;
+
+  memset(&req, 0, sizeof req);
+  req.cmds = header;
+  if (path)
+    req.url = get_dir_path(path);
+  else
+    req.url = strdup(ftpfs.host);
+
+  pthread_mutex_lock(&cmd_lock);
+  for (pp = &cmd_queue; *pp; pp = &(*pp)->next)
+    ;
+  *pp = &req;
+  pthread_mutex_unlock(&cmd_lock);
+
+  /* No connection is needed once someone else has sent ours */
+  conn = conn_pool_get_unless(cmd_req_done, &req);
+  if (conn == NULL)
+    goto out;
+
+  /* Take ours and everything else waiting on the same directory */
+  pthread_mutex_lock(&cmd_lock);
+  for (pp = &cmd_queue; *pp; ) {
+    struct cmd_req *r = *pp;
+    if (!strcmp(r->url, req.url)) {
+      *pp = r->next;
+      r->next = NULL;
+      *tail = r;
+      tail = &r->next;
+    } else {
+      pp = &r->next;
+    }
+  }
+  pthread_mutex_unlock(&cmd_lock);
+
+  if (batch) {
+    cmd_batch_send(conn, batch);
+
+    pthread_mutex_lock(&cmd_lock);
+    /* The others may be gone as soon as they see done */
+    while (batch) {
+      struct cmd_req *next = batch->next;
+      batch->done = 1;
+      batch = next;
+    }
+    pthread_cond_broadcast(&cmd_done);
+    pthread_mutex_unlock(&cmd_lock);
+    /* Those of them still waiting for a connection needn't any more */
+    conn_pool_wake();
+  }
+  conn_pool_put(conn);
+
+out:
+  /* Someone else may have taken ours, and still be sending it */
+  pthread_mutex_lock(&cmd_lock);
+  while (!req.done)
+    pthread_cond_wait(&cmd_done, &cmd_lock);
+  pthread_mutex_unlock(&cmd_lock);
+
+  free((char *) req.url);
+  return req.err;
 }
 
 static int ftpfs_chmod(const char *path, mode_t mode) {
@@ -854,7 +2145,10 @@ static int ftpfs_truncate(const char* path, off_t offset) {
 
   DEBUG(1, "ftpfs_truncate: %s len=%lld\n", path, (long long) offset);
   /* we can't use ftpfs_mknod here, because we don't know the right permissions */
-  if (offset == 0) return op_return(create_empty_file(path), "ftpfs_truncate");
+  if (offset == 0) {
+    forget_file(path);
+    return op_return(create_empty_file(path), "ftpfs_truncate");
+  }
 
   /* fix openoffice problem, truncating exactly to file length */
 
@@ -957,6 +2251,7 @@ static int ftpfs_unlink(const char *path) {
   int                err;
 
   DEBUG(1, "ftpfs_unlink: %s\n", path);
+  forget_file(path);
 
   filename = get_file_name(path);
   cmd      = g_strdup_printf("DELE %s", filename);
@@ -1006,8 +2301,7 @@ static int ftpfs_write(const char *path, const char *wbuf, size_t size,
     {
       return op_return(-EIO, "ftpfs_write");
     }
-    sem_wait(&fh->ready);
-    sem_post(&fh->data_need);
+    wait_write_thread(fh);
   }
 
   if (!fh->write_conn && fh->pos >0 && offset == fh->pos)
@@ -1021,41 +2315,48 @@ static int ftpfs_write(const char *path, const char *wbuf, size_t size,
     {
       return op_return(-EIO, "ftpfs_write");
     }
-    sem_wait(&fh->ready);
-    sem_post(&fh->data_need);
+    wait_write_thread(fh);
   }
 
   if (fh->write_conn) {
-    sem_wait(&fh->data_need);
-
     if (offset != fh->pos) {
       DEBUG(1, "non-sequential write detected -> fail\n");
 
-      sem_post(&fh->data_avail);
       finish_write_thread(fh);
       return op_return(-EIO, "ftpfs_write");
+    }
 
-
-    } else {
-      if (buf_add_mem(&fh->stream_buf, wbuf, size) == -1) {
-        sem_post(&fh->data_need);
+    pthread_mutex_lock(&ftpfs.lock);
+    /* Queue up to write_buffer bytes behind the upload; anything bigger
+     * goes in on its own once the queue is empty */
+    while (fh->stream_buf.len > 0 &&
+           fh->stream_buf.len + size > ftpfs.write_buffer &&
+           !fh->write_done)
+      pthread_cond_wait(&fh->write_cond, &ftpfs.lock);
+
+    if (!fh->write_done) {
+      if (ring_add_mem(&fh->stream_buf, wbuf, size) == -1) {
+        pthread_mutex_unlock(&ftpfs.lock);
         return op_return(-ENOMEM, "ftpfs_write");
       }
       fh->pos += size;
-      /* wake up write_data_bg */
-      sem_post(&fh->data_avail);
-      /* wait until libcurl has completely written the current chunk or finished/failed */
-      sem_wait(&fh->data_written);
-      fh->written_flag = 0;
+      write_stream_kick(fh);
 
-      if (fh->write_fail_cause != CURLE_OK)
-      {
-      /* TODO: on error we should problably unlink the target file  */
-        DEBUG(1, "writing failed. cause=%d\n", fh->write_fail_cause);
-        return op_return(-EIO, "ftpfs_write");
+      /* Without a queue, wait until libcurl has taken all of it */
+      if (ftpfs.write_buffer == 0) {
+        while (fh->stream_buf.len > 0 && !fh->write_done)
+          pthread_cond_wait(&fh->write_cond, &ftpfs.lock);
       }
     }
 
+    if (fh->write_done)
+    {
+      /* TODO: on error we should problably unlink the target file  */
+      DEBUG(1, "writing failed. cause=%d\n", fh->write_fail_cause);
+      pthread_mutex_unlock(&ftpfs.lock);
+      return op_return(-EIO, "ftpfs_write");
+    }
+    pthread_mutex_unlock(&ftpfs.lock);
   }
 
   return size;
@@ -1070,20 +2371,32 @@ static int ftpfs_flush(const char *path, struct fuse_file_info *fi) {
 
   if (fh->write_conn) {
     struct stat sbuf;
+    off_t size;
 
     err = finish_write_thread(fh);
     if (err) return op_return(err, "ftpfs_flush");
 
     /* check if the resulting file has the correct size
      this is important, because we use APPE for continuing
-     writing after a premature flush */
-    err = ftpfs_getattr(path, &sbuf);
-    if (err) return op_return(err, "ftpfs_flush");
+     writing after a premature flush.
+     The server confirming the transfer of everything we sent is
+     enough; otherwise we ask for the size, and only list the
+     directory, which also refreshes the cache, as a last resort. */
+    if ((fh->write_code == 226 || fh->write_code == 250) &&
+        fh->write_sent == fh->pos - fh->write_start)
+      return 0;
+
+    DEBUG(1, "ftpfs_flush: checking size, reply=%ld sent=%lld\n", fh->write_code, (long long) fh->write_sent);
+    if (!ftpfs.has_size || ftpfs_size(path, &size) != 0) {
+      err = ftpfs_getattr(path, &sbuf);
+      if (err) return op_return(err, "ftpfs_flush");
+      size = sbuf.st_size;
+    }
 
-    if (sbuf.st_size != fh->pos)
+    if (size != fh->pos)
     {
       fh->write_fail_cause = -999;
-      fprintf(stderr, "ftpfs_flush: check filesize problem: size=%lld expected=%lld\n", (long long) sbuf.st_size, (long long) fh->pos);
+      fprintf(stderr, "ftpfs_flush: check filesize problem: size=%lld expected=%lld\n", (long long) size, (long long) fh->pos);
       return op_return(-EIO, "ftpfs_flush");
     }
 
@@ -1105,21 +2418,19 @@ static int ftpfs_fsync(const char *path, int isdatasync,
 }
 
 static int ftpfs_release(const char* path, struct fuse_file_info* fi) {
-  struct ftpfs_file* fh = get_ftpfs_file(fi);
+  struct ftpfs_reader *reader = get_ftpfs_reader(fi);
+  struct ftpfs_file* fh = reader->fh;
   DEBUG(1, "ftpfs_release %s\n", path);
   ftpfs_flush(path, fi);
-  pthread_mutex_lock(&ftpfs.lock);
-  if (ftpfs.current_fh == fh) {
-    ftpfs.current_fh = NULL;
-  }
-  pthread_mutex_unlock(&ftpfs.lock);
-
-  /*
-  if (fh->write_conn) {
-    finish_write_thread(fh);
+  if (shared_file_put(reader) == 0) {
+    /*
+    if (fh->write_conn) {
+      finish_write_thread(fh);
+    }
+    */
+    free_ftpfs_file(fh);
   }
-  */
-  free_ftpfs_file(fh);
+  g_free(reader);
   return op_return(0, "ftpfs_release");
 }
 
@@ -1130,6 +2441,8 @@ static int ftpfs_rename(const char *from, const char *to) {
   int                err;
 
   DEBUG(1, "ftpfs_rename from %s to %s\n", from, to);
+  forget_file(from);
+  forget_file(to);
 
   rnfr   = g_strdup_printf("RNFR %s", from + 1);
   rnto   = g_strdup_printf("RNTO %s", to + 1);
@@ -1151,30 +2464,34 @@ static int ftpfs_rename(const char *from, const char *to) {
 
 static int ftpfs_readlink(const char *path, char *linkbuf, size_t size) {
   int err;
-  CURLcode curl_res;
+  int mlsd;
   char *name;
-  char* dir_path = get_dir_path(path);
+  char* dir_path;
   struct buffer buf;
 
+  /* Not every server says where a link points in MLST */
+  if (ftpfs.mlst) {
+    struct stat sbuf;
+    linkbuf[0] = '\0';
+    err = ftpfs_mlst(path, &sbuf, linkbuf, size);
+    if (err == -ENOENT)
+      return op_return(err, "ftpfs_readlink");
+    if (!err && linkbuf[0])
+      return op_return(0, "ftpfs_readlink");
+  }
+
+  dir_path = get_dir_path(path);
   DEBUG(2, "dir_path: %s %s\n", path, dir_path);
   buf_init(&buf);
 
-  pthread_mutex_lock(&ftpfs.lock);
-  cancel_previous_multi();
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_URL, dir_path);
-  curl_easy_setopt_or_die(ftpfs.connection, CURLOPT_WRITEDATA, &buf);
-  curl_res = curl_easy_perform(ftpfs.connection);
-  pthread_mutex_unlock(&ftpfs.lock);
+  ftpfs_list(dir_path, &buf, &mlsd);
 
-  if (curl_res != 0) {
-    DEBUG(1, "%s\n", error_buf);
-  }
   buf_null_terminate(&buf);
 
   name = strrchr(path, '/');
   ++name;
-  err = parse_dir((char*)buf.p, dir_path + strlen(ftpfs.host) - 1,
-                  name, NULL, linkbuf, size, NULL, NULL);
+  err = parse_listing(mlsd, (char*)buf.p, dir_path + strlen(ftpfs.host) - 1,
+                      name, NULL, linkbuf, size, NULL, NULL);
 
   free(dir_path);
   buf_free(&buf);
@@ -1182,40 +2499,177 @@ static int ftpfs_readlink(const char *path, char *linkbuf, size_t size) {
   return op_return(0, "ftpfs_readlink");
 }
 
+/* What the server last said about room on it, and until when to go by
+ * that. Servers that turn a command down aren't asked it again. */
+static pthread_mutex_t statfs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ftp_space statfs_space = { -1, -1, -1, -1 };
+static int64_t statfs_expires;   /* in cache_now() milliseconds */
+static int statfs_quota = 1;
+
+/* Sends cmd in the mount's directory, collecting the replies in buf */
+static CURLcode ftpfs_space_cmd(const char* cmd, struct buffer* buf,
+                                long* code) {
+  CURLcode curl_res;
+  struct curl_slist* header = NULL;
+  struct ftpfs_conn* conn;
+
+  header = curl_slist_append(header, cmd);
+  *code = 0;
+
+  conn = conn_pool_get();
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_URL, ftpfs.host);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_POSTQUOTE, header);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_NOBODY, 1);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_WRITEDATA, NULL);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_HEADERFUNCTION, reply_header);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_HEADERDATA, buf);
+
+  curl_res = timed_perform(conn->easy, STATS_FTP_COMMAND);
+  curl_easy_getinfo(conn->easy, CURLINFO_RESPONSE_CODE, code);
+
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_POSTQUOTE, NULL);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_NOBODY, 0);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt_or_die(conn->easy, CURLOPT_HEADERDATA, NULL);
+  if (curl_res != 0)
+    DEBUG(1, "%s\n", conn->error_buf);
+  conn_pool_put(conn);
+
+  curl_slist_free_all(header);
+  buf_null_terminate(buf);
+  return curl_res;
+}
+
+/* Asks with AVBL, or failing that SITE QUOTA, at most once every
+ * statfs_timeout seconds. Callers that come while it asks wait for the
+ * answer rather than asking too. */
+static void ftpfs_space(struct ftp_space* space) {
+  struct buffer buf;
+  CURLcode curl_res;
+  long code;
+
+  pthread_mutex_lock(&statfs_lock);
+  if ((ftpfs.has_avbl || statfs_quota) &&
+      cache_now() - statfs_expires >= 0) {
+    statfs_space.bytes = statfs_space.bytes_free = -1;
+    statfs_space.files = statfs_space.files_free = -1;
+
+    if (ftpfs.has_avbl) {
+      buf_init(&buf);
+      curl_res = ftpfs_space_cmd("AVBL", &buf, &code);
+      if (curl_res == 0)
+        parse_avbl((char*)buf.p, &statfs_space);
+      else if (code >= 500 && code <= 504)
+        ftpfs.has_avbl = 0;
+      buf_free(&buf);
+    }
+    if (statfs_space.bytes_free < 0 && statfs_quota) {
+      buf_init(&buf);
+      curl_res = ftpfs_space_cmd("SITE QUOTA", &buf, &code);
+      if (curl_res == 0)
+        parse_quota((char*)buf.p, &statfs_space);
+      else if (code >= 500 && code <= 504)
+        statfs_quota = 0;
+      buf_free(&buf);
+    }
+
+    statfs_expires = cache_now() + (int64_t) ftpfs.statfs_timeout * 1000;
+  }
+  *space = statfs_space;
+  pthread_mutex_unlock(&statfs_lock);
+}
+
+/* Counts in units of unit bytes. Without a total, the free space is all
+ * there is to go by, and without anything, there's lots of room. */
+static void space_blocks(const struct ftp_space* space, unsigned long unit,
+                         unsigned long long* blocks,
+                         unsigned long long* bfree) {
+  *blocks = *bfree = 999999999 * 2;
+  if (space->bytes_free >= 0) {
+    *bfree = space->bytes_free / unit;
+    *blocks = space->bytes >= 0 ? space->bytes / unit : *bfree;
+  }
+}
+
+static void space_files(const struct ftp_space* space,
+                        unsigned long long* files,
+                        unsigned long long* ffree) {
+  *files = *ffree = 999999999;
+  if (space->files_free >= 0) {
+    *ffree = space->files_free;
+    *files = space->files >= 0 ? space->files : *ffree;
+  }
+}
+
 #if FUSE_VERSION >= 25
 static int ftpfs_statfs(const char *path, struct statvfs *buf)
 {
+    struct ftp_space space;
+    unsigned long long blocks, bfree, files, ffree;
     (void) path;
 
+    ftpfs_space(&space);
+    space_blocks(&space, 512, &blocks, &bfree);
+    space_files(&space, &files, &ffree);
+
     buf->f_namemax = 255;
     buf->f_bsize = ftpfs.blksize;
     buf->f_frsize = 512;
-    buf->f_blocks = 999999999 * 2;
-    buf->f_bfree =  999999999 * 2;
-    buf->f_bavail = 999999999 * 2;
-    buf->f_files =  999999999;
-    buf->f_ffree =  999999999;
+    buf->f_blocks = blocks;
+    buf->f_bfree =  bfree;
+    buf->f_bavail = bfree;
+    buf->f_files =  files;
+    buf->f_ffree =  ffree;
     return op_return(0, "ftpfs_statfs");
 }
 #else
 static int ftpfs_statfs(const char *path, struct statfs *buf)
 {
+    struct ftp_space space;
+    unsigned long long blocks, bfree, files, ffree;
     (void) path;
 
+    ftpfs_space(&space);
+    space_blocks(&space, ftpfs.blksize ? ftpfs.blksize : 512, &blocks, &bfree);
+    space_files(&space, &files, &ffree);
+
     buf->f_namelen = 255;
     buf->f_bsize = ftpfs.blksize;
-    buf->f_blocks = 999999999 * 2;
-    buf->f_bfree =  999999999 * 2;
-    buf->f_bavail = 999999999 * 2;
-    buf->f_files =  999999999;
-    buf->f_ffree =  999999999;
+    buf->f_blocks = blocks;
+    buf->f_bfree =  bfree;
+    buf->f_bavail = bfree;
+    buf->f_files =  files;
+    buf->f_ffree =  ffree;
     return op_return(0, "ftpfs_statfs");
 }
 #endif
 
+#if FUSE_VERSION >= 26
+static void *ftpfs_init(struct fuse_conn_info *conn)
+{
+  (void) conn;
+#else
+static void *ftpfs_init(void)
+{
+#endif
+  /* Threads don't survive daemonizing, so start here rather than in main */
+  if (event_loop_start() == -1)
+    exit(1);
+  conn_pool_prewarm(ftpfs.prewarm);
+  return NULL;
+}
+
+static void ftpfs_destroy(void *data)
+{
+  (void) data;
+  event_loop_stop();
+  upload_handles_free();
+}
+
 struct fuse_cache_operations ftpfs_oper = {
   .oper = {
-/*    .init       = ftpfs_init, */
+    .init       = ftpfs_init,
+    .destroy    = ftpfs_destroy,
     .getattr    = ftpfs_getattr,
     .readlink   = ftpfs_readlink,
     .mknod      = ftpfs_mknod,
@@ -1233,6 +2687,9 @@ struct fuse_cache_operations ftpfs_oper = {
     .fsync      = ftpfs_fsync,
     .release    = ftpfs_release,
     .read       = ftpfs_read,
+#if FUSE_VERSION >= 29
+    .read_buf   = ftpfs_read_buf,
+#endif
     .write      = ftpfs_write,
     .statfs     = ftpfs_statfs,
 #if FUSE_VERSION >= 25
@@ -1254,18 +2711,93 @@ static int ftpfilemethod(const char *str)
   return CURLFTPMETHOD_MULTICWD;
 }
 
+static int feature_is(const char *line, const char *name) {
+  size_t len = strlen(name);
+  return !strncasecmp(line, name, len) &&
+         (line[len] == ' ' || line[len] == '\r' || line[len] == '\n');
+}
+
+void ftpfs_probe_features(CURL* easy) {
+  struct curl_slist *feat = NULL;
+  struct buffer buf;
+  CURLcode curl_res;
+  char *line;
+  int in_feat = 0;
+  int has_mlst = 0, has_size = 0, has_mdtm = 0, has_avbl = 0;
+
+  buf_init(&buf);
+  feat = curl_slist_append(feat, "FEAT");
+
+  curl_easy_setopt_or_die(easy, CURLOPT_POSTQUOTE, feat);
+  curl_easy_setopt_or_die(easy, CURLOPT_HEADERFUNCTION, reply_header);
+  curl_easy_setopt_or_die(easy, CURLOPT_HEADERDATA, &buf);
+  curl_easy_setopt_or_die(easy, CURLOPT_NOBODY, ftpfs.safe_nobody);
+
+  curl_res = curl_easy_perform(easy);
+
+  curl_easy_setopt_or_die(easy, CURLOPT_POSTQUOTE, NULL);
+  curl_easy_setopt_or_die(easy, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt_or_die(easy, CURLOPT_HEADERDATA, NULL);
+  curl_easy_setopt_or_die(easy, CURLOPT_NOBODY, 0);
+  curl_slist_free_all(feat);
+
+  if (curl_res != 0) {
+    DEBUG(1, "FEAT failed: %s\n", error_buf);
+    buf_free(&buf);
+    return;
+  }
+
+  /* The features are the lines between "211-" and "211 ", each starting
+   * with a space */
+  buf_null_terminate(&buf);
+  for (line = (char*)buf.p; line && *line; line = strchr(line, '\n')) {
+    if (*line == '\n')
+      line++;
+    if (!strncmp(line, "211-", 4)) {
+      in_feat = 1;
+    } else if (!strncmp(line, "211 ", 4)) {
+      in_feat = 0;
+    } else if (in_feat && line[0] == ' ') {
+      if (feature_is(line + 1, "MLST")) {
+        DEBUG(1, "server supports MLST and MLSD\n");
+        has_mlst = 1;
+      } else if (feature_is(line + 1, "SIZE")) {
+        has_size = 1;
+      } else if (feature_is(line + 1, "MDTM")) {
+        has_mdtm = 1;
+      } else if (feature_is(line + 1, "AVBL")) {
+        DEBUG(1, "server tells free space with AVBL\n");
+        has_avbl = 1;
+      }
+    }
+  }
+
+  if (has_mlst && !ftpfs.disable_mlsd) {
+    ftpfs.mlst = 1;
+    /* A custom list command is what the user wants to see */
+    if (!ftpfs.custom_list)
+      ftpfs.mlsd = 1;
+  }
+  ftpfs.has_size = has_size;
+  ftpfs.has_avbl = has_avbl;
+  if (!has_size || !has_mdtm)
+    ftpfs.size_mdtm = 0;
+
+  buf_free(&buf);
+}
+
 void set_common_curl_stuff(CURL* easy) {
+  long proxytype;
+
   curl_easy_setopt_or_die(easy, CURLOPT_WRITEFUNCTION, read_data);
   curl_easy_setopt_or_die(easy, CURLOPT_READFUNCTION, write_data);
   curl_easy_setopt_or_die(easy, CURLOPT_ERRORBUFFER, error_buf);
   curl_easy_setopt_or_die(easy, CURLOPT_URL, ftpfs.host);
   curl_easy_setopt_or_die(easy, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
   curl_easy_setopt_or_die(easy, CURLOPT_NOSIGNAL, 1);
-  curl_easy_setopt_or_die(easy, CURLOPT_CUSTOMREQUEST, "LIST -a");
-
-  if (ftpfs.custom_list) {
-    curl_easy_setopt_or_die(easy, CURLOPT_CUSTOMREQUEST, ftpfs.custom_list);
-  }
+  curl_easy_setopt_or_die(easy, CURLOPT_CUSTOMREQUEST, list_command());
+  if (ftpfs.share)
+    curl_easy_setopt_or_die(easy, CURLOPT_SHARE, ftpfs.share);
 
   if (ftpfs.tryutf8) {
     /* We'll let the slist leak, as it will still be accessible within
@@ -1377,14 +2909,13 @@ void set_common_curl_stuff(CURL* easy) {
     curl_easy_setopt_or_die(easy, CURLOPT_PROXY, ftpfs.proxy);
   }
 
-  /* The default proxy type is HTTP */
-  if (!ftpfs.proxytype) {
-    ftpfs.proxytype = CURLPROXY_HTTP;
-  }
-  curl_easy_setopt_or_die(easy, CURLOPT_PROXYTYPE, ftpfs.proxytype);
+  /* The default proxy type is HTTP. Handles are set up from several
+   * threads at once, so leave ftpfs alone. */
+  proxytype = ftpfs.proxytype ? ftpfs.proxytype : CURLPROXY_HTTP;
+  curl_easy_setopt_or_die(easy, CURLOPT_PROXYTYPE, proxytype);
 
   /* Connection to FTP servers only make sense with a HTTP tunnel proxy */
-  if (ftpfs.proxytype == CURLPROXY_HTTP || ftpfs.proxytunnel) {
+  if (proxytype == CURLPROXY_HTTP || ftpfs.proxytunnel) {
     curl_easy_setopt_or_die(easy, CURLOPT_HTTPPROXYTUNNEL, TRUE);
   }
 
@@ -25,14 +25,17 @@
 #include <curl/easy.h>
 #include <pthread.h> /* <pthread_mutex_t> */
 
+#define DEFAULT_READAHEAD (1024*1024)
+#define DEFAULT_PARALLEL_MIN_SIZE (16*1024*1024)
+#define DEFAULT_WRITE_BUFFER (1024*1024)
+#define DEFAULT_STATFS_TIMEOUT 30
+
 struct ftpfs {
   char* host;
   char* mountpoint;
-  pthread_mutex_t lock;
-  CURL* connection;
+  pthread_mutex_t lock;   /* protects multi and the read streams in it */
   CURLM* multi;
-  int attached_to_multi;
-  struct ftpfs_file* current_fh;
+  CURLSH* share;          /* TLS sessions and DNS, for every handle */
   unsigned blksize;
   int verbose;
   int debug;
@@ -41,6 +44,13 @@ struct ftpfs {
   int skip_pasv_ip;
   char* ftp_method;
   char* custom_list;
+  int disable_mlsd;
+  int mlsd;
+  int mlst;
+  int size_mdtm;
+  int has_size;     /* FEAT listed SIZE */
+  int has_avbl;     /* FEAT listed AVBL */
+  int no_range;     /* the server turned down REST */
   int tcp_nodelay;
   char* ftp_port;
   int disable_eprt;
@@ -78,6 +88,17 @@ struct ftpfs {
   const char *codepage;
   const char *iocharset;
   int multiconn;
+  unsigned max_connections;
+  unsigned prewarm;
+  int lazy_open;
+  unsigned readahead;
+  unsigned parallel_get;
+  unsigned parallel_min_size;
+  unsigned write_buffer;
+  unsigned statfs_timeout;
+  char *data_cache;
+  unsigned data_cache_size;
+  char *stats_file;
 };
 
 extern struct ftpfs ftpfs;
@@ -89,8 +110,9 @@ extern struct fuse_cache_operations ftpfs_oper;
 
 #define CURLFTPFS_BAD_READ   ((size_t)-1)
 
-void cancel_previous_multi(void);
 void set_common_curl_stuff(CURL* easy);
+/* Asks the server with FEAT which listing commands it has */
+void ftpfs_probe_features(CURL* easy);
 
 void ftpfs_curl_easy_setopt_abort(void);
 
@@ -7,7 +7,7 @@
 */
 
 #include <stddef.h> /* offsetof() */
-#include <stdlib.h> /* exit() */
+#include <stdlib.h> /* exit(), free() */
 #include <string.h> /* memset() */
 #include <stdio.h>  /* fprintf(), stderr */
 
@@ -20,8 +20,12 @@
 
 #include "ftpfs.h"         /* ftpfs */
 #include "cache.h"         /* cache_init(), CACHE_* */
+#include "conn_pool.h"     /* conn_pool_*(), conn_share_*(), DEFAULT_MAX_CONNECTIONS */
+#include "data_cache.h"    /* data_cache_*(), DEFAULT_DATA_CACHE_SIZE */
+#include "stats.h"         /* stats_init() */
 #include "charset_utils.h" /* convert_charsets() */
 #include "passwd.h"        /* prompt_passwd() */
+#include "path_utils.h"    /* make_absolute() */
 
 #include "config.h" /* VERSION */
 
@@ -43,6 +47,8 @@ static struct fuse_opt ftpfs_opts[] = {
   FTPFS_OPT("disable_eprt",       disable_eprt, 1),
   FTPFS_OPT("ftp_method=%s",      ftp_method, 0),
   FTPFS_OPT("custom_list=%s",     custom_list, 0),
+  FTPFS_OPT("disable_mlsd",       disable_mlsd, 1),
+  FTPFS_OPT("size_mdtm",          size_mdtm, 1),
   FTPFS_OPT("tcp_nodelay",        tcp_nodelay, 1),
   FTPFS_OPT("connect_timeout=%u", connect_timeout, 0),
   FTPFS_OPT("ssl",                use_ssl, CURLFTPSSL_ALL),
@@ -80,6 +86,17 @@ static struct fuse_opt ftpfs_opts[] = {
   FTPFS_OPT("codepage=%s",        codepage, 0),
   FTPFS_OPT("iocharset=%s",       iocharset, 0),
   FTPFS_OPT("nomulticonn",        multiconn, 0),
+  FTPFS_OPT("max_connections=%u", max_connections, 0),
+  FTPFS_OPT("lazy_open",          lazy_open, 1),
+  FTPFS_OPT("prewarm=%u",         prewarm, 0),
+  FTPFS_OPT("readahead=%u",       readahead, 0),
+  FTPFS_OPT("parallel_get=%u",    parallel_get, 0),
+  FTPFS_OPT("parallel_min_size=%u", parallel_min_size, 0),
+  FTPFS_OPT("write_buffer=%u",    write_buffer, 0),
+  FTPFS_OPT("statfs_timeout=%u",  statfs_timeout, 0),
+  FTPFS_OPT("data_cache=%s",      data_cache, 0),
+  FTPFS_OPT("data_cache_size=%u", data_cache_size, 0),
+  FTPFS_OPT("stats_file=%s",      stats_file, 0),
 
   FUSE_OPT_KEY("-h",             KEY_HELP),
   FUSE_OPT_KEY("--help",         KEY_HELP),
@@ -110,6 +127,8 @@ static void ftpfs_usage(const char *progname) {
 "    disable_eprt        use PORT, without trying EPRT first\n"
 "    ftp_method          [multicwd/singlecwd] Control CWD usage\n"
 "    custom_list=STR     Command used to list files. Defaults to \"LIST -a\"\n"
+"    disable_mlsd        list files with LIST even if the server has MLSD\n"
+"    size_mdtm           stat files with SIZE and MDTM when there's no MLST\n"
 "    tcp_nodelay         use the TCP_NODELAY option\n"
 "    connect_timeout=N   maximum time allowed for connection in seconds\n"
 "    ssl                 enable SSL/TLS for both control and data connections\n"
@@ -146,22 +165,62 @@ static void ftpfs_usage(const char *progname) {
 "    utf8                try to transfer file list with utf-8 encoding\n"
 "    codepage=STR        set the codepage the server uses\n"
 "    iocharset=STR       set the charset used by the client\n"
+"    max_connections=N   maximum number of control connections (default: %d)\n"
+"    nomulticonn         use a single control connection\n"
+"    lazy_open           don't fetch anything until a file is read\n"
+"    prewarm=N           log in N more connections in the background at\n"
+"                        mount time (default: 0)\n"
+"    parallel_get=N      connections to read large files with (default: 1)\n"
+"    parallel_min_size=N smallest file size in bytes to read in parallel\n"
+"                        (default: %d)\n"
+"    readahead=N         bytes to prefetch for sequential reads\n"
+"                        (default: %d)\n"
+"    write_buffer=N      bytes of writes to queue behind an upload\n"
+"                        (default: %d)\n"
+"    statfs_timeout=SECS how long to go by the free space the server last\n"
+"                        told (default: %d)\n"
+"    data_cache=DIR      keep downloaded file contents in DIR\n"
+"    data_cache_size=N   MiB the data cache may use (default: %d)\n"
+"    stats_file=FILE     where to write statistics on SIGUSR1\n"
+"                        (default: stderr)\n"
 "\n"
 "CurlFtpFS cache options:  \n"
 "    cache=yes|no              enable/disable cache (default: yes)\n"
 "    cache_timeout=SECS        set timeout for stat, dir, link at once\n"
-"                              default is %d seconds\n"
+"                              default is %d seconds, and SECS may have a\n"
+"                              fraction, as in 0.25\n"
 "    cache_stat_timeout=SECS   set stat timeout\n"
 "    cache_dir_timeout=SECS    set dir timeout\n"
 "    cache_link_timeout=SECS   set link timeout\n"
-"\n", progname, DEFAULT_CACHE_TIMEOUT);
+"    cache_stale_timeout=SECS  go on answering with what expired less than\n"
+"                              SECS ago while fetching it again in the\n"
+"                              background (default: 0)\n"
+"    cache_prefetch_depth=N    after listing a directory, list N levels of\n"
+"                              subdirectories below it in the background\n"
+"                              (default: 0)\n"
+"    cache_prefetch_conns=N    connections prefetching may use, best kept\n"
+"                              below max_connections (default: %d)\n"
+"    cache_max_entries=N       most paths to keep (default: no limit)\n"
+"    cache_max_mem=MIB         most memory to use (default: no limit)\n"
+"    cache_snapshot=FILE       save the cache to FILE on unmount and load it\n"
+"                              back on the next mount, where what has\n"
+"                              expired is checked again, and served\n"
+"                              meanwhile within cache_stale_timeout\n"
+"    cache_snapshot_age=SECS   ignore what was learnt longer ago than this\n"
+"                              default is %d seconds\n"
+"\n", progname, DEFAULT_MAX_CONNECTIONS,
+        DEFAULT_PARALLEL_MIN_SIZE, DEFAULT_READAHEAD, DEFAULT_WRITE_BUFFER,
+        DEFAULT_STATFS_TIMEOUT, DEFAULT_DATA_CACHE_SIZE, DEFAULT_CACHE_TIMEOUT,
+        DEFAULT_CACHE_PREFETCH_CONNS, DEFAULT_CACHE_SNAPSHOT_AGE);
 }
 
 static int ftpfs_fuse_main(struct fuse_args *args) {
 #if FUSE_VERSION >= 26
-  return fuse_main(args->argc, args->argv, cache_init(&ftpfs_oper), NULL);
+  return fuse_main(args->argc, args->argv,
+                   stats_init(cache_init(&ftpfs_oper), ftpfs.stats_file), NULL);
 #else
-  return fuse_main(args->argc, args->argv, cache_init(&ftpfs_oper));
+  return fuse_main(args->argc, args->argv,
+                   stats_init(cache_init(&ftpfs_oper), ftpfs.stats_file));
 #endif
 }
 
@@ -243,7 +302,13 @@ int main(int argc, char** argv) {
   ftpfs.blksize      = 4096;
   ftpfs.disable_epsv = 1;
   ftpfs.multiconn    = 1;
-  ftpfs.attached_to_multi = 0;
+  ftpfs.max_connections = DEFAULT_MAX_CONNECTIONS;
+  ftpfs.readahead    = DEFAULT_READAHEAD;
+  ftpfs.parallel_get = 1;
+  ftpfs.parallel_min_size = DEFAULT_PARALLEL_MIN_SIZE;
+  ftpfs.write_buffer = DEFAULT_WRITE_BUFFER;
+  ftpfs.statfs_timeout = DEFAULT_STATFS_TIMEOUT;
+  ftpfs.data_cache_size = DEFAULT_DATA_CACHE_SIZE;
 
   if (fuse_opt_parse(&args, &ftpfs, ftpfs_opts, ftpfs_opt_proc) == -1)
     return 1;
@@ -254,6 +319,11 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  /* Only used once fuse_daemonize() has changed to "/" */
+  if (make_absolute(&ftpfs.data_cache) == -1 ||
+      make_absolute(&ftpfs.stats_file) == -1)
+    return 1;
+
   if (!ftpfs.iocharset) {
     ftpfs.iocharset = "UTF8";
   }
@@ -262,6 +332,12 @@ int main(int argc, char** argv) {
     convert_charsets(ftpfs.iocharset, ftpfs.codepage, &ftpfs.host);
   }
 
+  /* Before the first handle, so that all of them share its TLS session */
+  if (conn_share_init() == -1) {
+    fprintf(stderr, "Error initializing libcurl share\n");
+    return 1;
+  }
+
   easy = curl_easy_init();
   if (easy == NULL) {
     fprintf(stderr, "Error initializing libcurl\n");
@@ -298,6 +374,7 @@ int main(int argc, char** argv) {
   if (curl_res != 0)
     ftpfs_curl_easy_perform_abort();
   curl_easy_setopt_or_die(easy, CURLOPT_NOBODY, 0);
+  ftpfs_probe_features(easy);
 
   ftpfs.multi = curl_multi_init();
   if (ftpfs.multi == NULL) {
@@ -305,9 +382,26 @@ int main(int argc, char** argv) {
     return 1;
   }
 
-  ftpfs.connection = easy;
   pthread_mutex_init(&ftpfs.lock, NULL);
 
+  if (!ftpfs.multiconn) {
+    ftpfs.max_connections = 1;
+    ftpfs.parallel_get = 1;
+  }
+  conn_pool_init(ftpfs.max_connections);
+  /* Keep the connection we just logged in with */
+  conn_pool_adopt(easy);
+
+  if (ftpfs.data_cache &&
+      data_cache_init(ftpfs.data_cache, ftpfs.data_cache_size) == -1)
+    return 1;
+
+  /* A cache snapshot is of one server, as seen from one mountpoint */
+  tmp = g_strdup_printf("%s\n%s", ftpfs.host,
+                        ftpfs.symlink_prefix_len ? ftpfs.symlink_prefix : "");
+  cache_set_source(tmp);
+  g_free(tmp);
+
   /* Set the filesystem name to show the current server */
   tmp = g_strdup_printf("-ofsname=curlftpfs#%s", ftpfs.host);
   fuse_opt_insert_arg(&args, 1, tmp);
@@ -315,9 +409,10 @@ int main(int argc, char** argv) {
 
   res = ftpfs_fuse_main(&args);
 
-  cancel_previous_multi();
   curl_multi_cleanup(ftpfs.multi);
-  curl_easy_cleanup(easy);
+  conn_pool_destroy();
+  conn_share_destroy();
+  data_cache_destroy();
   curl_global_cleanup();
   fuse_opt_free_args(&args);
 
@@ -15,9 +15,12 @@
 #include "ftpfs.h"
 
 #include <limits.h>
+#include <errno.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
 #include <glib.h>
 
 /* Converts an integer value to its hex character*/
@@ -140,3 +143,36 @@ char* get_dir_path(const char* path) {
 
   return encoded;
 }
+
+/* Local paths given as options are opened after fuse_daemonize() has
+ * changed to "/", so they have to be absolute by then */
+/* IMPORTANT: be sure to free() the returned string after use */
+char* get_absolute_path(const char* path) {
+  char cwd[PATH_MAX];
+  char* abs;
+
+  if (path[0] == '/')
+    return strdup(path);
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    return NULL;
+  abs = malloc(strlen(cwd) + strlen(path) + 2);
+  if (abs)
+    sprintf(abs, "%s/%s", cwd, path);
+  return abs;
+}
+
+/* Replaces a local path option with its absolute form */
+int make_absolute(char** path) {
+  char* abs;
+
+  if (*path == NULL)
+    return 0;
+  abs = get_absolute_path(*path);
+  if (abs == NULL) {
+    fprintf(stderr, "can't resolve %s: %s\n", *path, strerror(errno));
+    return -1;
+  }
+  free(*path);
+  *path = abs;
+  return 0;
+}
@@ -5,5 +5,9 @@ char* get_file_name(const char* path);
 char* get_full_path(const char* path);
 char* get_fulldir_path(const char* path);
 char* get_dir_path(const char* path);
+/* A local path made absolute against the current directory */
+char* get_absolute_path(const char* path);
+/* Prints why and returns -1 if *path can't be resolved */
+int make_absolute(char** path);
 
 #endif   /* __CURLFTPFS_PATH_UTILS_H__ */
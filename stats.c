@@ -0,0 +1,484 @@
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include "config.h"
+
+#include <stdio.h>  /* FILE, fopen(), fprintf(), rename() */
+#include <stdlib.h> /* free() */
+#include <string.h> /* strerror() */
+#include <errno.h>  /* errno */
+#include <unistd.h> /* pipe(), read(), write(), close() */
+#include <fcntl.h>  /* fcntl(), O_NONBLOCK, FD_CLOEXEC */
+#include <signal.h> /* sigaction(), SIGUSR1 */
+#include <time.h>   /* clock_gettime(), time() */
+
+#include <pthread.h> /* pthread_*() */
+#include <glib.h>    /* g_strdup_printf(), g_free() */
+
+#include "stats.h"
+
+/* Latencies go into buckets by powers of two of microseconds, the last
+ * one taking everything from about half an hour up */
+#define STATS_BUCKETS 32
+
+struct stats_timing {
+  uint64_t calls;
+  uint64_t total_us;
+  uint64_t max_us;
+  uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats {
+  uint64_t counters[STATS_COUNTERS];
+  struct stats_timing timings[STATS_TIMERS];
+  struct fuse_operations *next_oper;
+  const char *file;
+  time_t started;
+  pthread_t thread;
+  int running;
+  int wake_fds[2];
+};
+
+static struct stats stats;
+
+static const char *const counter_names[STATS_COUNTERS] = {
+  "cache_stat_hit",
+  "cache_stat_negative",
+  "cache_stat_stale",
+  "cache_stat_miss",
+  "cache_dir_hit",
+  "cache_dir_stale",
+  "cache_dir_miss",
+  "cache_link_hit",
+  "cache_link_miss",
+  "cache_dir_refresh",
+  "cache_dir_prefetch",
+  "read_restart",
+  "read_chunk_hit",
+  "read_range",
+  "read_shared",
+  "bytes_in",
+  "bytes_out",
+};
+
+static const char *const timer_names[STATS_TIMERS] = {
+  "getattr",
+  "readlink",
+  "getdir",
+  "mknod",
+  "mkdir",
+  "symlink",
+  "unlink",
+  "rmdir",
+  "rename",
+  "chmod",
+  "chown",
+  "truncate",
+  "utime",
+  "open",
+  "read",
+  "write",
+  "statfs",
+  "flush",
+  "release",
+  "fsync",
+  "create",
+  "ftruncate",
+  "fgetattr",
+  "read_buf",
+  "ftp_list",
+  "ftp_command",
+};
+
+void stats_add(enum stats_counter counter, uint64_t n) {
+  __atomic_fetch_add(&stats.counters[counter], n, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_start(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_time(enum stats_timer timer, uint64_t start) {
+  struct stats_timing *t = &stats.timings[timer];
+  uint64_t us = stats_start() - start;
+  uint64_t max = __atomic_load_n(&t->max_us, __ATOMIC_RELAXED);
+  uint64_t v;
+  int bucket = 0;
+
+  for (v = us; v > 1 && bucket < STATS_BUCKETS - 1; v >>= 1)
+    bucket++;
+
+  __atomic_fetch_add(&t->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&t->total_us, us, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&t->buckets[bucket], 1, __ATOMIC_RELAXED);
+  /* A failed exchange updates max, for the next try */
+  while (us > max &&
+         !__atomic_compare_exchange_n(&t->max_us, &max, us, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static uint64_t stats_load(const uint64_t *p) {
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/* The upper bound of the bucket holding the given fraction of calls, or
+ * the slowest call if that was faster */
+static uint64_t stats_percentile(const struct stats_timing *t,
+                                 uint64_t calls, uint64_t max,
+                                 double fraction) {
+  uint64_t want = (uint64_t) (calls * fraction + 0.5);
+  uint64_t seen = 0;
+  int i;
+
+  for (i = 0; i < STATS_BUCKETS - 1; i++) {
+    seen += stats_load(&t->buckets[i]);
+    if (seen >= want && seen)
+      break;
+  }
+  if (i < STATS_BUCKETS - 1 && ((uint64_t) 2 << i) < max)
+    return (uint64_t) 2 << i;
+  return max;
+}
+
+static void stats_write(FILE *f) {
+  int i;
+
+  fprintf(f, "uptime %lld\n", (long long) (time(NULL) - stats.started));
+  for (i = 0; i < STATS_COUNTERS; i++)
+    fprintf(f, "%s %llu\n", counter_names[i],
+            (unsigned long long) stats_load(&stats.counters[i]));
+
+  fprintf(f, "\n%-12s %10s %10s %10s %10s %10s %10s\n", "op", "calls",
+          "avg_us", "p50_us", "p90_us", "p99_us", "max_us");
+  for (i = 0; i < STATS_TIMERS; i++) {
+    const struct stats_timing *t = &stats.timings[i];
+    uint64_t calls = stats_load(&t->calls);
+    uint64_t max = stats_load(&t->max_us);
+    if (!calls)
+      continue;
+    fprintf(f, "%-12s %10llu %10llu %10llu %10llu %10llu %10llu\n",
+            timer_names[i], (unsigned long long) calls,
+            (unsigned long long) (stats_load(&t->total_us) / calls),
+            (unsigned long long) stats_percentile(t, calls, max, 0.5),
+            (unsigned long long) stats_percentile(t, calls, max, 0.9),
+            (unsigned long long) stats_percentile(t, calls, max, 0.99),
+            (unsigned long long) max);
+  }
+}
+
+/* Writes to a file next to the real one, so that readers never see half
+ * a dump */
+static void stats_dump(void) {
+  char *tmp;
+  FILE *f;
+
+  if (stats.file == NULL) {
+    stats_write(stderr);
+    fflush(stderr);
+    return;
+  }
+
+  tmp = g_strdup_printf("%s.tmp", stats.file);
+  f = fopen(tmp, "w");
+  if (f == NULL) {
+    fprintf(stderr, "can't write stats to %s: %s\n", tmp, strerror(errno));
+    g_free(tmp);
+    return;
+  }
+  stats_write(f);
+  if (fclose(f) == EOF || rename(tmp, stats.file) == -1) {
+    fprintf(stderr, "can't write stats to %s: %s\n", stats.file,
+            strerror(errno));
+    unlink(tmp);
+  }
+  g_free(tmp);
+}
+
+static void stats_signal(int sig) {
+  int saved = errno;
+  char c = 'd';
+  (void) sig;
+  /* A full pipe already has a dump coming */
+  if (write(stats.wake_fds[1], &c, 1) == -1) {}
+  errno = saved;
+}
+
+/* Does the dumping for the signal handler, which can't */
+static void *stats_thread(void *arg) {
+  char c;
+  (void) arg;
+
+  for (;;) {
+    ssize_t n = read(stats.wake_fds[0], &c, 1);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n != 1 || c == 'q')
+      break;
+    stats_dump();
+  }
+  return NULL;
+}
+
+static void stats_thread_start(void) {
+  struct sigaction sa;
+
+  if (pipe(stats.wake_fds) == -1) {
+    fprintf(stderr, "can't create stats pipe: %s\n", strerror(errno));
+    return;
+  }
+  fcntl(stats.wake_fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(stats.wake_fds[1], F_SETFD, FD_CLOEXEC);
+  fcntl(stats.wake_fds[1], F_SETFL, O_NONBLOCK);
+
+  if (pthread_create(&stats.thread, NULL, stats_thread, NULL) != 0) {
+    fprintf(stderr, "can't start stats thread\n");
+    close(stats.wake_fds[0]);
+    close(stats.wake_fds[1]);
+    return;
+  }
+  stats.running = 1;
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = stats_signal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void stats_thread_stop(void) {
+  struct sigaction sa;
+  char c = 'q';
+
+  if (!stats.running)
+    return;
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = SIG_DFL;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  while (write(stats.wake_fds[1], &c, 1) == -1 && errno == EAGAIN)
+    usleep(1000);
+  pthread_join(stats.thread, NULL);
+  close(stats.wake_fds[0]);
+  close(stats.wake_fds[1]);
+  stats.running = 0;
+}
+
+#if FUSE_VERSION >= 26
+static void *stats_fuse_init(struct fuse_conn_info *conn)
+{
+  void *res = stats.next_oper->init ? stats.next_oper->init(conn) : NULL;
+#elif FUSE_VERSION >= 23
+static void *stats_fuse_init(void)
+{
+  void *res = stats.next_oper->init ? stats.next_oper->init() : NULL;
+#endif
+#if FUSE_VERSION >= 23
+  /* Threads don't survive daemonizing, so start here rather than in main */
+  stats_thread_start();
+  return res;
+}
+
+static void stats_fuse_destroy(void *data)
+{
+  stats_thread_stop();
+  if (stats.next_oper->destroy)
+    stats.next_oper->destroy(data);
+}
+#endif
+
+#define STATS_TIMED(timer, call)             \
+  uint64_t start = stats_start();             \
+  int res = stats.next_oper->call;            \
+  stats_time(timer, start);                   \
+  return res
+
+static int stats_getattr(const char *path, struct stat *stbuf)
+{
+  STATS_TIMED(STATS_GETATTR, getattr(path, stbuf));
+}
+
+static int stats_readlink(const char *path, char *buf, size_t size)
+{
+  STATS_TIMED(STATS_READLINK, readlink(path, buf, size));
+}
+
+static int stats_getdir(const char *path, fuse_dirh_t h, fuse_dirfil_t filler)
+{
+  STATS_TIMED(STATS_GETDIR, getdir(path, h, filler));
+}
+
+static int stats_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+  STATS_TIMED(STATS_MKNOD, mknod(path, mode, rdev));
+}
+
+static int stats_mkdir(const char *path, mode_t mode)
+{
+  STATS_TIMED(STATS_MKDIR, mkdir(path, mode));
+}
+
+static int stats_symlink(const char *from, const char *to)
+{
+  STATS_TIMED(STATS_SYMLINK, symlink(from, to));
+}
+
+static int stats_unlink(const char *path)
+{
+  STATS_TIMED(STATS_UNLINK, unlink(path));
+}
+
+static int stats_rmdir(const char *path)
+{
+  STATS_TIMED(STATS_RMDIR, rmdir(path));
+}
+
+static int stats_rename(const char *from, const char *to)
+{
+  STATS_TIMED(STATS_RENAME, rename(from, to));
+}
+
+static int stats_chmod(const char *path, mode_t mode)
+{
+  STATS_TIMED(STATS_CHMOD, chmod(path, mode));
+}
+
+static int stats_chown(const char *path, uid_t uid, gid_t gid)
+{
+  STATS_TIMED(STATS_CHOWN, chown(path, uid, gid));
+}
+
+static int stats_truncate(const char *path, off_t size)
+{
+  STATS_TIMED(STATS_TRUNCATE, truncate(path, size));
+}
+
+static int stats_utime(const char *path, struct utimbuf *buf)
+{
+  STATS_TIMED(STATS_UTIME, utime(path, buf));
+}
+
+static int stats_open(const char *path, struct fuse_file_info *fi)
+{
+  STATS_TIMED(STATS_OPEN, open(path, fi));
+}
+
+static int stats_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi)
+{
+  STATS_TIMED(STATS_READ, read(path, buf, size, offset, fi));
+}
+
+static int stats_write_op(const char *path, const char *buf, size_t size,
+                          off_t offset, struct fuse_file_info *fi)
+{
+  STATS_TIMED(STATS_WRITE, write(path, buf, size, offset, fi));
+}
+
+#if FUSE_VERSION >= 25
+static int stats_statfs(const char *path, struct statvfs *buf)
+#else
+static int stats_statfs(const char *path, struct statfs *buf)
+#endif
+{
+  STATS_TIMED(STATS_STATFS, statfs(path, buf));
+}
+
+static int stats_flush(const char *path, struct fuse_file_info *fi)
+{
+  STATS_TIMED(STATS_FLUSH, flush(path, fi));
+}
+
+static int stats_release(const char *path, struct fuse_file_info *fi)
+{
+  STATS_TIMED(STATS_RELEASE, release(path, fi));
+}
+
+static int stats_fsync(const char *path, int isdatasync,
+                       struct fuse_file_info *fi)
+{
+  STATS_TIMED(STATS_FSYNC, fsync(path, isdatasync, fi));
+}
+
+#if FUSE_VERSION >= 25
+static int stats_create(const char *path, mode_t mode,
+                        struct fuse_file_info *fi)
+{
+  STATS_TIMED(STATS_CREATE, create(path, mode, fi));
+}
+
+static int stats_ftruncate(const char *path, off_t size,
+                           struct fuse_file_info *fi)
+{
+  STATS_TIMED(STATS_FTRUNCATE, ftruncate(path, size, fi));
+}
+
+static int stats_fgetattr(const char *path, struct stat *stbuf,
+                          struct fuse_file_info *fi)
+{
+  STATS_TIMED(STATS_FGETATTR, fgetattr(path, stbuf, fi));
+}
+#endif
+
+#if FUSE_VERSION >= 29
+static int stats_read_buf(const char *path, struct fuse_bufvec **bufp,
+                          size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  STATS_TIMED(STATS_READ_BUF, read_buf(path, bufp, size, offset, fi));
+}
+#endif
+
+struct fuse_operations *stats_init(struct fuse_operations *oper,
+                                   const char *file)
+{
+  static struct fuse_operations stats_oper;
+
+  if (oper == NULL)
+    return NULL;
+  stats.next_oper = oper;
+  stats.file = file;
+  stats.started = time(NULL);
+
+  /* Whatever isn't timed is passed on as it is */
+  stats_oper = *oper;
+#if FUSE_VERSION >= 23
+  stats_oper.init       = stats_fuse_init;
+  stats_oper.destroy    = stats_fuse_destroy;
+#endif
+  stats_oper.getattr    = oper->getattr ? stats_getattr : NULL;
+  stats_oper.readlink   = oper->readlink ? stats_readlink : NULL;
+  stats_oper.getdir     = oper->getdir ? stats_getdir : NULL;
+  stats_oper.mknod      = oper->mknod ? stats_mknod : NULL;
+  stats_oper.mkdir      = oper->mkdir ? stats_mkdir : NULL;
+  stats_oper.symlink    = oper->symlink ? stats_symlink : NULL;
+  stats_oper.unlink     = oper->unlink ? stats_unlink : NULL;
+  stats_oper.rmdir      = oper->rmdir ? stats_rmdir : NULL;
+  stats_oper.rename     = oper->rename ? stats_rename : NULL;
+  stats_oper.chmod      = oper->chmod ? stats_chmod : NULL;
+  stats_oper.chown      = oper->chown ? stats_chown : NULL;
+  stats_oper.truncate   = oper->truncate ? stats_truncate : NULL;
+  stats_oper.utime      = oper->utime ? stats_utime : NULL;
+  stats_oper.open       = oper->open ? stats_open : NULL;
+  stats_oper.read       = oper->read ? stats_read : NULL;
+  stats_oper.write      = oper->write ? stats_write_op : NULL;
+  stats_oper.statfs     = oper->statfs ? stats_statfs : NULL;
+  stats_oper.flush      = oper->flush ? stats_flush : NULL;
+  stats_oper.release    = oper->release ? stats_release : NULL;
+  stats_oper.fsync      = oper->fsync ? stats_fsync : NULL;
+#if FUSE_VERSION >= 25
+  stats_oper.create     = oper->create ? stats_create : NULL;
+  stats_oper.ftruncate  = oper->ftruncate ? stats_ftruncate : NULL;
+  stats_oper.fgetattr   = oper->fgetattr ? stats_fgetattr : NULL;
+#endif
+#if FUSE_VERSION >= 29
+  stats_oper.read_buf   = oper->read_buf ? stats_read_buf : NULL;
+#endif
+  return &stats_oper;
+}
@@ -0,0 +1,81 @@
+#ifndef __CURLFTPFS_STATS_H__
+#define __CURLFTPFS_STATS_H__ 1
+
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+#include <stdint.h> /* uint64_t */
+
+#include "cache.h"  /* <struct fuse_operations>, FUSE_VERSION */
+
+/* Counters and latencies are kept all the time, at the cost of an atomic
+ * add or two, and written out on SIGUSR1. */
+
+enum stats_counter {
+  STATS_STAT_HIT,
+  STATS_STAT_NEGATIVE,    /* answered from the listing of the parent */
+  STATS_STAT_STALE,
+  STATS_STAT_MISS,
+  STATS_DIR_HIT,
+  STATS_DIR_STALE,
+  STATS_DIR_MISS,
+  STATS_LINK_HIT,
+  STATS_LINK_MISS,
+  STATS_DIR_REFRESH,      /* listings fetched in the background */
+  STATS_DIR_PREFETCH,
+  STATS_READ_RESTART,     /* download streams started again elsewhere */
+  STATS_READ_CHUNK_HIT,   /* reads away from the stream served by a handle */
+  STATS_READ_RANGE,       /* ranges fetched for them */
+  STATS_READ_SHARED,      /* opens that joined a handle already reading */
+  STATS_BYTES_IN,
+  STATS_BYTES_OUT,
+  STATS_COUNTERS
+};
+
+enum stats_timer {
+  STATS_GETATTR,
+  STATS_READLINK,
+  STATS_GETDIR,
+  STATS_MKNOD,
+  STATS_MKDIR,
+  STATS_SYMLINK,
+  STATS_UNLINK,
+  STATS_RMDIR,
+  STATS_RENAME,
+  STATS_CHMOD,
+  STATS_CHOWN,
+  STATS_TRUNCATE,
+  STATS_UTIME,
+  STATS_OPEN,
+  STATS_READ,
+  STATS_WRITE,
+  STATS_STATFS,
+  STATS_FLUSH,
+  STATS_RELEASE,
+  STATS_FSYNC,
+  STATS_CREATE,
+  STATS_FTRUNCATE,
+  STATS_FGETATTR,
+  STATS_READ_BUF,
+  /* Round trips to the server, not FUSE operations */
+  STATS_FTP_LIST,
+  STATS_FTP_COMMAND,
+  STATS_TIMERS
+};
+
+void stats_add(enum stats_counter counter, uint64_t n);
+
+/* Returns the time to pass to stats_time() once it's done */
+uint64_t stats_start(void);
+void stats_time(enum stats_timer timer, uint64_t start);
+
+/* Wraps every operation of oper so that it is timed. The dump goes to
+ * file, or to stderr if that's NULL. */
+struct fuse_operations *stats_init(struct fuse_operations *oper,
+                                   const char *file);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* Runs lookups and inserts against the metadata cache from a growing
+ * number of threads and prints one line of JSON per thread count.
+ * Arguments are passed on as cache options, e.g. -o cache_max_entries=1000 */
+
+#define _XOPEN_SOURCE 600
+#include <time.h>     /* clock_gettime() */
+#include <stdlib.h>   /* exit() */
+#include <stdio.h>    /* printf(), snprintf() */
+#include <string.h>   /* memset() */
+#include <pthread.h>  /* pthread_create() */
+
+#include "cache.h"
+
+#define BENCH_PATHS 65536
+/* Per thread */
+#define BENCH_OPS 250000
+/* One operation in this many is an insert, the rest are lookups */
+#define BENCH_INSERT_EVERY 10
+
+static struct fuse_operations *ops;
+static char *paths[BENCH_PATHS];
+static unsigned long misses;
+
+static void fill_stat(struct stat *sbuf) {
+  memset(sbuf, 0, sizeof(*sbuf));
+  sbuf->st_mode = S_IFREG | 0644;
+  sbuf->st_size = 4096;
+}
+
+/* Stands in for the server, only reached on a miss */
+static int bench_getattr(const char *path, struct stat *sbuf) {
+  (void) path;
+  fill_stat(sbuf);
+  __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker(void *arg) {
+  /* Each thread walks the paths in its own order */
+  unsigned long seed = (unsigned long) arg * 2654435761UL + 1;
+  unsigned long ops_left = (unsigned long) BENCH_OPS;
+  struct stat sbuf;
+
+  while (ops_left--) {
+    const char *path;
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    path = paths[(seed >> 33) % BENCH_PATHS];
+    if ((seed >> 20) % BENCH_INSERT_EVERY == 0) {
+      fill_stat(&sbuf);
+      cache_add_attr(path, &sbuf);
+    } else if (ops->getattr(path, &sbuf) != 0) {
+      fprintf(stderr, "getattr %s failed\n", path);
+      exit(1);
+    }
+  }
+  return NULL;
+}
+
+static void bench(unsigned nthreads) {
+  pthread_t threads[64];
+  double start, secs;
+  unsigned long ops_done = (unsigned long) BENCH_OPS * nthreads;
+  unsigned i;
+
+  misses = 0;
+  start = now();
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, worker, (void *) (long) i)) {
+      fprintf(stderr, "failed to start thread\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  secs = now() - start;
+
+  printf("{\"bench\":\"cache_getattr\",\"threads\":%u,\"ops\":%lu,"
+         "\"seconds\":%.6f,\"ops_per_sec\":%.0f,\"misses\":%lu}\n",
+         nthreads, ops_done, secs, ops_done / secs, misses);
+}
+
+int main(int argc, char **argv) {
+  static const unsigned thread_counts[] = { 1, 2, 4, 8, 16 };
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_cache_operations oper;
+  unsigned i;
+
+  memset(&oper, 0, sizeof(oper));
+  oper.oper.getattr = bench_getattr;
+
+  if (cache_parse_options(&args) == -1)
+    exit(1);
+  ops = cache_init(&oper);
+  if (ops == NULL)
+    exit(1);
+
+  /* Spread over a few directories, as a real tree would be */
+  for (i = 0; i < BENCH_PATHS; i++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/bench/dir%02u/file%05u", i % 64, i);
+    paths[i] = strdup(path);
+  }
+
+  for (i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++)
+    bench(thread_counts[i]);
+
+  cache_deinit();
+  for (i = 0; i < BENCH_PATHS; i++)
+    free(paths[i]);
+  fuse_opt_free_args(&args);
+  return 0;
+}
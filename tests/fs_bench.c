@@ -0,0 +1,212 @@
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* Times plain file operations below a directory, normally a curlftpfs
+ * mount, and prints one line of JSON per measurement:
+ *
+ *   fs_bench DIR [FILE_MB] [SMALL_FILES]
+ */
+
+#define _XOPEN_SOURCE 600
+#include <time.h>      /* clock_gettime() */
+#include <stdlib.h>    /* malloc(), qsort() */
+#include <stdio.h>     /* printf(), snprintf() */
+#include <string.h>    /* memset(), strerror() */
+#include <errno.h>     /* errno */
+#include <fcntl.h>     /* open() */
+#include <unistd.h>    /* read(), write(), pread() */
+#include <sys/stat.h>  /* stat(), mkdir() */
+
+#define BLOCK (128 * 1024)
+#define RANDOM_BLOCK 4096
+#define RANDOM_READS 256
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, const char *path) {
+  fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+  exit(1);
+}
+
+static void report_rate(const char *name, double bytes, double secs) {
+  printf("{\"bench\":\"%s\",\"bytes\":%.0f,\"seconds\":%.6f,"
+         "\"mb_per_sec\":%.2f}\n",
+         name, bytes, secs, bytes / secs / (1024 * 1024));
+}
+
+static int cmp_double(const void *a_, const void *b_) {
+  double a = *(const double *) a_, b = *(const double *) b_;
+  return a < b ? -1 : a > b;
+}
+
+/* Latencies in microseconds; sorts them */
+static void report_latency(const char *name, double *lat, unsigned n) {
+  double sum = 0;
+  unsigned i;
+
+  for (i = 0; i < n; i++)
+    sum += lat[i];
+  qsort(lat, n, sizeof(*lat), cmp_double);
+  printf("{\"bench\":\"%s\",\"ops\":%u,\"ops_per_sec\":%.1f,"
+         "\"avg_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+         name, n, n / (sum / 1e6), sum / n, lat[n / 2],
+         lat[(unsigned) (n * 0.99)], lat[n - 1]);
+}
+
+static void seq_write(const char *path, char *buf, unsigned mb) {
+  unsigned long blocks = (unsigned long) mb * 1024 * 1024 / BLOCK;
+  unsigned long i;
+  double start;
+  int fd;
+
+  start = now();
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    fail("open", path);
+  for (i = 0; i < blocks; i++) {
+    if (write(fd, buf, BLOCK) != BLOCK)
+      fail("write", path);
+  }
+  /* The upload only completes on close */
+  if (close(fd) == -1)
+    fail("close", path);
+  report_rate("seq_write", (double) blocks * BLOCK, now() - start);
+}
+
+static void seq_read(const char *path, char *buf) {
+  double start, bytes = 0;
+  ssize_t res;
+  int fd;
+
+  start = now();
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    fail("open", path);
+  while ((res = read(fd, buf, BLOCK)) > 0)
+    bytes += res;
+  if (res == -1)
+    fail("read", path);
+  close(fd);
+  report_rate("seq_read", bytes, now() - start);
+}
+
+static void random_read(const char *path, char *buf, unsigned mb) {
+  unsigned long blocks = (unsigned long) mb * 1024 * 1024 / RANDOM_BLOCK;
+  unsigned long seed = 1;
+  double start, lat[RANDOM_READS];
+  double total_start;
+  unsigned i;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    fail("open", path);
+  total_start = now();
+  for (i = 0; i < RANDOM_READS; i++) {
+    off_t off;
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    off = (off_t) ((seed >> 33) % blocks) * RANDOM_BLOCK;
+    start = now();
+    if (pread(fd, buf, RANDOM_BLOCK, off) != RANDOM_BLOCK)
+      fail("pread", path);
+    lat[i] = (now() - start) * 1e6;
+  }
+  report_rate("random_read", (double) RANDOM_READS * RANDOM_BLOCK,
+              now() - total_start);
+  report_latency("random_read_latency", lat, RANDOM_READS);
+  close(fd);
+}
+
+static void small_files(const char *dir, char *buf, unsigned n) {
+  double *lat = malloc(n * sizeof(*lat));
+  char path[4096 + 16];
+  struct stat sbuf;
+  double start;
+  unsigned i;
+
+  if (lat == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    fail("mkdir", dir);
+
+  for (i = 0; i < n; i++) {
+    int fd;
+    snprintf(path, sizeof(path), "%s/small%05u", dir, i);
+    start = now();
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+      fail("open", path);
+    if (write(fd, buf, 1024) != 1024)
+      fail("write", path);
+    if (close(fd) == -1)
+      fail("close", path);
+    lat[i] = (now() - start) * 1e6;
+  }
+  report_latency("small_create", lat, n);
+
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/small%05u", dir, i);
+    start = now();
+    if (stat(path, &sbuf) == -1)
+      fail("stat", path);
+    lat[i] = (now() - start) * 1e6;
+  }
+  report_latency("stat", lat, n);
+
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/small%05u", dir, i);
+    unlink(path);
+  }
+  rmdir(dir);
+  free(lat);
+}
+
+int main(int argc, char **argv) {
+  const char *base;
+  unsigned mb, files;
+  char path[4096];
+  char *buf;
+  unsigned i;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s DIR [FILE_MB] [SMALL_FILES]\n", argv[0]);
+    return 1;
+  }
+  base = argv[1];
+  mb = argc > 2 ? atoi(argv[2]) : 64;
+  files = argc > 3 ? atoi(argv[3]) : 200;
+  if (mb == 0 || files == 0) {
+    fprintf(stderr, "FILE_MB and SMALL_FILES must be positive\n");
+    return 1;
+  }
+
+  buf = malloc(BLOCK);
+  if (buf == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (i = 0; i < BLOCK; i++)
+    buf[i] = (char) (i * 31);
+
+  snprintf(path, sizeof(path), "%s/fs_bench.dat", base);
+  seq_write(path, buf, mb);
+  seq_read(path, buf);
+  random_read(path, buf, mb);
+  unlink(path);
+
+  snprintf(path, sizeof(path), "%s/fs_bench.dir", base);
+  small_files(path, buf, files);
+
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,120 @@
+/*
+    FTP file system
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* Parses synthetic listings of growing size and prints one line of JSON
+ * per listing format and size */
+
+#define _XOPEN_SOURCE 600
+#include <time.h>   /* clock_gettime() */
+#include <stdlib.h> /* malloc(), atol() */
+#include <stdio.h>  /* printf(), snprintf() */
+#include <string.h> /* memcpy() */
+
+#include "ftpfs.h"
+#include "ftpfs-ls.h"
+
+struct ftpfs ftpfs;
+
+static unsigned long filled;
+
+static int count(fuse_cache_dirh_t h, const char *name,
+                 const struct stat *sbuf) {
+  (void) h;
+  (void) name;
+  (void) sbuf;
+  filled++;
+  return 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Mostly files, with every tenth a directory and every fiftieth a link */
+static size_t make_line(char *p, size_t size, int mlsd, unsigned long i) {
+  if (mlsd) {
+    if (i % 10 == 0)
+      return snprintf(p, size, "type=dir;modify=20240112102000;"
+                      "UNIX.mode=0755; dir%06lu\r\n", i);
+    return snprintf(p, size, "type=file;size=%lu;modify=20240112102000;"
+                    "UNIX.mode=0644; file%06lu.txt\r\n", i * 37, i);
+  }
+  if (i % 50 == 0)
+    return snprintf(p, size, "lrwxrwxrwx    1 1137     1100           14 "
+                    "Mar 12  2004 link%06lu -> Science/molbio\r\n", i);
+  if (i % 10 == 0)
+    return snprintf(p, size, "drwxr-xr-x    2 ftp      ftp          4096 "
+                    "Jan 12 10:20 dir%06lu\r\n", i);
+  return snprintf(p, size, "-rw-r--r--    1 ftp      ftp      %10lu "
+                  "Jan 12 10:20 file%06lu.txt\r\n", i * 37, i);
+}
+
+static char *make_list(int mlsd, unsigned long lines, size_t *len) {
+  size_t size = lines * 96 + 1;
+  char *list = malloc(size);
+  size_t off = 0;
+  unsigned long i;
+
+  if (list == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < lines; i++)
+    off += make_line(list + off, size - off, mlsd, i);
+  *len = off;
+  return list;
+}
+
+static void bench(const char *name, int mlsd, unsigned long lines) {
+  size_t len;
+  char *list = make_list(mlsd, lines, &len);
+  /* Small listings are parsed over and over for a steadier figure */
+  unsigned long rounds = lines >= 1000000 ? 1 : 1000000 / lines;
+  unsigned long r;
+  double start, secs;
+  /* The filler is only called with a handle; count() doesn't look at it */
+  fuse_cache_dirh_t h = (fuse_cache_dirh_t) &filled;
+
+  filled = 0;
+  start = now();
+  for (r = 0; r < rounds; r++) {
+    if (mlsd)
+      parse_dir_mlsd(list, "/bench/", NULL, NULL, NULL, 0, h, count);
+    else
+      parse_dir(list, "/bench/", NULL, NULL, NULL, 0, h, count);
+  }
+  secs = now() - start;
+
+  if (filled != lines * rounds) {
+    fprintf(stderr, "%s: parsed %lu entries out of %lu\n", name,
+            filled, lines * rounds);
+    exit(1);
+  }
+  printf("{\"bench\":\"%s\",\"lines\":%lu,\"rounds\":%lu,\"seconds\":%.6f,"
+         "\"lines_per_sec\":%.0f,\"mb_per_sec\":%.2f}\n",
+         name, lines, rounds, secs, lines * rounds / secs,
+         len * rounds / secs / (1024 * 1024));
+  free(list);
+}
+
+int main(int argc, char **argv) {
+  static const unsigned long sizes[] = { 10000, 100000, 1000000 };
+  unsigned long max = argc > 1 ? atol(argv[1]) : 1000000;
+  size_t i;
+
+  ftpfs.blksize = 4096;
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    if (sizes[i] > max)
+      break;
+    bench("parse_unix", 0, sizes[i]);
+    bench("parse_mlsd", 1, sizes[i]);
+  }
+  return 0;
+}
@@ -15,6 +15,7 @@
 
 #include "ftpfs.h"
 #include "ftpfs-ls.h"
+#include "charset_utils.h"
 
 struct ftpfs ftpfs;
 
@@ -49,6 +50,15 @@ struct ftpfs ftpfs;
     check_numeric_is(sbuf.st_mtime,   _tt,       "lld", long long); \
   } while (0)
 
+static char filled[256];
+
+static int fill(fuse_cache_dirh_t h, const char *name, const struct stat *sbuf) {
+  (void) h;
+  strcat(filled, name);
+  strcat(filled, S_ISDIR(sbuf->st_mode) ? "/|" : "|");
+  return 0;
+}
+
 int main(int argc, char **argv) {
   const char *list;
   char line[256];
@@ -152,6 +162,169 @@ int main(int argc, char **argv) {
   assert(err == 0);
   check(sbuf, 0, 0, S_IFREG|S_IRUSR|S_IWUSR, 1, 0, 0, 0, 6561177600LL, 4096, 12814800, "00:00:00 15/10/2005");
 
+  /* MLSD times are UTC, so check them as they are */
+  list = "type=cdir;modify=20050921143000;UNIX.mode=0755; /pub\r\n"
+         "type=pdir;modify=20050921143000;UNIX.mode=0755; /\r\n"
+         "type=file;size=40448;modify=20050921143000;UNIX.mode=0644; PR_AU13_CH.doc\r\n";
+  err = parse_dir_mlsd(list, "/", "PR_AU13_CH.doc", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 0);
+  check_numeric_is(sbuf.st_mode, S_IFREG|S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH, "lld", long long);
+  check_numeric_is(sbuf.st_size, 40448, "lld", long long);
+  check_numeric_is(sbuf.st_blocks, 80, "lld", long long);
+  check_numeric_is(sbuf.st_mtime, 1127313000, "lld", long long);
+
+  err = parse_dir_mlsd(list, "/", "pub", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 1);
+
+  list = "Type=dir;Sizd=4096;Modify=19991231235959.123;Perm=flcdmpe; with space; and=equals\r\n";
+  err = parse_dir_mlsd(list, "/", "with space; and=equals", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 0);
+  check_numeric_is(sbuf.st_mode, S_IFDIR|0755, "lld", long long);
+  check_numeric_is(sbuf.st_size, 4096, "lld", long long);
+  check_numeric_is(sbuf.st_mtime, 946684799, "lld", long long);
+
+  list = "type=OS.unix=slink:Science/molbio;modify=20240229000001; molbio\r\n";
+  err = parse_dir_mlsd(list, "/", "molbio", &sbuf, linkbuf, 1024, NULL, NULL);
+  assert(err == 0);
+  assert(!strcmp(linkbuf, "Science/molbio"));
+  check_numeric_is(sbuf.st_mode, S_IFLNK|0777, "lld", long long);
+  check_numeric_is(sbuf.st_mtime, 1709164801, "lld", long long);
+
+  list = "type=file;size=6561177600;modify=20051015000000;UNIX.mode=0600; home.backup.tar\r\n";
+  err = parse_dir_mlsd(list, "/", "home.backup.tar", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 0);
+  check_numeric_is(sbuf.st_size, 6561177600LL, "lld", long long);
+  check_numeric_is(sbuf.st_blocks, 12814800, "lld", long long);
+
+  /* MLST has the facts on the one line that starts with a space */
+  list = "250 CWD command successful\r\n"
+         "250-Listing /pub/molbio\r\n"
+         " type=OS.unix=slink:/Science/molbio;modify=20240229000001; /pub/molbio\r\n"
+         "250 End\r\n";
+  linkbuf[0] = '\0';
+  err = parse_mlst(list, "/pub/molbio", &sbuf, linkbuf, 1024);
+  assert(err == 0);
+  assert(!strcmp(linkbuf, "/Science/molbio"));
+  check_numeric_is(sbuf.st_mode, S_IFLNK|0777, "lld", long long);
+  check_numeric_is(sbuf.st_mtime, 1709164801, "lld", long long);
+
+  list = "250-Listing pub\r\n"
+         " Type=cdir;Modify=20050921143000;UNIX.mode=0711; /pub\r\n"
+         "250 End\r\n";
+  err = parse_mlst(list, "/pub", &sbuf, NULL, 0);
+  assert(err == 0);
+  check_numeric_is(sbuf.st_mode, S_IFDIR|0711, "lld", long long);
+
+  err = parse_mlst("250 CWD command successful\r\n", "/pub", &sbuf, NULL, 0);
+  assert(err == 1);
+
+  /* Several entries in one listing, the names getting shorter and longer */
+  list = "drwxr-xr-x   2 user group     4096 Jan 01  2001 a_rather_long_directory_name\r\n"
+         "-rw-r--r--   1 user group       10 Jan 01  2001 b\n"
+         "garbage\r\n"
+         "lrwxrwxrwx   1 user group        4 Jan 01  2001 c -> /abs -> x\r\n"
+         "05-22-03  12:13PM                   12 d e\r\n";
+  err = parse_dir(list, "/dir/", "c", &sbuf, linkbuf, 1024, NULL, NULL);
+  assert(err == 0);
+  assert(!strcmp(linkbuf, "/abs -> x"));
+  check(sbuf, 0, 0, S_IFLNK|S_IRWXU|S_IRWXG|S_IRWXO, 1, 0, 0, 0, 4, 4096, 8, "00:00:00 01/01/2001");
+
+  err = parse_dir(list, "/dir/", "d e", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 0);
+  check(sbuf, 0, 0, S_IFREG, 1, 0, 0, 0, 12, 4096, 8, "12:13:00 22/05/2003");
+
+  err = parse_dir(list, "/dir/", NULL, NULL, NULL, 0, (fuse_cache_dirh_t) 1, fill);
+  assert(err == 1);
+  assert(!strcmp(filled, "a_rather_long_directory_name/|b|c|d e|"));
+
+  strcpy(ftpfs.symlink_prefix, "/mnt");
+  ftpfs.symlink_prefix_len = 4;
+  err = parse_dir(list, "/dir/", "c", &sbuf, linkbuf, 1024, NULL, NULL);
+  assert(err == 0);
+  assert(!strcmp(linkbuf, "/mnt/abs -> x"));
+  err = parse_dir(list, "/dir/", "c", &sbuf, linkbuf, 8, NULL, NULL);
+  assert(err == 0);
+  assert(!strcmp(linkbuf, "/mnt/ab"));
+  ftpfs.symlink_prefix_len = 0;
+
+  /* Lines that stop short of a name */
+  list = "-rw-r--r--   1 user group       10 Jan 01  2001\r\n"
+         "-rw-r--r--   1 user group       10 Jan 01  2001 \r\n";
+  err = parse_dir(list, "/", "", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 0);
+  filled[0] = '\0';
+  err = parse_dir(list, "/", NULL, NULL, NULL, 0, (fuse_cache_dirh_t) 1, fill);
+  assert(filled[0] == '\0');
+
+  /* Free space, after the replies from logging in */
+  {
+    struct ftp_space space = { -1, -1, -1, -1 };
+    err = parse_avbl("230 Logged in\r\n"
+                     "250 CWD command successful\r\n"
+                     "213 6561177600\r\n", &space);
+    assert(err == 0);
+    check_numeric_is(space.bytes_free, 6561177600LL, "lld", long long);
+    check_numeric_is(space.bytes, -1, "lld", long long);
+
+    err = parse_avbl("250 CWD command successful\r\n", &space);
+    assert(err == 1);
+
+    err = parse_quota("250 CWD command successful\r\n"
+                      "200-The current quota for this session are [current/limit]:\r\n"
+                      "200-Name: robson\r\n"
+                      "200-Quota Type: User\r\n"
+                      "200-  Uploaded Mb:\t12.50/100.00\r\n"
+                      "200-  Downloaded Mb:\tunlimited\r\n"
+                      "200-  Uploaded files:\t3/10\r\n"
+                      "200 Please contact root if these entries are inaccurate\r\n",
+                      &space);
+    assert(err == 0);
+    check_numeric_is(space.bytes, 100LL * 1024 * 1024, "lld", long long);
+    check_numeric_is(space.bytes_free, 87.5 * 1024 * 1024, "lld", long long);
+    check_numeric_is(space.files, 10, "lld", long long);
+    check_numeric_is(space.files_free, 7, "lld", long long);
+
+    space.bytes = space.bytes_free = space.files = space.files_free = -1;
+    err = parse_quota("200-  Uploaded bytes: unlimited\r\n"
+                      "200-  Uploaded files: unlimited\r\n"
+                      "200 End\r\n", &space);
+    assert(err == 1);
+    check_numeric_is(space.bytes_free, -1, "lld", long long);
+  }
+
+  /* Listings in the server's codepage; ASCII is left where it is */
+  ftpfs.codepage = "ISO-8859-1";
+  ftpfs.iocharset = "UTF-8";
+  list = "-rw-r--r--   1 user group       10 Jan 01  2001 caf\xe9\r\n"
+         "-rw-r--r--   1 user group       10 Jan 01  2001 plain\r\n";
+  err = parse_dir(list, "/", "caf\xc3\xa9", &sbuf, NULL, 0, NULL, NULL);
+  assert(err == 0);
+  check_numeric_is(sbuf.st_size, 10, "lld", long long);
+  filled[0] = '\0';
+  err = parse_dir(list, "/", NULL, NULL, NULL, 0, (fuse_cache_dirh_t) 1, fill);
+  assert(!strcmp(filled, "caf\xc3\xa9|plain|"));
+
+  list = "250-Listing\r\n"
+         " type=file;size=7;modify=20050921143000; /caf\xe9\r\n"
+         "250 End\r\n";
+  err = parse_mlst(list, "/caf\xc3\xa9", &sbuf, NULL, 0);
+  assert(err == 0);
+  check_numeric_is(sbuf.st_size, 7, "lld", long long);
+
+  {
+    char *s = strdup("plain");
+    const char *before = s;
+    convert_charsets(ftpfs.iocharset, ftpfs.codepage, &s);
+    assert(s == before);
+    free(s);
+    s = strdup("caf\xc3\xa9");
+    convert_charsets(ftpfs.iocharset, ftpfs.codepage, &s);
+    assert(!strcmp(s, "caf\xe9"));
+    free(s);
+  }
+  ftpfs.codepage = NULL;
+  ftpfs.iocharset = NULL;
+
   fuse_opt_free_args(&args);
 
   cache_deinit();